@@ -3,30 +3,136 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
 #include <math.h>
 
 #include "file_service.h"
 #include "common.h"
+#include "histogram.h"
+#include "result_stream.h"
+#include "verify.h"
+#include "workload.h"
+
+/**
+   How requests arrive in open-loop mode: evenly spaced, as a Poisson process,
+   or in bursts sent back to back, with the bursts arriving as a Poisson
+   process
+ */
+enum arrival { ARRIVAL_CONST, ARRIVAL_POISSON, ARRIVAL_BURSTY };
+
+/* requests in a burst, by default */
+#define DEFAULT_BURST 16
+
+/* longest an open-loop thread sleeps between looking for responses, in ns */
+#define OPEN_LOOP_POLL_NS 10000
+
+/* a ramp stage is saturated if it achieved less than this share of its
+   offered rate, or its p99 latency is this many times the first stage's */
+#define RAMP_MIN_ACHIEVED 0.9
+#define RAMP_MAX_P99_GROWTH 10
+
+/* most stages in a ramp */
+#define RAMP_MAX_STAGES 100
+
+/* most distinct wrong sectors reported by number */
+#define MAX_REPORTED_MISMATCHES 16
+
+/**
+   The offered load: closed loop if rate is 0, and otherwise requests sent at
+   rate per second for the whole client, whether or not earlier ones have been
+   answered. With a ramp, the rate starts there and goes up by rampStep every
+   stageMs until the server cannot keep up.
+ */
+struct open_loop {
+  double rate;
+  enum arrival arrival;
+  int burst;
+  double rampStep;
+  int stageMs;
+};
+
+/**
+   A ramp's state, shared by the worker threads. They run each stage together,
+   and the last one to finish it judges it.
+ */
+struct ramp {
+  pthread_barrier_t barrier;
+  struct client_worker_data *workers;
+  int numOfWorkers;
+  struct open_loop *load;
+  int stage;
+  double rate;			// offered by the stage being run
+  int stageRequests;		// per thread
+  double firstP99;
+  double knee;			// highest rate kept up with, or 0
+  int stop;
+};
+
+/**
+   Latencies of a set of requests, and when the first was sent and the last
+   answered
+ */
+struct latencies {
+  struct histogram *hist;
+  long first;			// ns, or -1 before any
+  long last;
+};
+
+/**
+   A sector that did not hold what it should have, and how many times it
+   was read so
+ */
+struct mismatch {
+  int volume;
+  int sector;
+  uint64_t count;
+};
 
 /**
    struct to pass data from main thread to worker thread
  */
 struct client_worker_data{
-  struct fs_process_sring *ring;
-  struct sector_limits *limits;
+  struct fs_process_shm *shm;
+  struct fs_doorbell *bell;
+  struct fs_volumes *volumes;
+  int volume;
   int numOfRequest;
-  struct client_worker_result *result;
+  int queueDepth;
+  int op;
+  int sectorsPerRequest;
+  int writePercent;
+  int flushEvery;
+  struct open_loop *load;
+  double rate;			// its share of the open-loop rate
+  struct ramp *ramp;		// or NULL
+  struct workload **workloads;	// per volume, where its requests go
+  struct wl_cursor cursors[FS_MAX_VOLUMES];
+  struct wl_rng rng;
+  int burstLeft;
+  int stageEnd;			// requests up to the end of the ramp stage
+  struct latencies total;	// of all its requests
+  struct latencies stage;	// of the ramp stage being run
+  struct client_worker_result *slots;	// one per request in flight
+  struct result_stream **streams;	// per volume, or NULL
+  struct verifier **verifiers;		// per volume, or NULL
+  uint64_t checked;			// sectors verified
+  uint64_t mismatches;			// and found wrong
+  struct mismatch bad[MAX_REPORTED_MISMATCHES];	// the first of them
+  int nbad;
 };
 
 /** 
-    struct to store data of each response received 
+    struct to store data of each request in flight
 */
 struct client_worker_result{
   struct timespec startTime;
   struct timespec endTime;
   struct timespec time;
-  int sectorNum;
-  struct sector_data data;
+  int op;
+  int volume;
+  int buf;
+  int count;
+  int sectorNum[FS_MAX_SECTORS];
 };
 
 int timespec_subtract (struct timespec *result, struct timespec *start, struct timespec *end)
@@ -94,167 +200,584 @@ long convertToNanoSec(struct timespec *ts){
   return result;
 }
 
+static void resetLatencies(struct latencies *l){
+	histogram_reset(l->hist);
+	l->first = -1;
+	l->last = -1;
+}
+
+static void initLatencies(struct latencies *l){
+	l->hist = emalloc(sizeof(*l->hist));
+	resetLatencies(l);
+}
+
+static void recordLatency(struct latencies *l,
+			  struct client_worker_result *result){
+	long start = convertToNanoSec(&result->startTime);
+	long end = convertToNanoSec(&result->endTime);
+	histogram_record(l->hist, convertToNanoSec(&result->time));
+	if(l->first == -1 || start < l->first){
+		l->first = start;
+	}
+	if(end > l->last){
+		l->last = end;
+	}
+}
+
+static void mergeLatencies(struct latencies *into, struct latencies *from){
+	histogram_merge(into->hist, from->hist);
+	if(from->first != -1 && (into->first == -1 || from->first < into->first)){
+		into->first = from->first;
+	}
+	if(from->last > into->last){
+		into->last = from->last;
+	}
+}
+
+static double getReqPerSec(struct latencies *l){
+	if(l->last <= l->first){
+		return 0;
+	}
+	return l->hist->count / ((l->last - l->first) / 1e9);
+}
+
 /**
-   calculate average time from client_worker_result
-*/
-static double getTimeAvg(struct client_worker_result * result, int numOfItem){
-	int i = 0;
-	struct timespec total;
-	total.tv_sec = 0;
-	total.tv_nsec=0;
+   Opens the stream of results of volume to 2 files:
+   read.<client_pid> -> binary file, data from server
+   sectors.<client_pid> -> sector numbers, line break separated
+   For volumes other than the first, the file names end in .<volume>
+ */
+static struct result_stream *openResults(int volume){
+	char fReadName[60], fSectorName[60];
+	if(volume == 0){
+	  sprintf(fReadName, "./read.%d", getpid());
+	  sprintf(fSectorName, "./sectors.%d", getpid());
+	}
+	else{
+	  sprintf(fReadName, "./read.%d.%d", getpid(), volume);
+	  sprintf(fSectorName, "./sectors.%d.%d", getpid(), volume);
+	}
+	struct result_stream *rs = result_stream_open(fReadName, fSectorName,
+						      RS_DEFAULT_BYTES);
+	if(!rs){
+		fail_en(fReadName);
+	}
+	return rs;
+}
+
+/* Registers this client with the file server, asking for the share of it in
+ * `req`. On return, the server will have created a ring buffer for us to use,
+ * and we will know the served volumes and their sector limits. */
+static struct fs_volumes register_with_server(struct fs_registration *req)
+{
+	struct fs_registrar_sring *reg = shm_map(shm_registrar_name, sizeof(*reg));
+	struct fs_volumes rsp;
 
-	for(i = 0; i<numOfItem; i++){
-	  timespec_add(&total, &total, &result[i].time);
+	req->pid = getpid();
+	RB_MAKE_REQUEST(fs_registrar, reg, req, &rsp);
+
+	checkpoint("Client Reg: requested %d, recieved %d volumes, the first "
+		   "(%d, %d)", req->pid, rsp.count, rsp.limits[0].start,
+		   rsp.limits[0].end);
+	shm_unmap(reg, sizeof(*reg));
+
+	return rsp;
+}
+
+/**
+   Fill in a request for result, picking its volume at random, unless the
+   worker sticks to one, and its sectors from the volume's workload. It is a write
+   writePercent percent of the time, with its data in buffers claimed from the
+   pool, and a flush of a volume after every flushEvery writes to it.
+   Returns -1 if the pool has no room for a write's data.
+ */
+static int makeRequest(struct client_worker_data *workerData,
+		       struct client_worker_result *result,
+		       struct fs_request *req, int *writes){
+	int volume = workerData->volume >= 0 ? workerData->volume :
+		     wl_rng_below(&workerData->rng, workerData->volumes->count);
+	struct sector_limits *sector = &workerData->volumes->limits[volume];
+	struct workload *workload = workerData->workloads[volume];
+	struct wl_cursor *cursor = &workerData->cursors[volume];
+	struct wl_rng *rng = &workerData->rng;
+	req->op = workerData->op;
+	req->volume = volume;
+	req->count = result->count;
+	req->buf = -1;
+	result->volume = volume;
+	if(workerData->flushEvery && writes[volume] >= workerData->flushEvery){
+		req->op = FS_FLUSH;
+		result->count = 0;
+		writes[volume] = 0;
+	}
+	else if((int)wl_rng_below(rng, 100) < workerData->writePercent){
+		req->op = FS_WRITE;
+		req->buf = fs_pool_alloc(workerData->shm,
+					 FS_POOL_BUFFERS_FOR(req->count));
+		if(req->buf == -1){
+			return -1;
+		}
+		++writes[volume];
 	}
-	
-	return (double)convertToNanoSec(&total)/numOfItem;
+	result->op = req->op;
+	result->buf = req->buf;
+	switch(req->op){
+	case FS_FLUSH:
+		break;
+	case FS_WRITE:
+		req->sector = workload_next(workload, cursor, rng, req->count) +
+			      sector->start;
+		for(int i=0; i<req->count; i++){
+			char *data = workerData->shm->pool[req->buf] +
+				     i * SECTOR_SIZE;
+			verify_fill(data, req->sector + i);
+			result->sectorNum[i] = req->sector + i;
+		}
+		break;
+	case FS_READ_RANGE:
+		req->sector = workload_next(workload, cursor, rng, req->count) +
+			      sector->start;
+		for(int i=0; i<req->count; i++){
+			result->sectorNum[i] = req->sector + i;
+		}
+		break;
+	case FS_READ_VEC:
+		for(int i=0; i<req->count; i++){
+			req->vec[i] = workload_next(workload, cursor, rng, 1) +
+				      sector->start;
+			result->sectorNum[i] = req->vec[i];
+		}
+		break;
+	default:
+		req->sector = workload_next(workload, cursor, rng, 1) +
+			      sector->start;
+		result->sectorNum[0] = req->sector;
+	}
+	return 0;
 }
 
-/** 
-   find max time from client_worker_result
-*/
-static long getTimeMax(struct client_worker_result * result, int numOfItem){
-        int i = 0;
-	struct timespec max = result[i].time;
-	
-	for(i = 0; i<numOfItem; i++){
-	  if(timespec_compare(&max, &result[i].time) == -1) {
-	    max = result[i].time;
-	  }
-	}
-	return (long)convertToNanoSec(&max);
+/**
+   Counts count more mismatches of sector of volume in bad, which holds
+   *nbad of up to max distinct sectors; a new sector is dropped if there is
+   no room for it
+ */
+static void addMismatch(struct mismatch *bad, int *nbad, int max, int volume,
+			int sector, uint64_t count){
+	for(int i=0; i<*nbad; i++){
+		if(bad[i].volume == volume && bad[i].sector == sector){
+			bad[i].count += count;
+			return;
+		}
+	}
+	if(*nbad < max){
+		bad[*nbad].volume = volume;
+		bad[*nbad].sector = sector;
+		bad[*nbad].count = count;
+		(*nbad)++;
+	}
 }
 
-/** 
-   find min time from client_worker_result
-*/
-static long getTimeMin(struct client_worker_result * result, int numOfItem){
-        int i = 0;
-	struct timespec min = result[i].time;
-	
-	for(i = 0; i<numOfItem; i++){
-	  if(timespec_compare(&min, &result[i].time) == 1) {
-	    min = result[i].time;
-	  }
-	}
-	return (long)convertToNanoSec(&min);
+/**
+   Checks the data a read returned against what the volume's verifier
+   expects, counting the sectors that are wrong
+ */
+static void verifyRead(struct client_worker_data *workerData,
+		       struct client_worker_result *result, const char *data){
+	struct verifier *v = workerData->verifiers[result->volume];
+	for(int i=0; i<result->count; i++){
+		int sector = result->sectorNum[i];
+		if(verifier_check(v, sector, data + i * SECTOR_SIZE)){
+			continue;
+		}
+		addMismatch(workerData->bad, &workerData->nbad,
+			    MAX_REPORTED_MISMATCHES, result->volume, sector, 1);
+		workerData->mismatches++;
+	}
+	workerData->checked += result->count;
 }
 
-/** 
-   calculate standard deviation of client_worker_result time data 
-*/
-static double getTimeStdDev(struct client_worker_result *result, int numOfItem, double avg) {
-        int i;
-	double diffSq[numOfItem];
-	double stdDev;
-	double total = 0;
-	for(i = 0; i<numOfItem; i++){
-	  diffSq[i] = pow((convertToNanoSec(&result[i].time) - avg), 2);
-	}
-	
-	for(i=0; i<numOfItem; i++){
-	  total = total + diffSq[i];
-	}
-
-	stdDev = sqrt(total/numOfItem);
-	
-	return stdDev;
+/**
+   Records the response to the request of result, verifying a read's data
+   and streaming its sectors and data to the volume's result files, and
+   giving back its buffers
+ */
+static void finishRequest(struct client_worker_data *workerData,
+			  struct client_worker_result *result,
+			  struct fs_response *rsp){
+	struct result_stream *rs = workerData->streams ?
+				   workerData->streams[result->volume] : NULL;
+	clock_gettime(CLOCK_MONOTONIC, &result->endTime);
+	timespec_subtract(&result->time, &result->startTime, &result->endTime);
+	recordLatency(&workerData->total, result);
+	if(workerData->ramp){
+		recordLatency(&workerData->stage, result);
+	}
+	if(rsp->error){
+		fprintf(stderr, "Request failed: %s\n", strerror(rsp->error));
+	}
+	else if(result->count){
+		int buf = result->op == FS_WRITE ? result->buf : rsp->buf;
+		char *data = workerData->shm->pool[buf];
+		if(workerData->verifiers && result->op != FS_WRITE){
+			verifyRead(workerData, result, data);
+		}
+		if(rs){
+			result_stream_append(rs, result->sectorNum, data,
+					     result->count);
+		}
+	}
+	if(result->op == FS_WRITE){
+		fs_pool_release(workerData->shm, result->buf,
+				FS_POOL_BUFFERS_FOR(result->count));
+	}
+	else if(!rsp->error && result->op != FS_FLUSH){
+		fs_pool_release(workerData->shm, rsp->buf, rsp->nbufs);
+	}
+}
+
+/**
+   Tells the server about the requests just submitted
+ */
+static void signalSubmits(struct client_worker_data *workerData){
+	RB_SIGNAL_SUBMITS(fs_process, &workerData->shm->ring);
+	if(workerData->bell){
+		fs_ring_doorbell(workerData->bell);
+	}
+}
+
+/**
+   Closed loop: keeps up to queueDepth requests in flight on the ring, each
+   tagged with the index of its result in the worker's slots, and sends
+   another each time one is answered, until numOfRequest have been
+ */
+static void closedLoop(struct client_worker_data *workerData,
+		       int numOfRequest){
+	struct fs_process_sring *ring = &workerData->shm->ring;
+	int queueDepth = workerData->queueDepth;
+	int count = workerData->sectorsPerRequest;
+
+	uint32_t tickets[FS_PROCESS_SLOT_COUNT];
+	int inFlight = 0;
+	int next = 0;
+	int completed = 0;
+	int writes[FS_MAX_VOLUMES] = { 0 };
+	struct client_worker_result *slots = workerData->slots;
+	int freeSlots[FS_PROCESS_SLOT_COUNT];
+	int nFree = queueDepth;
+	for(int i=0; i<queueDepth; i++){
+		freeSlots[i] = i;
+	}
+	struct fs_request req;
+	struct client_worker_result *result = NULL;	// of req, if not yet sent
+	while(completed < numOfRequest){
+		/* fill the pipeline */
+		int submitted = 0;
+		while(next < numOfRequest && inFlight < queueDepth){
+			if(!result){
+				result = &slots[freeSlots[nFree - 1]];
+				result->count = count;
+				if(makeRequest(workerData, result, &req, writes)){
+					result = NULL;
+					if(inFlight){
+						break; // pool full, reap first
+					}
+					sched_yield(); // other writes hold it
+					continue;
+				}
+				nFree--;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &result->startTime);
+			if(inFlight == 0){
+				/* holding no slots, so it is safe to wait for one */
+				tickets[inFlight] = RB_SUBMIT_QUIET(fs_process,
+								    ring, &req,
+								    result - slots);
+			}
+			else if(RB_TRY_SUBMIT_QUIET(fs_process, ring, &req,
+						    result - slots,
+						    &tickets[inFlight])){
+				break; // ring full, reap something first
+			}
+			result = NULL;
+			inFlight++;
+			next++;
+			submitted++;
+		}
+		/* one signal tells the server about the whole batch. Only
+		   the first submit can block, so nothing waits on a request
+		   the server has not been told about. */
+		if(submitted){
+			signalSubmits(workerData);
+		}
+
+		struct fs_response rsp;
+		uint64_t tag;
+		int i = RB_WAIT_ANY(fs_process, ring, tickets, inFlight, &rsp, &tag);
+		finishRequest(workerData, &slots[tag], &rsp);
+		freeSlots[nFree++] = tag;
+		tickets[i] = tickets[--inFlight];
+		completed++;
+	}
 }
 
-static double getReqPerSec(struct client_worker_result *result, int numOfItem){
-  struct timespec diff;
-  timespec_subtract(&diff, &result[0].startTime, &result[numOfItem-1].endTime);
-  return numOfItem/(convertToNanoSec(&diff)/1000000000.);
+/**
+   Seconds from one request (or burst of them) to the next, for requests
+   arriving at rate per second
+ */
+static double nextArrival(struct client_worker_data *workerData, double rate){
+	struct open_loop *load = workerData->load;
+	switch(load->arrival){
+	case ARRIVAL_CONST:
+		return 1 / rate;
+	case ARRIVAL_POISSON:
+		return -log(1 - wl_rng_double(&workerData->rng)) / rate;
+	default:
+		if(--workerData->burstLeft > 0){
+			return 0;
+		}
+		workerData->burstLeft = load->burst;
+		return -log(1 - wl_rng_double(&workerData->rng)) * load->burst /
+		       rate;
+	}
 }
 
+static void timespecAddNs(struct timespec *ts, long long ns){
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
 
 /**
-   write client_worker_result data to 2 files:
-   read.<client_pid> -> sector numbers, line break separated
-   write.<client_pid> -> binary file, data from server
+   Open loop: sends numOfRequest requests at rate per second, each at its due
+   time whether or not earlier ones have been answered. A request that cannot
+   go when it is due, because queueDepth are already in flight or the ring or
+   pool is full, goes as soon as it can; its latency is still counted from
+   when it was due, so time spent queued in the client is not hidden.
  */
-static void writeResult(struct client_worker_result *result, int numOfItem){
-        FILE *fpRead, *fpSector;
-	char fReadName[60], fSectorName[60];
-	int i;
-	
-	sprintf(fReadName, "./read.%d", getpid());
-	sprintf(fSectorName, "./sectors.%d", getpid());
-	
-	fpRead = fopen(fReadName, "w+");
-	fpSector = fopen(fSectorName, "w+b");
-	
-	for(i=0; i<numOfItem; i++){
-	  fwrite(result[i].data.data, sizeof(result[i].data.data[0]), sizeof(result[i].data.data)/sizeof(result[i].data.data[0]), fpRead);
+static void openLoop(struct client_worker_data *workerData, int numOfRequest,
+		     double rate){
+	struct fs_process_sring *ring = &workerData->shm->ring;
+	int queueDepth = workerData->queueDepth;
+	int count = workerData->sectorsPerRequest;
 
-	  fprintf(fpSector, "%d\n", result[i].sectorNum);
+	uint32_t tickets[FS_PROCESS_SLOT_COUNT];
+	int inFlight = 0;
+	int next = 0;
+	int completed = 0;
+	int writes[FS_MAX_VOLUMES] = { 0 };
+	struct client_worker_result *slots = workerData->slots;
+	int freeSlots[FS_PROCESS_SLOT_COUNT];
+	int nFree = queueDepth;
+	for(int i=0; i<queueDepth; i++){
+		freeSlots[i] = i;
 	}
+	struct fs_request req;
+	struct client_worker_result *result = NULL;	// of req, if not yet sent
+	struct timespec due, now;
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	while(completed < numOfRequest){
+		int submitted = 0;
+		int reaped = 0;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while(next < numOfRequest && inFlight < queueDepth &&
+		      timespec_compare(&due, &now) <= 0){
+			if(!result){
+				result = &slots[freeSlots[nFree - 1]];
+				result->count = count;
+				if(makeRequest(workerData, result, &req, writes)){
+					result = NULL;
+					break; // pool full
+				}
+				nFree--;
+				result->startTime = due;
+			}
+			if(RB_TRY_SUBMIT_QUIET(fs_process, ring, &req,
+					       result - slots, &tickets[inFlight])){
+				break; // ring full
+			}
+			result = NULL;
+			inFlight++;
+			next++;
+			submitted++;
+			timespecAddNs(&due, nextArrival(workerData, rate) * 1e9);
+		}
+		if(submitted){
+			signalSubmits(workerData);
+		}
 
-	fclose(fpRead);
-	fclose(fpSector);
+		for(int i=0; i<inFlight; ){
+			struct fs_response rsp;
+			uint64_t tag;
+			if(RB_POLL(fs_process, ring, tickets[i], &rsp, &tag)){
+				finishRequest(workerData, &slots[tag], &rsp);
+				freeSlots[nFree++] = tag;
+				tickets[i] = tickets[--inFlight];
+				completed++;
+				reaped++;
+			}
+			else{
+				i++;
+			}
+		}
+		if(submitted || reaped){
+			continue;
+		}
+
+		/* nothing to do until a response comes or the next request is
+		   due; with nothing in flight only the latter can happen */
+		long long wait = (convertToNanoSec(&due) -
+				  convertToNanoSec(&now));
+		if(next < numOfRequest && wait <= 0){
+			sched_yield(); // due, but no room for it
+		}
+		else if(!inFlight){
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due,
+					NULL);
+		}
+		else{
+			struct timespec nap = { 0, OPEN_LOOP_POLL_NS };
+			if(next < numOfRequest && wait < OPEN_LOOP_POLL_NS){
+				nap.tv_nsec = wait;
+			}
+			nanosleep(&nap, NULL);
+		}
+	}
 }
 
-/* Registers this client with the file server. On return, the server will have
- * created a ring buffer for us to use, and we will know the sector limits for
- * the served file. */
-static struct sector_limits register_with_server()
-{
-	struct fs_registrar_sring *reg = shm_map(shm_registrar_name, sizeof(*reg));
-	int req = getpid();
-	struct sector_limits rsp;
+/**
+   Judges the ramp stage the workers have just run: prints its offered and
+   achieved rates and latencies, and decides whether the server kept up.
+   Sets up the next stage, or stops the ramp at the first stage that did not
+   keep up, or when a thread has too few requests left for the next one.
+ */
+static void judgeStage(struct ramp *ramp){
+	struct latencies stage;
+	initLatencies(&stage);
+	for(int w=0; w<ramp->numOfWorkers; w++){
+		mergeLatencies(&stage, &ramp->workers[w].stage);
+		resetLatencies(&ramp->workers[w].stage);
+	}
+	double achieved = getReqPerSec(&stage);
+	uint64_t p50 = histogram_percentile(stage.hist, 50);
+	uint64_t p99 = histogram_percentile(stage.hist, 99);
+	free(stage.hist);
 
-	RB_MAKE_REQUEST(fs_registrar, reg, &req, &rsp);
+	if(ramp->stage == 0){
+		ramp->firstP99 = p99;
+	}
+	int saturated = achieved < RAMP_MIN_ACHIEVED * ramp->rate ||
+			p99 > RAMP_MAX_P99_GROWTH * ramp->firstP99;
+	printf("stage %d: offered %.0f/s, achieved %.0f/s, p50 %llu ns, "
+	       "p99 %llu ns%s\n", ramp->stage, ramp->rate, achieved,
+	       (unsigned long long)p50, (unsigned long long)p99,
+	       saturated ? ", saturated" : "");
+	if(!saturated){
+		ramp->knee = ramp->rate;
+	}
 
-	checkpoint("Client Reg: requested %d, recieved (%d, %d)", req,
-		   rsp.start, rsp.end);
-	shm_unmap(reg, sizeof(*reg));
+	ramp->stage++;
+	ramp->rate += ramp->load->rampStep;
+	ramp->stageRequests = ramp->rate / ramp->numOfWorkers *
+			      ramp->load->stageMs / 1000;
+	if(ramp->stageRequests < 1){
+		ramp->stageRequests = 1;
+	}
+	int roomy = 1;
+	for(int w=0; w<ramp->numOfWorkers; w++){
+		struct client_worker_data *wd = &ramp->workers[w];
+		if(wd->stageEnd + ramp->stageRequests > wd->numOfRequest){
+			roomy = 0;
+		}
+	}
+	if(saturated || !roomy || ramp->stage == RAMP_MAX_STAGES){
+		if(!saturated){
+			printf("ramp stopped before saturating: %s\n",
+			       roomy ? "too many stages" : "out of requests");
+		}
+		ramp->stop = 1;
+	}
+}
 
-	return rsp;
+/**
+   Runs the stages of a ramp, in step with the other workers
+ */
+static void runRamp(struct client_worker_data *workerData){
+	struct ramp *ramp = workerData->ramp;
+	int base = 0;
+	while(!ramp->stop){
+		int n = ramp->stageRequests;
+		workerData->stageEnd = base + n;
+		openLoop(workerData, n, ramp->rate / ramp->numOfWorkers);
+		base += n;
+		if(pthread_barrier_wait(&ramp->barrier) ==
+		   PTHREAD_BARRIER_SERIAL_THREAD){
+			judgeStage(ramp);
+		}
+		pthread_barrier_wait(&ramp->barrier);
+	}
 }
 
 /**
     Client worker thread
     Generate random number within the limits. Put in a read request, then
-    prints out the received data.
+    prints out the received data. Requests go in a closed loop, an open loop
+    at a fixed rate, or a ramp of open-loop stages. Each request is tagged
+    with the index of its slot, and they are reaped in whatever order the
+    server answers them. The data of each response is verified and streamed
+    straight out of the data pool to the result files, and its buffers are
+    released at once; so are the buffers of a write, once it has been
+    answered.
  **/
 void *request_worker(void *arg){
 	struct client_worker_data *workerData = arg;
-	struct fs_process_sring *ring = workerData->ring;
-	struct sector_limits *sector = workerData->limits;
 	int numOfRequest = workerData->numOfRequest;
-	struct client_worker_result *result = workerData->result;
-
-	int i;
-	for(i=0; i<numOfRequest; i++){
-		result[i].sectorNum = (rand() % (sector->end-sector->start)) + sector->start;
-
-		//clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tpStart);
-		clock_gettime(CLOCK_MONOTONIC, &(result[i].startTime));
-		RB_MAKE_REQUEST(fs_process, ring, &result[i].sectorNum,
-				&result[i].data);
-		//clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tpEnd);
-		clock_gettime(CLOCK_MONOTONIC, &(result[i].endTime));
-
-		timespec_subtract(&result[i].time, &result[i].startTime, &result[i].endTime);
-		//printf("Client: requested %d, received %s\n", req, result[i].data.data);
+	if(workerData->ramp){
+		runRamp(workerData);
+		return NULL;
+	}
+	if(workerData->rate > 0){
+		openLoop(workerData, numOfRequest, workerData->rate);
+	}
+	else{
+		closedLoop(workerData, numOfRequest);
 	}
 	return NULL;
 }
 
 /**
    connect the client to its own ring buffer. Then spawn off worker threads to
-   do work on the shared ring buffer.
+   do work on the shared ring buffer. Returns the number of sectors that
+   failed verification.
  */
-void request_data(struct sector_limits sector, int numOfThread, int numOfRequest)
+uint64_t request_data(struct fs_volumes *volumes, int volume, int numOfThread,
+		  int numOfRequest,
+		  int queueDepth, int op, int sectorsPerRequest,
+		  int writePercent, int flushEvery, struct open_loop *load,
+		  struct workload **workloads, const char *histFile,
+		  bool keepResults, struct verifier **verifiers,
+		  struct rb_wait_policy *waitPolicy)
 {
         char shmWorkerName[50];
 	sprintf(shmWorkerName, "%s.%d", shm_ring_buffer_prefix, getpid());
-	struct fs_process_sring *ring = shm_map(shmWorkerName, sizeof(*ring));
+	struct fs_process_shm *shm = shm_map(shmWorkerName, sizeof(*shm));
+	RB_SET_WAIT_POLICY(&shm->ring, client, waitPolicy);
+	struct fs_doorbells *doorbells = NULL;
+	struct fs_doorbell *bell = NULL;
+	if(shm->doorbell >= 0){
+		doorbells = shm_map(shm_doorbell_name, sizeof(*doorbells));
+		bell = &doorbells->bell[shm->doorbell];
+	}
 
 	int requestPerThread = (int)numOfRequest/numOfThread;
 
-	struct client_worker_result *result = emalloc(numOfRequest *
-						      sizeof(*result));
+	struct client_worker_result *slots = emalloc(numOfThread * queueDepth *
+						     sizeof(*slots));
+	struct result_stream *streams[FS_MAX_VOLUMES] = { NULL };
+	for(int i=0; keepResults && i<volumes->count; i++){
+		if(volume < 0 || volume == i){
+			streams[i] = openResults(i);
+		}
+	}
 	struct client_worker_data clientData[numOfThread];
 
 	//init pthread
@@ -263,16 +786,67 @@ void request_data(struct sector_limits sector, int numOfThread, int numOfRequest
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
+	struct ramp ramp;
+	if(load->rampStep > 0){
+		ramp.workers = clientData;
+		ramp.numOfWorkers = numOfThread;
+		ramp.load = load;
+		ramp.stage = 0;
+		ramp.rate = load->rate;
+		ramp.stageRequests = load->rate / numOfThread * load->stageMs / 1000;
+		if(ramp.stageRequests < 1){
+			ramp.stageRequests = 1;
+		}
+		ramp.knee = 0;
+		ramp.stop = 0;
+		if(ramp.stageRequests > requestPerThread){
+			fprintf(stderr, "Too few requests for the first stage of "
+				"the ramp: it needs %d per thread\n",
+				ramp.stageRequests);
+			exit(1);
+		}
+		pthread_barrier_init(&ramp.barrier, NULL, numOfThread);
+	}
+
 	int i;
 	for(i=0; i<numOfThread; i++){
 
-	        clientData[i].ring = ring;
-		clientData[i].limits = &sector;
+	        clientData[i].shm = shm;
+		clientData[i].bell = bell;
+		clientData[i].volumes = volumes;
+		clientData[i].volume = volume;
 		clientData[i].numOfRequest = requestPerThread;
+		clientData[i].queueDepth = queueDepth;
+		clientData[i].op = op;
+		clientData[i].sectorsPerRequest = sectorsPerRequest;
+		clientData[i].writePercent = writePercent;
+		clientData[i].flushEvery = flushEvery;
+		clientData[i].load = load;
+		clientData[i].rate = load->rate / numOfThread;
+		clientData[i].ramp = load->rampStep > 0 ? &ramp : NULL;
+		clientData[i].workloads = workloads;
+		for(int v=0; v<volumes->count; v++){
+			if(workloads[v]){
+				workload_cursor_init(workloads[v],
+						     &clientData[i].cursors[v], i,
+						     numOfThread);
+			}
+		}
+		wl_rng_seed(&clientData[i].rng, (uint64_t)getpid() << 32 | i);
+		clientData[i].burstLeft = load->burst;
+		initLatencies(&clientData[i].total);
+		if(load->rampStep > 0){
+			initLatencies(&clientData[i].stage);
+		}
 	        if((numOfRequest%numOfThread != 0) && (i == numOfThread-1)){
 		  clientData[i].numOfRequest = requestPerThread + numOfRequest%numOfThread;
 		}
-		clientData[i].result = &result[i*requestPerThread];
+		clientData[i].slots = &slots[i * queueDepth];
+		clientData[i].streams = keepResults ? streams : NULL;
+		clientData[i].verifiers = verifiers;
+		clientData[i].checked = 0;
+		clientData[i].mismatches = 0;
+		clientData[i].nbad = 0;
 
 
 
@@ -283,32 +857,294 @@ void request_data(struct sector_limits sector, int numOfThread, int numOfRequest
 	for(i=0; i<numOfThread; i++){
 	        pthread_join(workerThread[i], NULL);
 	}
+	if(load->rampStep > 0){
+		pthread_barrier_destroy(&ramp.barrier);
+		if(ramp.knee > 0){
+			printf("knee: %.0f requests/s\n", ramp.knee);
+		}
+		else{
+			printf("knee: not found, the first stage saturated\n");
+		}
+	}
 
 	//calculate measurements
-	double avg = getTimeAvg(result, numOfRequest);
-	long max = getTimeMax(result, numOfRequest);
-	long min = getTimeMin(result, numOfRequest);
-	double stddev = getTimeStdDev(result, numOfRequest, avg);
-	double reqPerSec = getReqPerSec(result, numOfRequest);
-	printf("%ld|%f|%ld|%f|%f\n", max, avg, min, stddev, reqPerSec);
+	struct latencies total;
+	initLatencies(&total);
+	for(i=0; i<numOfThread; i++){
+		mergeLatencies(&total, &clientData[i].total);
+		free(clientData[i].total.hist);
+		if(load->rampStep > 0){
+			free(clientData[i].stage.hist);
+		}
+	}
+	struct histogram *hist = total.hist;
+	printf("%llu requests, %.0f requests/s\n",
+	       (unsigned long long)hist->count, getReqPerSec(&total));
+	printf("latency: p50 %llu ns, p90 %llu ns, p99 %llu ns, p99.9 %llu ns, "
+	       "p99.99 %llu ns, max %llu ns\n",
+	       (unsigned long long)histogram_percentile(hist, 50),
+	       (unsigned long long)histogram_percentile(hist, 90),
+	       (unsigned long long)histogram_percentile(hist, 99),
+	       (unsigned long long)histogram_percentile(hist, 99.9),
+	       (unsigned long long)histogram_percentile(hist, 99.99),
+	       (unsigned long long)hist->max);
+	if(histFile){
+		FILE *f = fopen(histFile, "w");
+		if(!f){
+			perror(histFile);
+		}
+		else{
+			histogram_dump(hist, f);
+			fclose(f);
+		}
+	}
+	free(hist);
 
-	//write to file
-	writeResult(result, numOfRequest);
+	uint64_t checked = 0, mismatches = 0;
+	for(i=0; i<numOfThread; i++){
+		checked += clientData[i].checked;
+		mismatches += clientData[i].mismatches;
+	}
+	if(verifiers){
+		printf("verify: %llu sectors checked, %llu wrong\n",
+		       (unsigned long long)checked,
+		       (unsigned long long)mismatches);
+		struct mismatch bad[MAX_REPORTED_MISMATCHES];
+		int nbad = 0;
+		for(i=0; i<numOfThread; i++){
+			for(int j=0; j<clientData[i].nbad; j++){
+				struct mismatch *m = &clientData[i].bad[j];
+				addMismatch(bad, &nbad, MAX_REPORTED_MISMATCHES,
+					    m->volume, m->sector, m->count);
+			}
+		}
+		for(i=0; i<nbad; i++){
+			printf("wrong: volume %d sector %d, %llu times\n",
+			       bad[i].volume, bad[i].sector,
+			       (unsigned long long)bad[i].count);
+		}
+	}
+
+	//finish writing the result files
+	for(i=0; i<volumes->count; i++){
+		int error;
+		if(streams[i] && (error = result_stream_close(streams[i]))){
+			fprintf(stderr, "Writing the results of volume %d: %s\n",
+				i, strerror(error));
+		}
+	}
 
 	pthread_attr_destroy(&attr);
-	shm_unmap(ring, sizeof(*ring));
-	free(result);
+	shm_unmap(shm, sizeof(*shm));
+	if(doorbells){
+		shm_unmap(doorbells, sizeof(*doorbells));
+	}
+	free(slots);
+	return mismatches;
+}
+
+/**
+   Parses an arrival process, const, poisson or bursty[:burst]. Returns -1 if
+   it is not one.
+ */
+static int parseArrival(const char *str, struct open_loop *load){
+	if(!strcmp(str, "const")){
+		load->arrival = ARRIVAL_CONST;
+	}
+	else if(!strcmp(str, "poisson")){
+		load->arrival = ARRIVAL_POISSON;
+	}
+	else if(!strncmp(str, "bursty", 6) && (!str[6] || str[6] == ':')){
+		load->arrival = ARRIVAL_BURSTY;
+		if(str[6] && (load->burst = atoi(str + 7)) < 1){
+			return -1;
+		}
+	}
+	else{
+		return -1;
+	}
+	return 0;
 }
 
-int main(int argc, char const *argv[])
+/**
+   Makes the verifiers, for each volume used, that spec asks for: pattern,
+   for images made by make_test_file.py, or image:path[,path...], for the
+   images of the volumes in order, checked against the CRC32Cs of their
+   sectors. Returns -1, having said why, if it cannot.
+ */
+static int makeVerifiers(const char *spec, struct fs_volumes *volumes,
+			 int volume, struct verifier **verifiers){
+	char *paths = NULL;
+	char *save = NULL;
+	char *path = NULL;
+	if(!strncmp(spec, "image:", 6)){
+		paths = strdup(spec + 6);
+		path = strtok_r(paths, ",", &save);
+	}
+	else if(strcmp(spec, "pattern")){
+		fprintf(stderr, "Bad verification: %s\n", spec);
+		return -1;
+	}
+	for(int i=0; i<volumes->count; i++){
+		int nsectors = volumes->limits[i].end - volumes->limits[i].start;
+		if(paths && !path){
+			fprintf(stderr, "No image given for volume %d\n", i);
+			free(paths);
+			return -1;
+		}
+		if(volume < 0 || volume == i){
+			verifiers[i] = paths ? verifier_image(path, nsectors) :
+					       verifier_pattern(nsectors);
+			if(!verifiers[i]){
+				perror(path);
+				free(paths);
+				return -1;
+			}
+		}
+		if(paths){
+			path = strtok_r(NULL, ",", &save);
+		}
+	}
+	free(paths);
+	return 0;
+}
+
+int main(int argc, char *argv[])
 {
-        if(argc<3){
-	        printf("client <num_of_threads> <num_of_requests for client>\n");
+	int queueDepth = 1;
+	int op = FS_READ;
+	int sectorsPerRequest = 1;
+	int writePercent = 0;
+	int flushEvery = 0;
+	int volume = -1;
+	const char *profile = "uniform";
+	const char *histFile = NULL;
+	bool keepResults = True;
+	const char *verifySpec = NULL;
+	struct open_loop load = { 0, ARRIVAL_POISSON, DEFAULT_BURST, 0, 1000 };
+	struct rb_wait_policy waitPolicy = RB_WAIT_POLICY_DEFAULT;
+	struct fs_registration registration = { 0, 1, 0, 0 };
+	int opt;
+	while((opt = getopt(argc, argv, "q:r:v:x:f:V:P:R:D:S:H:nC:w:W:I:B:")) != -1){
+		switch(opt){
+		case 'q':
+			queueDepth = atoi(optarg);
+			break;
+		case 'r':
+			op = FS_READ_RANGE;
+			sectorsPerRequest = atoi(optarg);
+			break;
+		case 'v':
+			op = FS_READ_VEC;
+			sectorsPerRequest = atoi(optarg);
+			break;
+		case 'x':
+			writePercent = atoi(optarg);
+			break;
+		case 'f':
+			flushEvery = atoi(optarg);
+			break;
+		case 'V':
+			volume = atoi(optarg);
+			break;
+		case 'P':
+			profile = optarg;
+			break;
+		case 'R':
+			load.rate = atof(optarg);
+			break;
+		case 'D':
+			if(parseArrival(optarg, &load))
+				argc = 0;
+			break;
+		case 'S':
+			if(sscanf(optarg, "%lf:%d", &load.rampStep,
+				  &load.stageMs) < 1)
+				argc = 0;
+			break;
+		case 'H':
+			histFile = optarg;
+			break;
+		case 'n':
+			keepResults = False;
+			break;
+		case 'C':
+			verifySpec = optarg;
+			break;
+		case 'w':
+			if(rb_wait_policy_parse(optarg, &waitPolicy))
+				argc = 0;
+			break;
+		case 'W':
+			registration.weight = atoi(optarg);
+			break;
+		case 'I':
+			registration.max_iops = strtoull(optarg, NULL, 10);
+			break;
+		case 'B':
+			registration.max_bandwidth = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			argc = 0; // print usage
+		}
+	}
+
+        if(argc-optind<2){
+	        printf("client [-q <queue_depth>] [-r <range_sectors> | -v <vector_sectors>] [-x <write_percent>] [-f <writes_per_flush>] [-V <volume>] [-P <profile>] [-R <requests_per_sec>] [-D <const|poisson|bursty[:burst]>] [-S <rate_step>[:stage_ms]] [-H <histogram_file>] [-n] [-C <pattern|image:path[,path...]>] [-w <block|spin[:polls]|adaptive|busy>] [-W <weight>] [-I <max_iops>] [-B <max_bytes_per_sec>] <num_of_threads> <num_of_requests for client>\n");
 		return 0;
 	}
+	if(queueDepth < 1)
+		queueDepth = 1;
+	if(queueDepth > FS_PROCESS_SLOT_COUNT)
+		queueDepth = FS_PROCESS_SLOT_COUNT;
+	if(sectorsPerRequest < 1)
+		sectorsPerRequest = 1;
+	if(sectorsPerRequest > FS_MAX_SECTORS)
+		sectorsPerRequest = FS_MAX_SECTORS;
+	if(op == FS_READ_VEC && sectorsPerRequest > FS_MAX_VEC)
+		sectorsPerRequest = FS_MAX_VEC;
+	if(writePercent < 0)
+		writePercent = 0;
+	if(writePercent > 100)
+		writePercent = 100;
+	if(flushEvery < 0)
+		flushEvery = 0;
+	if(load.rampStep > 0 && load.rate <= 0)
+		load.rate = load.rampStep;
+	if(load.stageMs < 1)
+		load.stageMs = 1000;
 
-	struct sector_limits rsp = register_with_server();
-	request_data(rsp, atoi(argv[1]), atoi(argv[2]));
+	struct fs_volumes rsp = register_with_server(&registration);
+	if(volume >= rsp.count){
+		fprintf(stderr, "The server has only %d volumes\n", rsp.count);
+		return 1;
+	}
+	struct workload *workloads[FS_MAX_VOLUMES] = { NULL };
+	for(int i=0; i<rsp.count; i++){
+		int span = rsp.limits[i].end - rsp.limits[i].start;
+		if(volume >= 0 && volume != i)
+			continue;
+		if(sectorsPerRequest > span)
+			sectorsPerRequest = span;
+		if(!(workloads[i] = workload_create(profile, span)))
+			return 1;
+	}
+	struct verifier *verifiers[FS_MAX_VOLUMES] = { NULL };
+	if(verifySpec && makeVerifiers(verifySpec, &rsp, volume, verifiers))
+		return 1;
+	uint64_t mismatches = request_data(&rsp, volume, atoi(argv[optind]),
+					   atoi(argv[optind+1]), queueDepth,
+					   op, sectorsPerRequest,
+					   writePercent, flushEvery, &load,
+					   workloads, histFile, keepResults,
+					   verifySpec ? verifiers : NULL,
+					   &waitPolicy);
+	for(int i=0; i<rsp.count; i++){
+		if(workloads[i])
+			workload_destroy(workloads[i]);
+		if(verifiers[i])
+			verifier_destroy(verifiers[i]);
+	}
 
-	return 0;
+	return mismatches ? 2 : 0;
 }
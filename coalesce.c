@@ -0,0 +1,83 @@
+/*
+ * Request coalescing. Batches are as small as an I/O thread's scheduler
+ * window, so a qsort of piece pointers, and another of the extents to put
+ * them back in the batch's order, is plenty.
+ */
+
+#include "coalesce.h"
+#include "file_service.h"
+
+/* By sector, and longest first among pieces starting at the same sector, so
+ * that the first piece of an extent is the one that may cover it */
+static int piece_cmp(const void *a_, const void *b_)
+{
+	const struct read_piece *a = *(struct read_piece * const *)a_;
+	const struct read_piece *b = *(struct read_piece * const *)b_;
+	if (a->sector != b->sector)
+		return a->sector < b->sector ? -1 : 1;
+	return b->count - a->count;
+}
+
+/* By the place of their first piece in the batch */
+static int extent_cmp(const void *a_, const void *b_)
+{
+	const struct read_extent *a = a_, *b = b_;
+	return a->first - b->first;
+}
+
+int coalesce(struct read_piece **pieces, int n, int max_count,
+	     struct read_extent *extents)
+{
+	for (int i = 0; i < n; ++i)
+		pieces[i]->order = i;
+	qsort(pieces, n, sizeof(*pieces), &piece_cmp);
+	int nextents = 0;
+	struct read_extent *e = NULL;
+	struct read_piece **tail = NULL;
+	for (int i = 0; i < n; ++i) {
+		struct read_piece *p = pieces[i];
+		int end = p->sector + p->count;
+		if (e && p->sector <= e->sector + e->count &&
+		    (end <= e->sector + e->count ||
+		     end - e->sector <= max_count)) {
+			if (end > e->sector + e->count)
+				e->count = end - e->sector;
+			if (p->owner != e->pieces->owner)
+				e->shared = True;
+			if (p->client != e->client)
+				e->client = NULL;
+			if (p->order < e->first)
+				e->first = p->order;
+			++e->npieces;
+		} else {
+			e = &extents[nextents++];
+			e->sector = p->sector;
+			e->count = p->count;
+			e->npieces = 1;
+			e->first = p->order;
+			e->shared = False;
+			e->client = p->client;
+			e->pieces = p;
+			tail = &e->pieces;
+		}
+		p->next = NULL;
+		*tail = p;
+		tail = &p->next;
+	}
+	for (int i = 0; i < nextents; ++i) {
+		e = &extents[i];
+		e->target = e->client && e->pieces->count == e->count ?
+			    e->pieces->buf : NULL;
+	}
+	qsort(extents, nextents, sizeof(*extents), &extent_cmp);
+	return nextents;
+}
+
+void coalesce_scatter(struct read_piece *pieces, int sector, const char *data)
+{
+	for (struct read_piece *p = pieces; p; p = p->next) {
+		const char *src = data + (p->sector - sector) * SECTOR_SIZE;
+		if (p->buf && p->buf != src)
+			memcpy(p->buf, src, p->count * SECTOR_SIZE);
+	}
+}
@@ -0,0 +1,58 @@
+/*
+ * Request coalescing for the I/O threads. The sector reads of a batch of
+ * requests are sorted, and reads of the same, overlapping or adjacent sectors
+ * are merged into one larger read; once it is done, its data is copied back
+ * out to each request it stands in for. The merged reads keep the order the
+ * scheduler put the batch in.
+ *
+ * Nothing here is shared between threads: each I/O thread coalesces its own
+ * batches.
+ */
+
+#ifndef COALESCE_H_
+#define COALESCE_H_
+
+#include "common.h"
+
+/* Part of a request: `count` consecutive sectors to be read into `buf` */
+struct read_piece {
+	int sector;
+	int count;
+	char *buf;			// count * SECTOR_SIZE bytes, or NULL
+	void *owner;			// the request it is part of
+	void *client;			// whose memory buf is in
+	int order;			// place in its batch, set by coalesce()
+	struct read_piece *next;	// in its extent
+};
+
+/* A read standing in for one or more pieces */
+struct read_extent {
+	int sector;
+	int count;
+	int npieces;
+	int first;			// least order of its pieces
+	bool shared;			// pieces have more than one owner
+	void *client;			// of all its pieces, or NULL if they
+					// have more than one
+	char *target;			// buf of a piece that covers the whole
+					// extent, if all are the client's, or
+					// NULL
+	struct read_piece *pieces;
+};
+
+/* Sorts `pieces` by sector, and groups pieces that overlap or are adjacent
+ * into extents of at most `max_count` sectors. An extent is only read straight
+ * into one of its pieces when they all belong to the same client, since the
+ * others are copied from there. The extents are stored in
+ * `extents` in the order their first pieces had in `pieces`, so each is read
+ * as early as the earliest request it serves. There are at most `n` of them.
+ * Returns the number of extents. */
+int coalesce(struct read_piece **pieces, int n, int max_count,
+	     struct read_extent *extents);
+
+/* Copies each of a list of pieces out of `data`, which holds the sectors
+ * from `sector` on and covers them all. Pieces with no buffer, or whose
+ * buffer is already the right place in `data`, are left alone. */
+void coalesce_scatter(struct read_piece *pieces, int sector, const char *data);
+
+#endif /* end of include guard: COALESCE_H_ */
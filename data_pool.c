@@ -0,0 +1,52 @@
+/*
+ * Allocation of buffers from a client's data pool.
+ *
+ * The pool's bitmap lives in the shared segment and is updated with atomic
+ * operations, so the server's I/O threads can claim buffers while the client's
+ * threads release them, without a lock. A run of buffers never spans two words
+ * of the bitmap, which keeps claiming a run to a single compare-and-swap.
+ */
+
+#include <stdint.h>
+
+#include "file_service.h"
+#include "common.h"
+
+/* Returns the bits of `used` at which a run of `n` clear bits starts */
+static uint64_t run_starts(uint64_t used, int n)
+{
+	uint64_t starts = ~used;
+	for (int i = 1; i < n; ++i)
+		starts &= ~used >> i;
+	return starts;
+}
+
+static uint64_t run_mask(int n, int bit)
+{
+	return (n == 64 ? UINT64_MAX : ((uint64_t)1 << n) - 1) << bit;
+}
+
+int fs_pool_alloc(struct fs_process_shm *shm, int nbufs)
+{
+	if (nbufs < 1 || nbufs > 64)
+		return -1;
+	for (int w = 0; w < FS_POOL_BUFFERS / 64; ++w) {
+		uint64_t *word = &shm->pool_map[w];
+		uint64_t used = __atomic_load_n(word, __ATOMIC_RELAXED);
+		uint64_t starts;
+		while ((starts = run_starts(used, nbufs))) {
+			int bit = __builtin_ctzll(starts);
+			if (__atomic_compare_exchange_n(word, &used,
+					used | run_mask(nbufs, bit), 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return w * 64 + bit;
+		}
+	}
+	return -1;
+}
+
+void fs_pool_release(struct fs_process_shm *shm, int buf, int nbufs)
+{
+	__atomic_fetch_and(&shm->pool_map[buf / 64],
+			   ~run_mask(nbufs, buf % 64), __ATOMIC_RELEASE);
+}
@@ -9,6 +9,7 @@
 
 #include <semaphore.h>
 #include "ring.h"
+#include "common.h"
 
 /* Name of the shared memory file that clients should `shm_map()` to register
  * their pid with the server */
@@ -20,27 +21,144 @@
 /* types for the request/response for the registration buffer */
 typedef int client_pid_t;
 
+/* Most weight a client can ask for */
+#define FS_MAX_WEIGHT 64
+
+/* A client's registration, with the share of the server it asks for. When the
+ * server is busy, clients get requests served in proportion to their weights;
+ * a client can also be capped whether the server is busy or not. */
+typedef struct fs_registration {
+	client_pid_t pid;
+	int weight;			// 1 to FS_MAX_WEIGHT
+	uint64_t max_iops;		// requests per second, or 0 for no cap
+	uint64_t max_bandwidth;		// bytes per second, or 0 for no cap
+} fs_registration_t;
+
+/* Most files (volumes) a server can serve at once */
+#define FS_MAX_VOLUMES 8
+
 typedef struct sector_limits {
 	int start;
 	int end;
 } sector_limits_t;
 
-typedef int sector_number;
+/* The registration's response: the volumes the client may use, each with the
+ * sectors of it that may be asked for. Requests name a volume by its index
+ * here. */
+typedef struct fs_volumes {
+	int count;
+	sector_limits_t limits[FS_MAX_VOLUMES];
+} fs_volumes_t;
 
 typedef struct sector_data{
 	char data[SECTOR_SIZE];
 } sector_data_t;
 
-/* number of slots in the ringbuffer */
+/* Kinds of request on a client's ring */
+enum fs_op {
+	FS_READ,		// one sector
+	FS_READ_RANGE,		// `count` sectors from `sector`
+	FS_READ_VEC,		// the `count` sectors in `vec`
+	FS_WRITE,		// `count` sectors from `sector`, with the data
+				// in the pool from buffer `buf` on
+	FS_FLUSH,		// answered once every write to the volume
+				// answered before it was sent is on the disk
+};
+
+/* Most sectors in a vectored request */
+#define FS_MAX_VEC 16
+
+/* Each client's data pool: page-sized buffers that the server reads sectors
+ * straight into. A request's data is put in a run of consecutive buffers, in
+ * the order its sectors were asked for. */
+#define FS_POOL_BUFFER_SIZE 4096
+#define FS_POOL_BUFFERS 256
+#define FS_POOL_BUFFER_SECTORS (FS_POOL_BUFFER_SIZE / SECTOR_SIZE)
+
+/* Most sectors in one request. The pool holds twice what a full ring of the
+ * largest requests needs, so a client that releases its buffers as soon as it
+ * is done with them never finds it full. */
+#define FS_MAX_SECTORS 64
+
+/* Number of pool buffers needed for `_count` sectors */
+#define FS_POOL_BUFFERS_FOR(_count)					\
+	(((_count) + FS_POOL_BUFFER_SECTORS - 1) / FS_POOL_BUFFER_SECTORS)
+
+/* types for the request/response for the per-client ring. The response to a
+ * read only describes where the data is: the client reads it in place from the
+ * pool, and then releases the buffers with `fs_pool_release()`. A write's data
+ * goes the other way, in buffers the client claims and fills, and releases
+ * once the write has been answered. */
+typedef struct fs_request {
+	int op;			// an fs_op
+	int volume;		// which of the registration's volumes
+	int sector;		// FS_READ, FS_READ_RANGE and FS_WRITE
+	int count;		// FS_READ_RANGE, FS_READ_VEC and FS_WRITE
+	int buf;		// FS_WRITE
+	int vec[FS_MAX_VEC];	// FS_READ_VEC
+} fs_request_t;
+
+typedef struct fs_response {
+	int error;		// 0, or an errno value; EINVAL for a bad request,
+				// ENOBUFS if the pool is full and EROFS for a
+				// write to a server that cannot write
+	int buf;		// first pool buffer holding the data
+	int nbufs;		// number of buffers to release
+} fs_response_t;
+
+/* number of slots in the ringbuffer. The per-client ring is lock-free, which
+ * needs a power of two. */
 #define FS_REGISTRAR_SLOT_COUNT 10
-#define FS_PROCESS_SLOT_COUNT 10
+#define FS_PROCESS_SLOT_COUNT 16
 
 /* defines the request/response union, the entry slot struct, and the ringbuffer
- * struct */
-DEFINE_RING_TYPES(fs_registrar, client_pid_t, sector_limits_t,
+ * struct. Registration is rare and stays on the semaphore ring; the per-client
+ * sector ring carries every request and uses the lock-free ring. */
+DEFINE_RING_TYPES(fs_registrar, fs_registration_t, fs_volumes_t,
 		  FS_REGISTRAR_SLOT_COUNT);
-DEFINE_RING_TYPES(fs_process, sector_number, sector_data_t,
-	          FS_PROCESS_SLOT_COUNT);
+DEFINE_LOCKFREE_RING_TYPES(fs_process, fs_request_t, fs_response_t,
+			   FS_PROCESS_SLOT_COUNT);
+
+/* Name of the shared memory file holding the doorbells of the server's
+ * pollers. It only exists when the server runs in event mode, where a few
+ * poller threads serve all the client rings between them, and a poller with
+ * nothing to do sleeps on its doorbell. */
+#define shm_doorbell_name "/fs_doorbells"
+
+/* Most pollers the server can have */
+#define FS_MAX_POLLERS 64
+
+struct fs_doorbell {
+	uint32_t seq;			// bumped by clients with new requests
+	uint32_t waiters;		// pollers asleep on `seq`
+} RB_CACHE_ALIGNED;
+
+struct fs_doorbells {
+	struct fs_doorbell bell[FS_MAX_POLLERS];
+};
+
+/* Tells a ring's poller there are new requests on it. One ring of the doorbell
+ * covers every request submitted before it. */
+static inline void fs_ring_doorbell(struct fs_doorbell *bell)
+{
+	rb_word_inc(&bell->seq, &bell->waiters);
+}
+
+/* Layout of each client's shared memory segment: the ring, then the data pool
+ * and the bitmap of its buffers that are in use. In event mode, the client
+ * must ring doorbell `doorbell` after submitting requests; otherwise it is
+ * -1. */
+struct fs_process_shm {
+	int doorbell;
+	struct fs_process_sring ring;
+	uint64_t pool_map[FS_POOL_BUFFERS / 64];
+	char pool[FS_POOL_BUFFERS][FS_POOL_BUFFER_SIZE]
+		__attribute__((aligned(FS_POOL_BUFFER_SIZE)));
+};
+
+RB_STATIC_ASSERT(FS_POOL_BUFFERS % 64 == 0, fs_pool_map_is_whole_words);
+RB_STATIC_ASSERT(FS_POOL_BUFFERS >= 2 * FS_PROCESS_SLOT_COUNT *
+		 FS_POOL_BUFFERS_FOR(FS_MAX_SECTORS), fs_pool_holds_two_rings);
 
 /* Prefix of the name of the shared memory file that clients should `mmap()` to
  * communicate via ring buffer. The full name will be
@@ -61,4 +179,16 @@ void shm_unmap(void *ptr, size_t size);
 /* unmap and destroy a shared memory segment */
 void shm_destroy(char *fname, void *ptr, size_t size);
 
+/* Functions to handle a client's data pool. Either side may call them at any
+ * time, from any thread. */
+/* claim `nbufs` consecutive free buffers, returning the first, or -1 if there
+ * is no such run */
+int fs_pool_alloc(struct fs_process_shm *shm, int nbufs);
+/* give back buffers claimed by `fs_pool_alloc()` */
+void fs_pool_release(struct fs_process_shm *shm, int buf, int nbufs);
+
+/* Whether a request only names sectors of volume `volume`, which has
+ * `nsectors`, and its data fits in a run of pool buffers */
+bool fs_request_valid(const struct fs_request *q, int volume, int nsectors);
+
 #endif /* end of include guard: FILE_SERVICE_H_ */
@@ -0,0 +1,111 @@
+/*
+ * Log-linear latency histograms. Bucket b counts:
+ *
+ * 	b < 2 * HIST_SUB:	the value b
+ * 	otherwise:		with e = b / HIST_SUB - 1, the 2^e values
+ * 				from (b % HIST_SUB + HIST_SUB) << e on
+ *
+ * so a value v whose top bit is bit HIST_SUB_BITS + e goes to bucket
+ * e * HIST_SUB + (v >> e).
+ */
+
+#include <math.h>
+
+#include "histogram.h"
+
+static inline int bucket_of(uint64_t value)
+{
+	if (value >> HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+	if (value < 2 * HIST_SUB)
+		return value;
+	int e = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return e * HIST_SUB + (value >> e);
+}
+
+/* The highest value bucket `b` counts */
+static uint64_t bucket_top(int b)
+{
+	if (b < 2 * HIST_SUB)
+		return b;
+	int e = b / HIST_SUB - 1;
+	return ((uint64_t)(b % HIST_SUB + HIST_SUB + 1) << e) - 1;
+}
+
+void histogram_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+	++h->buckets[bucket_of(value)];
+	++h->count;
+	h->sum += value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+void histogram_merge(struct histogram *into, const struct histogram *from)
+{
+	for (int b = 0; b < HIST_BUCKETS; ++b)
+		into->buckets[b] += from->buckets[b];
+	into->count += from->count;
+	into->sum += from->sum;
+	if (from->min < into->min)
+		into->min = from->min;
+	if (from->max > into->max)
+		into->max = from->max;
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double percentile)
+{
+	if (!h->count)
+		return 0;
+	if (percentile <= 0)
+		return h->min;
+	uint64_t rank = ceil(percentile / 100 * h->count), seen = 0;
+	if (rank < 1)
+		rank = 1;
+	for (int b = 0; b < HIST_BUCKETS; ++b) {
+		seen += h->buckets[b];
+		if (seen >= rank) {
+			uint64_t top = bucket_top(b);
+			return top < h->max ? top : h->max;
+		}
+	}
+	return h->max;
+}
+
+double histogram_mean(const struct histogram *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+void histogram_dump(const struct histogram *h, FILE *f)
+{
+	uint64_t seen = 0;
+	fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile",
+		"TotalCount", "1/(1-Percentile)");
+	for (int b = 0; b < HIST_BUCKETS; ++b) {
+		if (!h->buckets[b])
+			continue;
+		seen += h->buckets[b];
+		uint64_t top = bucket_top(b);
+		double fraction = (double)seen / h->count;
+		fprintf(f, "%12llu %14.12f %10llu", (unsigned long long)
+			(top < h->max ? top : h->max), fraction,
+			(unsigned long long)seen);
+		if (seen < h->count)
+			fprintf(f, " %14.2f\n", 1 / (1 - fraction));
+		else
+			fprintf(f, " %14s\n", "inf");
+	}
+	fprintf(f, "#[Mean    = %14.3f, Max     = %14llu]\n",
+		histogram_mean(h), (unsigned long long)h->max);
+	fprintf(f, "#[Total count    = %12llu]\n",
+		(unsigned long long)h->count);
+}
@@ -0,0 +1,56 @@
+/*
+ * Latency histograms in the manner of HdrHistogram: values below
+ * 2 * HIST_SUB are counted exactly, and above that each power of two is
+ * split into HIST_SUB buckets, so a value is known to within 1 / HIST_SUB of
+ * itself whatever its size. A histogram takes the same memory however many
+ * values it counts, and recording one is a few shifts and an increment.
+ *
+ * A histogram is not locked: each thread records into its own, and they are
+ * merged once the threads are done.
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+
+#define HIST_SUB_BITS 8
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+/* values from 2^HIST_MAX_BITS (about 18 minutes, in ns) on are counted in
+ * the last bucket */
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;			// exactly, even past the last bucket
+	double sum;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+/* Empties a histogram */
+void histogram_reset(struct histogram *h);
+
+void histogram_record(struct histogram *h, uint64_t value);
+
+/* Adds the counts of `from` to `into` */
+void histogram_merge(struct histogram *into, const struct histogram *from);
+
+/* The value that `percentile` percent of the values are at or below, as the
+ * highest value of its bucket (but no more than the largest recorded). 0 if
+ * the histogram is empty. */
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+
+double histogram_mean(const struct histogram *h);
+
+/* Writes each non-empty bucket's highest value, with the fraction and number
+ * of values at or below it, and 1 / (1 - fraction), as columns to plot, the
+ * way HdrHistogram prints a percentile distribution */
+void histogram_dump(const struct histogram *h, FILE *f);
+
+#endif /* end of include guard: HISTOGRAM_H_ */
@@ -0,0 +1,96 @@
+/*
+ * Engine selection, and the pread engine: each I/O thread reads one sector at
+ * a time with pread() on the shared descriptor.
+ */
+
+/* Necessary for pread() */
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <errno.h>
+
+#include "io_engine.h"
+#include "file_service.h"
+#include "common.h"
+
+static const struct io_engine *engines[] = {
+	&io_engine_pread,
+	&io_engine_uring,
+	&io_engine_mmap,
+};
+
+/* The pread engine has no per-thread state beyond the descriptor */
+static void *pread_thread_init(int fd)
+{
+	int *ctx = emalloc(sizeof(*ctx));
+	*ctx = fd;
+	return ctx;
+}
+
+static void pread_thread_exit(void *ctx)
+{
+	free(ctx);
+}
+
+/* Fill a buffer with sectors. Reads are positional, so any number of I/O
+ * threads can share the one descriptor. */
+static void pread_submit(void *ctx, struct io_req *req)
+{
+	int fd = *(int *)ctx;
+	checkpoint("filling %d sectors from %d", req->count, req->sector);
+	off_t start = (off_t)req->sector * SECTOR_SIZE;
+	size_t len = (size_t)req->count * SECTOR_SIZE;
+	size_t got = 0;
+	req->error = 0;
+	while (got < len) {
+		ssize_t n = pread(fd, req->buf + got, len - got, start + got);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			req->error = errno;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	memset(req->buf + got, 0, len - got);
+	req->complete(req);
+}
+
+static void pread_poll(void *ctx, int wait)
+{
+	/* everything completes in submit() */
+}
+
+const struct io_engine io_engine_pread = {
+	.name = "pread",
+	.queue_depth = 1,
+	.thread_init = &pread_thread_init,
+	.thread_exit = &pread_thread_exit,
+	.submit = &pread_submit,
+	.poll = &pread_poll,
+};
+
+const struct io_engine *io_engine_select(const char *spec, int fd)
+{
+	const struct io_engine *e = NULL;
+	const char *opts = strchr(spec, ':');
+	size_t name_len = opts ? opts - spec : strlen(spec);
+	for (int i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+		if (strlen(engines[i]->name) == name_len &&
+		    !strncmp(engines[i]->name, spec, name_len))
+			e = engines[i];
+	if (!e)
+		return NULL;
+	if (opts && (!e->configure || e->configure(opts + 1)))
+		return NULL;
+
+	/* try it out on this thread, the way an I/O thread would */
+	void *ctx = e->thread_init(fd);
+	if (!ctx) {
+		fprintf(stderr, "I/O engine %s unavailable, using %s\n",
+			e->name, io_engine_pread.name);
+		return &io_engine_pread;
+	}
+	e->thread_exit(ctx);
+	return e;
+}
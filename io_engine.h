@@ -0,0 +1,49 @@
+/*
+ * I/O engines: the different ways the server's I/O threads can read sectors
+ * out of the file being served. Every I/O thread gets its own engine context,
+ * submits reads to it, and polls it for completions.
+ */
+
+#ifndef IO_ENGINE_H_
+#define IO_ENGINE_H_
+
+/* A read of `count` consecutive sectors. The I/O thread fills in `sector`,
+ * `count`, `buf` and `complete`; the engine sets `error` and calls `complete`
+ * when the read is done. Anything past the end of the file reads as zeros. */
+struct io_req {
+	int sector;
+	int count;
+	char *buf;			// count * SECTOR_SIZE bytes
+	int error;			// 0, or an errno value
+	void (*complete)(struct io_req *req);
+};
+
+struct io_engine {
+	const char *name;
+	/* most reads a single thread may have in flight at once */
+	int queue_depth;
+	/* Takes the options given after the engine's name, if it has any.
+	 * Returns -1 if they are not understood. May be NULL. */
+	int (*configure)(const char *opts);
+	/* Sets up one thread's state for reading `fd`. Returns NULL if the
+	 * engine cannot run on this system. */
+	void *(*thread_init)(int fd);
+	void (*thread_exit)(void *ctx);
+	/* Starts a read. Synchronous engines complete it before returning. */
+	void (*submit)(void *ctx, struct io_req *req);
+	/* Hands submitted reads to the kernel and completes any that have
+	 * finished. If `wait`, blocks until at least one completes. */
+	void (*poll)(void *ctx, int wait);
+};
+
+extern const struct io_engine io_engine_pread;
+extern const struct io_engine io_engine_uring;
+extern const struct io_engine io_engine_mmap;
+
+/* Looks up an engine by `spec`, which is its name optionally followed by a
+ * colon and options (e.g. "mmap:populate"), and checks it can run here, falling
+ * back to the pread engine if it cannot. Returns NULL for an unknown name or
+ * bad options. */
+const struct io_engine *io_engine_select(const char *spec, int fd);
+
+#endif /* end of include guard: IO_ENGINE_H_ */
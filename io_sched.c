@@ -0,0 +1,175 @@
+/*
+ * Request schedulers of the I/O threads.
+ *
+ * Each I/O thread owns its scheduler, so there is no locking. Requests are
+ * stamped with an arrival number, which orders them for FIFO and for finding
+ * the oldest one under IOSCHED_DEADLINE.
+ */
+
+#include "io_sched.h"
+
+struct sched_entry {
+	struct work_item item;
+	uint64_t sector;
+	uint64_t arrived;		// ns
+	uint64_t seq;			// arrival order
+};
+
+struct io_sched {
+	enum sched_policy policy;
+	int window;
+	int count;
+	uint64_t max_latency_ns;
+	uint64_t next_seq;
+	uint64_t head;			// sector the sweep has reached
+	uint64_t dispatched;
+	uint64_t expired;
+	struct sched_entry *e;
+};
+
+static const char *policy_names[] = { "fifo", "cscan", "deadline" };
+
+struct io_sched *io_sched_create(enum sched_policy policy, int window,
+				 uint64_t max_latency_ns)
+{
+	struct io_sched *s = ecalloc(sizeof(*s));
+	s->policy = policy;
+	s->window = window;
+	s->max_latency_ns = max_latency_ns;
+	s->e = emalloc(window * sizeof(*s->e));
+	return s;
+}
+
+void io_sched_destroy(struct io_sched *s)
+{
+	free(s->e);
+	free(s);
+}
+
+int io_sched_count(struct io_sched *s)
+{
+	return s->count;
+}
+
+bool io_sched_full(struct io_sched *s)
+{
+	return s->count == s->window;
+}
+
+void io_sched_add(struct io_sched *s, struct work_item item, uint64_t sector,
+		  uint64_t now)
+{
+	struct sched_entry *e = &s->e[s->count++];
+	e->item = item;
+	e->sector = sector;
+	e->arrived = now;
+	e->seq = s->next_seq++;
+}
+
+static int oldest(struct io_sched *s)
+{
+	int best = 0;
+	for (int i = 1; i < s->count; ++i)
+		if (s->e[i].seq < s->e[best].seq)
+			best = i;
+	return best;
+}
+
+/* The lowest sector at or above the head, or else the lowest of all, so the
+ * sweep always runs upward; ties go to the older request */
+static int cscan(struct io_sched *s)
+{
+	int ahead = -1, lowest = 0;
+	for (int i = 0; i < s->count; ++i) {
+		struct sched_entry *e = &s->e[i];
+		if (e->sector >= s->head && (ahead == -1 ||
+		    e->sector < s->e[ahead].sector ||
+		    (e->sector == s->e[ahead].sector &&
+		     e->seq < s->e[ahead].seq)))
+			ahead = i;
+		if (e->sector < s->e[lowest].sector ||
+		    (e->sector == s->e[lowest].sector &&
+		     e->seq < s->e[lowest].seq))
+			lowest = i;
+	}
+	return ahead != -1 ? ahead : lowest;
+}
+
+int io_sched_next(struct io_sched *s, struct work_item *item, uint64_t now)
+{
+	if (!s->count)
+		return -1;
+	int i;
+	switch (s->policy) {
+	case IOSCHED_CSCAN:
+		i = cscan(s);
+		break;
+	case IOSCHED_DEADLINE:
+		i = oldest(s);
+		if (now - s->e[i].arrived >= s->max_latency_ns)
+			++s->expired;
+		else
+			i = cscan(s);
+		break;
+	default:
+		i = oldest(s);
+	}
+	*item = s->e[i].item;
+	s->head = s->e[i].sector;
+	s->e[i] = s->e[--s->count];
+	++s->dispatched;
+	return 0;
+}
+
+void io_sched_stats(struct io_sched *s, uint64_t *dispatched,
+		    uint64_t *expired)
+{
+	*dispatched = s->dispatched;
+	*expired = s->expired;
+}
+
+int sched_policy_parse(const char *spec, enum sched_policy *policy,
+		       int *window, uint64_t *max_latency_us)
+{
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? colon - spec : strlen(spec);
+	int p;
+	for (p = 0; p < sizeof(policy_names) / sizeof(policy_names[0]); ++p)
+		if (strlen(policy_names[p]) == len &&
+		    !strncmp(policy_names[p], spec, len))
+			break;
+	if (p == sizeof(policy_names) / sizeof(policy_names[0]))
+		return -1;
+
+	int w = *window;
+	unsigned long long lat = *max_latency_us;
+	if (colon) {
+		char *end;
+		w = strtol(colon + 1, &end, 10);
+		if (end == colon + 1 || w < 1)
+			return -1;
+		if (*end == ':') {
+			const char *start = end + 1;
+			lat = strtoull(start, &end, 10);
+			if (end == start)
+				return -1;
+		}
+		if (*end)
+			return -1;
+	}
+	*policy = p;
+	*window = w;
+	*max_latency_us = lat;
+	return 0;
+}
+
+const char *sched_policy_name(enum sched_policy policy)
+{
+	return policy_names[policy];
+}
+
+int sched_default_window(enum sched_policy policy)
+{
+	return policy == IOSCHED_FIFO ? IOSCHED_DEFAULT_FIFO_WINDOW :
+	       IOSCHED_DEFAULT_WINDOW;
+}
@@ -0,0 +1,73 @@
+/*
+ * Request scheduler of an I/O thread. It sits between the thread's work queue
+ * and the I/O engine: the thread takes up to a window of requests off the
+ * queue, and the scheduler picks the order they are handed to the engine in.
+ *
+ * The window bounds how far a request can be overtaken, and keeps a thread
+ * from hoarding requests the other I/O threads could steal. Requests are kept
+ * in an unsorted array and found by a scan, since windows are small.
+ */
+
+#ifndef IO_SCHED_H_
+#define IO_SCHED_H_
+
+#include <stdint.h>
+
+#include "common.h"
+#include "work_queue.h"
+
+enum sched_policy {
+	IOSCHED_FIFO,		// in arrival order
+	IOSCHED_CSCAN,		// by sector, sweeping upward and wrapping
+	IOSCHED_DEADLINE,	// C-SCAN, but a request past its deadline
+				// goes first
+};
+
+/* Defaults for the window, and for the longest a request waits for its turn
+ * in IOSCHED_DEADLINE. FIFO keeps the order requests came in whatever its
+ * window, so it only needs one wide enough for the batches whose reads are
+ * coalesced, and a narrower one leaves more for the other threads to steal. */
+#define IOSCHED_DEFAULT_WINDOW 32
+#define IOSCHED_DEFAULT_FIFO_WINDOW 8
+#define IOSCHED_DEFAULT_MAX_LATENCY_US 10000
+
+struct io_sched;
+
+/* Creates a scheduler holding at most `window` requests. `max_latency_ns` is
+ * only used by IOSCHED_DEADLINE. */
+struct io_sched *io_sched_create(enum sched_policy policy, int window,
+				 uint64_t max_latency_ns);
+
+void io_sched_destroy(struct io_sched *s);
+
+/* Number of requests held */
+int io_sched_count(struct io_sched *s);
+
+/* True if the window is full */
+bool io_sched_full(struct io_sched *s);
+
+/* Adds a request for `sector`, arrived at time `now` (in ns). The window must
+ * not be full. */
+void io_sched_add(struct io_sched *s, struct work_item item, uint64_t sector,
+		  uint64_t now);
+
+/* Takes the request to serve next into `*item`. Returns -1 if there is
+ * none. */
+int io_sched_next(struct io_sched *s, struct work_item *item, uint64_t now);
+
+/* Counts of requests dispatched, and of those IOSCHED_DEADLINE sent out of
+ * turn because their deadline had passed */
+void io_sched_stats(struct io_sched *s, uint64_t *dispatched,
+		    uint64_t *expired);
+
+/* Parses "<fifo|cscan|deadline>[:<window>[:<max_latency_us>]]". Fields left
+ * out keep the values passed in. Returns -1 if it is not that. */
+int sched_policy_parse(const char *spec, enum sched_policy *policy,
+		       int *window, uint64_t *max_latency_us);
+
+const char *sched_policy_name(enum sched_policy policy);
+
+/* The window a policy gets when none is given */
+int sched_default_window(enum sched_policy policy);
+
+#endif /* end of include guard: IO_SCHED_H_ */
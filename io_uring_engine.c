@@ -0,0 +1,231 @@
+/*
+ * io_uring engine. Each I/O thread has its own submission/completion ring.
+ * Reads are queued as SQEs and handed to the kernel in one io_uring_enter() per
+ * batch, which also collects completions. The served file and a block of
+ * bounce buffers are registered with the ring up front, so the kernel does not
+ * have to look up the file or pin pages on every read; each single-sector read
+ * is copied from its bounce buffer into the response when it completes.
+ * Multi-sector reads are too big for a bounce buffer and go straight into the
+ * caller's buffer.
+ *
+ * Talks to the kernel through the raw system calls, so liburing is not needed.
+ */
+
+/* Necessary for MAP_POPULATE */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "io_engine.h"
+#include "file_service.h"
+#include "common.h"
+
+/* Reads in flight per I/O thread, and entries in its submission queue */
+#define URING_DEPTH 64
+
+struct uring_ctx {
+	int ring_fd;
+
+	/* submission queue, shared with the kernel */
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned to_submit;
+
+	/* completion queue, shared with the kernel */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_len;
+	size_t cq_len;
+	size_t sqes_len;
+
+	/* registered bounce buffers, one sector per in-flight read */
+	char *bounce;
+	struct io_req *inflight[URING_DEPTH];
+	int free_slots[URING_DEPTH];
+	int nfree;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		       unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void uring_thread_exit(void *ctx_)
+{
+	struct uring_ctx *ctx = ctx_;
+	if (ctx->sqes)
+		munmap(ctx->sqes, ctx->sqes_len);
+	if (ctx->cq_ptr && ctx->cq_ptr != ctx->sq_ptr)
+		munmap(ctx->cq_ptr, ctx->cq_len);
+	if (ctx->sq_ptr)
+		munmap(ctx->sq_ptr, ctx->sq_len);
+	close(ctx->ring_fd);
+	free(ctx->bounce);
+	free(ctx);
+}
+
+/* Maps a region of the ring, or returns NULL */
+static void *uring_map(int ring_fd, size_t len, off_t offset)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static void *uring_thread_init(int fd)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int ring_fd = uring_setup(URING_DEPTH, &p);
+	if (ring_fd == -1)
+		return NULL;
+
+	struct uring_ctx *ctx = ecalloc(sizeof(*ctx));
+	ctx->ring_fd = ring_fd;
+	ctx->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ctx->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ctx->cq_len > ctx->sq_len)
+			ctx->sq_len = ctx->cq_len;
+		ctx->cq_len = ctx->sq_len;
+	}
+	ctx->sq_ptr = uring_map(ring_fd, ctx->sq_len, IORING_OFF_SQ_RING);
+	if (!ctx->sq_ptr)
+		goto err;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ctx->cq_ptr = ctx->sq_ptr;
+	else
+		ctx->cq_ptr = uring_map(ring_fd, ctx->cq_len,
+					IORING_OFF_CQ_RING);
+	if (!ctx->cq_ptr)
+		goto err;
+	ctx->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sqes = uring_map(ring_fd, ctx->sqes_len, IORING_OFF_SQES);
+	if (!ctx->sqes)
+		goto err;
+
+	char *sq = ctx->sq_ptr, *cq = ctx->cq_ptr;
+	ctx->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ctx->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ctx->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ctx->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ctx->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ctx->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ctx->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	if (posix_memalign((void **)&ctx->bounce, sysconf(_SC_PAGESIZE),
+			   URING_DEPTH * SECTOR_SIZE))
+		goto err;
+	struct iovec iov = { ctx->bounce, URING_DEPTH * SECTOR_SIZE };
+	if (uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1)
+		goto err;
+	if (uring_register(ring_fd, IORING_REGISTER_FILES, &fd, 1) == -1)
+		goto err;
+
+	for (int i = 0; i < URING_DEPTH; ++i)
+		ctx->free_slots[i] = i;
+	ctx->nfree = URING_DEPTH;
+	return ctx;
+err:
+	uring_thread_exit(ctx);
+	return NULL;
+}
+
+/* Queues a read, into a free bounce buffer if it is a single sector. It is not
+ * seen by the kernel until the next uring_poll(). */
+static void uring_submit(void *ctx_, struct io_req *req)
+{
+	struct uring_ctx *ctx = ctx_;
+	int slot = ctx->free_slots[--ctx->nfree];
+	ctx->inflight[slot] = req;
+
+	unsigned tail = *ctx->sq_tail;
+	unsigned idx = tail & *ctx->sq_mask;
+	struct io_uring_sqe *sqe = &ctx->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 0;			// index into the registered files
+	if (req->count == 1) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)(ctx->bounce + slot * SECTOR_SIZE);
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = IORING_OP_READ;
+		sqe->addr = (uintptr_t)req->buf;
+	}
+	sqe->len = req->count * SECTOR_SIZE;
+	sqe->off = (uint64_t)req->sector * SECTOR_SIZE;
+	sqe->user_data = slot;
+	ctx->sq_array[idx] = idx;
+	__atomic_store_n(ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ctx->to_submit;
+}
+
+static void uring_poll(void *ctx_, int wait)
+{
+	struct uring_ctx *ctx = ctx_;
+	if (ctx->to_submit || wait) {
+		int n;
+		do {
+			n = uring_enter(ctx->ring_fd, ctx->to_submit,
+					wait ? 1 : 0,
+					wait ? IORING_ENTER_GETEVENTS : 0);
+		} while (n == -1 && errno == EINTR);
+		if (n == -1)
+			fail_en("io_uring_enter");
+		ctx->to_submit -= n;
+	}
+
+	unsigned head = *ctx->cq_head;
+	unsigned tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ctx->cqes[head & *ctx->cq_mask];
+		int slot = cqe->user_data;
+		int res = cqe->res;
+		struct io_req *req = ctx->inflight[slot];
+		int len = req->count * SECTOR_SIZE;
+		int got = res > 0 ? res : 0;
+		if (req->count == 1)
+			memcpy(req->buf, ctx->bounce + slot * SECTOR_SIZE, got);
+		memset(req->buf + got, 0, len - got);
+		req->error = res < 0 ? -res : 0;
+		ctx->free_slots[ctx->nfree++] = slot;
+		++head;
+		__atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+		req->complete(req);
+	}
+}
+
+const struct io_engine io_engine_uring = {
+	.name = "uring",
+	.queue_depth = URING_DEPTH,
+	.thread_init = &uring_thread_init,
+	.thread_exit = &uring_thread_exit,
+	.submit = &uring_submit,
+	.poll = &uring_poll,
+};
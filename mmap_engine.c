@@ -0,0 +1,134 @@
+/*
+ * mmap engine. Each image is mapped into the server once, the first time an
+ * I/O thread for it starts, and kept mapped until the server exits. A read is
+ * a copy straight from the mapping into the response, with no system call;
+ * once the image is in the page cache the kernel is not involved at all.
+ *
+ * Options (after "mmap:", comma separated):
+ * 	populate	fault the whole image in when it is mapped
+ * 	huge		ask for transparent huge pages for the mapping
+ */
+
+/* Necessary for MAP_POPULATE and MADV_HUGEPAGE */
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "io_engine.h"
+#include "file_service.h"
+#include "common.h"
+
+struct mmap_image {
+	int fd;
+	char *base;			// NULL for an empty file
+	size_t len;
+};
+
+static struct {
+	pthread_mutex_t mtx;		// protects everything below
+	struct mmap_image images[FS_MAX_VOLUMES];
+	int count;
+	bool populate;
+	bool huge;
+} image = { PTHREAD_MUTEX_INITIALIZER };
+
+static int mmap_configure(const char *opts)
+{
+	char buf[64];
+	strncpy(buf, opts, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	char *save;
+	for (char *o = strtok_r(buf, ",", &save); o;
+	     o = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(o, "populate"))
+			image.populate = True;
+		else if (!strcmp(o, "huge"))
+			image.huge = True;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+/* Maps the image of `fd` if nobody has yet. Returns NULL if it cannot be
+ * mapped. */
+static struct mmap_image *map_image(int fd)
+{
+	struct mmap_image *m = NULL;
+	pthread_mutex_lock(&image.mtx);
+	for (int i = 0; i < image.count; ++i)
+		if (image.images[i].fd == fd) {
+			m = &image.images[i];
+			goto out;
+		}
+	if (image.count == FS_MAX_VOLUMES)
+		goto out;
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		goto out;
+	struct mmap_image *new = &image.images[image.count];
+	new->fd = fd;
+	new->base = NULL;
+	new->len = st.st_size;
+	if (new->len) {
+		int flags = MAP_SHARED | (image.populate ? MAP_POPULATE : 0);
+		void *p = mmap(NULL, new->len, PROT_READ, flags, fd, 0);
+		if (p == MAP_FAILED)
+			goto out;
+		/* best effort: not every filesystem can back a file mapping
+		 * with huge pages */
+		if (image.huge)
+			madvise(p, new->len, MADV_HUGEPAGE);
+		new->base = p;
+	}
+	m = new;
+	++image.count;
+out:
+	pthread_mutex_unlock(&image.mtx);
+	return m;
+}
+
+static void *mmap_thread_init(int fd)
+{
+	return map_image(fd);
+}
+
+static void mmap_thread_exit(void *ctx)
+{
+	/* the mapping is shared by every thread and kept until exit */
+}
+
+static void mmap_submit(void *ctx, struct io_req *req)
+{
+	struct mmap_image *m = ctx;
+	checkpoint("filling %d sectors from %d", req->count, req->sector);
+	size_t start = (size_t)req->sector * SECTOR_SIZE;
+	size_t len = (size_t)req->count * SECTOR_SIZE;
+	size_t got = 0;
+	if (start < m->len) {
+		got = m->len - start;
+		if (got > len)
+			got = len;
+		memcpy(req->buf, m->base + start, got);
+	}
+	memset(req->buf + got, 0, len - got);
+	req->error = 0;
+	req->complete(req);
+}
+
+static void mmap_poll(void *ctx, int wait)
+{
+	/* everything completes in submit() */
+}
+
+const struct io_engine io_engine_mmap = {
+	.name = "mmap",
+	.queue_depth = 1,
+	.configure = &mmap_configure,
+	.thread_init = &mmap_thread_init,
+	.thread_exit = &mmap_thread_exit,
+	.submit = &mmap_submit,
+	.poll = &mmap_poll,
+};
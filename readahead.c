@@ -0,0 +1,103 @@
+/*
+ * Readahead stream detection. A client has only a few streams, so they are
+ * searched linearly and the least recently extended one is replaced.
+ */
+
+#include "readahead.h"
+
+/* Notes that a stream is being given up on or restarted, cutting the window
+ * if it had records prefetched that it never asked for */
+static void abandon(struct ra_state *ra, struct ra_stream *s)
+{
+	if (s->next > s->last + s->stride) {
+		ra->window /= 4;
+		if (ra->window < RA_MIN_WINDOW)
+			ra->window = RA_MIN_WINDOW;
+		++ra->wasted;
+	}
+	s->run = 0;
+	s->next = 0;
+}
+
+/* The stream a request belongs to: one it extends, by landing a stride on or
+ * anywhere in what has been prefetched, or else one whose last request it
+ * could follow at a new stride, or else the least recently used one, started
+ * afresh */
+static struct ra_stream *find_stream(struct ra_state *ra, int sector, int count)
+{
+	struct ra_stream *pair = NULL, *lru = &ra->s[0];
+	for (int i = 0; i < RA_STREAMS; ++i) {
+		struct ra_stream *s = &ra->s[i];
+		if (s->len != count) {
+			if (s->used < lru->used)
+				lru = s;
+			continue;
+		}
+		if (s->run && (sector == s->last + s->stride ||
+			       (sector > s->last && sector < s->next))) {
+			++s->run;
+			return s;
+		}
+		int d = sector - s->last;
+		if (d >= count && d <= RA_MAX_STRIDE &&
+		    (!pair || s->used > pair->used))
+			pair = s;
+		if (s->used < lru->used)
+			lru = s;
+	}
+	if (pair) {
+		abandon(ra, pair);
+		pair->stride = sector - pair->last;
+		pair->run = 1;
+		return pair;
+	}
+	abandon(ra, lru);
+	lru->len = count;
+	lru->stride = 0;
+	return lru;
+}
+
+int readahead_observe(struct ra_state *ra, int sector, int count,
+		      int max_window, struct ra_plan *plan)
+{
+	plan->n = 0;
+	if (max_window < 1 || count < 1 || sector < 0)
+		return 0;
+	if (!ra->window)
+		ra->window = RA_INIT_WINDOW;
+	if (ra->window > max_window)
+		ra->window = max_window;
+
+	struct ra_stream *s = find_stream(ra, sector, count);
+	s->last = sector;
+	s->used = ++ra->tick;
+	if (s->run < RA_TRIGGER)
+		return 0;
+
+	/* the record asked for was prefetched, so the window is paying off */
+	bool hit = s->next > sector;
+	if (!hit)
+		s->next = sector + s->stride;
+	int ahead = (s->next - sector) / s->stride - 1;
+	int want = ra->window / count;
+	if (ahead > (want > 1 ? want : 1) / 2)
+		return 0;
+	if (hit) {
+		ra->window *= 2;
+		if (ra->window > max_window)
+			ra->window = max_window;
+		want = ra->window / count;
+	}
+	if (want < 1)
+		want = 1;
+	if (s->stride != count && want > RA_MAX_RECORDS)
+		want = RA_MAX_RECORDS;
+	if (want <= ahead)
+		return 0;
+	plan->sector = s->next;
+	plan->count = count;
+	plan->stride = s->stride;
+	plan->n = want - ahead;
+	s->next += plan->n * s->stride;
+	return plan->n;
+}
@@ -0,0 +1,75 @@
+/*
+ * Readahead: spotting a client reading the file in order, and deciding what
+ * to read into the sector cache ahead of it.
+ *
+ * Each client has a few streams. A request that lands where a stream's stride
+ * says the next one should, or anywhere in what has been prefetched for it,
+ * extends it; a stream that has moved on by the same stride RA_TRIGGER times
+ * in a row, with requests of the same length, is prefetched for. The window
+ * of sectors kept read ahead starts small, doubles each time a stream catches
+ * up with half of it, and is cut to a quarter when a stream breaks off with
+ * prefetched records it never asked for.
+ *
+ * A client's requests are all seen by the one thread that serves its ring, so
+ * nothing here is locked.
+ */
+
+#ifndef READAHEAD_H_
+#define READAHEAD_H_
+
+#include <stdint.h>
+
+#include "common.h"
+
+/* streams followed per client */
+#define RA_STREAMS 4
+
+/* steps in a row at one stride before prefetching starts */
+#define RA_TRIGGER 2
+
+/* farthest apart, in sectors, two requests of a stream may be */
+#define RA_MAX_STRIDE 1024
+
+/* most records of a strided (not contiguous) stream prefetched at once */
+#define RA_MAX_RECORDS 64
+
+/* window sizes, in sectors */
+#define RA_MIN_WINDOW 8
+#define RA_INIT_WINDOW 16
+#define RA_DEFAULT_MAX_WINDOW 256
+#define RA_MAX_WINDOW 1024
+
+struct ra_stream {
+	int last;			// sector of its last request
+	int len;			// sectors per request
+	int stride;			// sectors between requests
+	int run;			// requests in a row at that stride
+	int next;			// sector of the first record not
+					// prefetched, or 0 if none is
+	uint64_t used;			// when it was last extended
+};
+
+struct ra_state {
+	struct ra_stream s[RA_STREAMS];
+	int window;			// sectors to keep read ahead
+	uint64_t tick;
+	uint64_t wasted;		// times the window was cut
+};
+
+/* What to prefetch: `n` records of `count` sectors, the first at `sector` and
+ * each `stride` sectors after the one before. They are contiguous if `stride`
+ * is `count`. */
+struct ra_plan {
+	int sector;
+	int count;
+	int stride;
+	int n;				// 0 for nothing
+};
+
+/* Notes a request for `count` sectors from `sector`, and fills in what should
+ * be prefetched because of it, with a window of at most `max_window` sectors.
+ * Returns plan->n. */
+int readahead_observe(struct ra_state *ra, int sector, int count,
+		      int max_window, struct ra_plan *plan);
+
+#endif /* end of include guard: READAHEAD_H_ */
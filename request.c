@@ -0,0 +1,37 @@
+/*
+ * Checks of the requests clients put on their rings. Nothing a client sends
+ * is trusted: a request is only served once it names sectors of the volume
+ * and, for a write, a run of its pool that holds the data.
+ */
+
+#include "file_service.h"
+#include "common.h"
+
+bool fs_request_valid(const struct fs_request *q, int volume, int nsectors)
+{
+	if (q->volume != volume)
+		return False;
+	switch (q->op) {
+	case FS_READ:
+		return q->sector >= 0 && q->sector < nsectors;
+	case FS_WRITE:
+		if (q->buf < 0 ||
+		    q->buf > FS_POOL_BUFFERS - FS_POOL_BUFFERS_FOR(q->count))
+			return False;
+		/* fall through */
+	case FS_READ_RANGE:
+		return q->count >= 1 && q->count <= FS_MAX_SECTORS &&
+		       q->sector >= 0 && q->sector <= nsectors - q->count;
+	case FS_READ_VEC:
+		if (q->count < 1 || q->count > FS_MAX_VEC)
+			return False;
+		for (int i = 0; i < q->count; ++i)
+			if (q->vec[i] < 0 || q->vec[i] >= nsectors)
+				return False;
+		return True;
+	case FS_FLUSH:
+		return True;
+	default:
+		return False;
+	}
+}
@@ -0,0 +1,170 @@
+/*
+ * Double-buffered result files. The lock covers the buffer being filled and
+ * the hand-over; the writer writes the other buffer without it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "result_stream.h"
+#include "file_service.h"
+
+/* most characters a sector number takes, with its newline (sprintf()
+ * also writes a '\0' after the last, so a buffer has room for one more) */
+#define SECTOR_TEXT 12
+
+struct rs_buf {
+	char *data;
+	size_t data_len;
+	char *text;
+	size_t text_len;
+};
+
+struct result_stream {
+	int data_fd;
+	int sectors_fd;
+	size_t cap;			// data bytes in a buffer
+	pthread_mutex_t mtx;
+	pthread_cond_t full;		// for the writer: a buffer to write
+	pthread_cond_t written;		// for appenders: the writer is done
+	struct rs_buf buf[2];
+	int active;			// the buffer being filled
+	bool writing;			// the other one is the writer's
+	bool stop;
+	int error;
+	pthread_t writer;
+};
+
+/* Writes all of `len` bytes, or returns an errno value */
+static int write_all(int fd, const char *p, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *writer(void *arg)
+{
+	struct result_stream *rs = arg;
+	pthread_mutex_lock(&rs->mtx);
+	for (;;) {
+		while (!rs->writing && !rs->stop)
+			pthread_cond_wait(&rs->full, &rs->mtx);
+		if (!rs->writing)
+			break;
+		struct rs_buf *b = &rs->buf[!rs->active];
+		pthread_mutex_unlock(&rs->mtx);
+
+		int error = write_all(rs->data_fd, b->data, b->data_len);
+		if (!error)
+			error = write_all(rs->sectors_fd, b->text, b->text_len);
+		b->data_len = 0;
+		b->text_len = 0;
+
+		pthread_mutex_lock(&rs->mtx);
+		if (error && !rs->error)
+			rs->error = error;
+		rs->writing = False;
+		pthread_cond_broadcast(&rs->written);
+	}
+	pthread_mutex_unlock(&rs->mtx);
+	return NULL;
+}
+
+/* Hands the buffer being filled to the writer, once it is done with the
+ * other, and starts filling that one */
+static void swap_locked(struct result_stream *rs)
+{
+	while (rs->writing)
+		pthread_cond_wait(&rs->written, &rs->mtx);
+	rs->active = !rs->active;
+	rs->writing = True;
+	pthread_cond_signal(&rs->full);
+}
+
+struct result_stream *result_stream_open(const char *data_path,
+					 const char *sectors_path,
+					 size_t bytes)
+{
+	int data_fd = open(data_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (data_fd < 0)
+		return NULL;
+	int sectors_fd = open(sectors_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (sectors_fd < 0) {
+		int error = errno;
+		close(data_fd);
+		errno = error;
+		return NULL;
+	}
+
+	struct result_stream *rs = ecalloc(sizeof(*rs));
+	rs->data_fd = data_fd;
+	rs->sectors_fd = sectors_fd;
+	rs->cap = bytes / SECTOR_SIZE;
+	if (rs->cap < FS_MAX_SECTORS)
+		rs->cap = FS_MAX_SECTORS;
+	for (int i = 0; i < 2; ++i) {
+		rs->buf[i].data = emalloc(rs->cap * SECTOR_SIZE);
+		rs->buf[i].text = emalloc(rs->cap * SECTOR_TEXT + 1);
+	}
+	rs->cap *= SECTOR_SIZE;
+	pthread_mutex_init(&rs->mtx, NULL);
+	pthread_cond_init(&rs->full, NULL);
+	pthread_cond_init(&rs->written, NULL);
+	if ((errno = pthread_create(&rs->writer, NULL, &writer, rs)))
+		fail_en("pthread_create");
+	return rs;
+}
+
+void result_stream_append(struct result_stream *rs, const int *sectors,
+			  const char *data, int count)
+{
+	size_t len = (size_t)count * SECTOR_SIZE;
+	pthread_mutex_lock(&rs->mtx);
+	struct rs_buf *b = &rs->buf[rs->active];
+	if (b->data_len + len > rs->cap) {
+		swap_locked(rs);
+		b = &rs->buf[rs->active];
+	}
+	memcpy(b->data + b->data_len, data, len);
+	b->data_len += len;
+	for (int i = 0; i < count; ++i)
+		b->text_len += sprintf(b->text + b->text_len, "%d\n",
+				       sectors[i]);
+	pthread_mutex_unlock(&rs->mtx);
+}
+
+int result_stream_close(struct result_stream *rs)
+{
+	pthread_mutex_lock(&rs->mtx);
+	if (rs->buf[rs->active].data_len)
+		swap_locked(rs);
+	rs->stop = True;
+	pthread_cond_signal(&rs->full);
+	pthread_mutex_unlock(&rs->mtx);
+	pthread_join(rs->writer, NULL);
+
+	int error = rs->error;
+	if (close(rs->data_fd) && !error)
+		error = errno;
+	if (close(rs->sectors_fd) && !error)
+		error = errno;
+	for (int i = 0; i < 2; ++i) {
+		free(rs->buf[i].data);
+		free(rs->buf[i].text);
+	}
+	pthread_mutex_destroy(&rs->mtx);
+	pthread_cond_destroy(&rs->full);
+	pthread_cond_destroy(&rs->written);
+	free(rs);
+	return error;
+}
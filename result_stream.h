@@ -0,0 +1,41 @@
+/*
+ * Streams the client's results to its result files as they come in: the data
+ * of each request to one file, and its sector numbers, one per line, to
+ * another, so the two can be checked against each other and the image.
+ *
+ * A stream has two buffers. The client's threads copy results into one while
+ * a writer thread writes the other out in a few large writes; once the one
+ * being filled is full they swap, and the threads wait only if the writer has
+ * not caught up yet. The client holds no more than the two buffers however
+ * many requests it makes.
+ */
+
+#ifndef RESULT_STREAM_H_
+#define RESULT_STREAM_H_
+
+#include <stddef.h>
+
+#include "common.h"
+
+/* Default bytes of data in each buffer */
+#define RS_DEFAULT_BYTES (4 << 20)
+
+struct result_stream;
+
+/* Creates (or truncates) the two files and starts the writer. Each buffer
+ * holds `bytes` of data, and at least FS_MAX_SECTORS sectors' worth. Returns
+ * NULL, with errno set, if a file cannot be created. */
+struct result_stream *result_stream_open(const char *data_path,
+					 const char *sectors_path,
+					 size_t bytes);
+
+/* Adds the results of a request for the `count` sectors listed in `sectors`,
+ * whose data (SECTOR_SIZE bytes each) is in `data` */
+void result_stream_append(struct result_stream *rs, const int *sectors,
+			  const char *data, int count);
+
+/* Writes out what is left, stops the writer and closes the files. Returns 0,
+ * or an errno value if a write failed. */
+int result_stream_close(struct result_stream *rs);
+
+#endif /* end of include guard: RESULT_STREAM_H_ */
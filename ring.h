@@ -3,12 +3,286 @@
  * buffers.  These macros allow for the creation of ring buffers of arbitrary
  * request and response types, with user-defined request handling.
  *
+ * Two flavours of ring are available, chosen when the ring types are defined:
+ *
+ * 	DEFINE_RING_TYPES
+ * 		Semaphores guard the free/full slot counts and each slot has its
+ * 		own process-shared mutex and condvar for the response handshake.
+ *
+ * 	DEFINE_LOCKFREE_RING_TYPES
+ * 		Clients claim slots through an atomic producer index and every
+ * 		slot carries a sequence number, so the fast path is a handful of
+ * 		atomic operations in shared memory. How a side that finds
+ * 		nothing to do waits is set by its wait policy (see
+ * 		rb_wait_policy below); futex wakes are only issued when somebody
+ * 		is actually asleep. The slot count must be a power of two.
+ *
+ * Both flavours generate the same set of `<tag>_rb_*` functions, so the
+ * RB_INIT/RB_MAKE_REQUEST/RB_SERVE macros below work with either one.
+ *
  * Note that the line continuation markers assume an 8-space tab width.
  */
 
 #ifndef RING_H_
 #define RING_H_
 
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* Size of a cache line. Words written by the client side of a ring and words
+ * written by the server side are kept on separate lines, and so are the
+ * headers and payloads of the slots, so the two sides do not keep stealing
+ * lines from each other. */
+#define RB_CACHE_LINE 64
+#define RB_CACHE_ALIGNED __attribute__((aligned(RB_CACHE_LINE)))
+
+/* Number of times to poll a shared word before going to sleep on it, by
+ * default */
+#define RB_SPIN_LIMIT 1000
+
+/* Longest an adaptive waiter spins. A wait expected to be longer than this is
+ * cheaper to sleep through. */
+#define RB_ADAPTIVE_MAX_NS 50000
+
+/* Shortest an adaptive waiter spins, when it spins at all */
+#define RB_ADAPTIVE_MIN_NS 1000
+
+/* How often a busy-polling waiter yields the CPU and checks for cancellation,
+ * in polls. Yielding costs next to nothing on a core of its own, and keeps a
+ * busy poller from holding up the thread it waits for when it does not. */
+#define RB_BUSY_YIELD_POLLS 4096
+
+/* How long a cancellable waiter sleeps before checking for cancellation */
+#define RB_CANCEL_POLL_NS 100000000
+
+/* Tells the CPU we are in a spin loop */
+static inline void rb_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* How a waiter waits for a shared word to change */
+enum rb_wait_mode {
+	RB_POLICY_BLOCK,	// sleep on the futex straight away
+	RB_POLICY_SPIN,		// poll `spin` times, then sleep
+	RB_POLICY_ADAPTIVE,	// poll for about twice the recent wait, then
+				// sleep
+	RB_POLICY_BUSY,		// poll until it changes: for dedicated cores
+};
+
+/* A wait policy, and what an adaptive waiter has learned. One is kept for
+ * each side of a ring, so a client and the server can wait differently. */
+struct rb_wait_policy {
+	uint32_t mode;
+	uint32_t spin;			// polls, in RB_POLICY_SPIN
+	uint32_t avg_ns;		// recent wait, in RB_POLICY_ADAPTIVE
+};
+
+#define RB_WAIT_POLICY_DEFAULT { RB_POLICY_SPIN, RB_SPIN_LIMIT, 0 }
+
+/* Parses a wait policy: "block", "spin" or "spin:<polls>", "adaptive" or
+ * "busy". Returns 0, or -1 if it is not one. */
+static inline int rb_wait_policy_parse(const char *str,
+				       struct rb_wait_policy *pol)
+{
+	struct rb_wait_policy p = RB_WAIT_POLICY_DEFAULT;
+	if (!strcmp(str, "block")) {
+		p.mode = RB_POLICY_BLOCK;
+	} else if (!strncmp(str, "spin", 4)) {
+		if (str[4] == ':') {
+			char *end;
+			long n = strtol(str + 5, &end, 10);
+			if (end == str + 5 || *end || n < 0 || n > INT_MAX)
+				return -1;
+			p.spin = n;
+		} else if (str[4]) {
+			return -1;
+		}
+	} else if (!strcmp(str, "adaptive")) {
+		p.mode = RB_POLICY_ADAPTIVE;
+	} else if (!strcmp(str, "busy")) {
+		p.mode = RB_POLICY_BUSY;
+	} else {
+		return -1;
+	}
+	*pol = p;
+	return 0;
+}
+
+static inline uint64_t rb_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Sleeps while `*addr == val`. The ring lives in memory shared between
+ * processes, so the non-private futex operations are used. */
+static inline void rb_futex_wait(uint32_t *addr, uint32_t val,
+				 const struct timespec *timeout)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static inline void rb_futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline void rb_futex_wake_one(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Sets a shared word and wakes anybody sleeping on it. The store and the load
+ * of `waiters` are both sequentially consistent, pairing with rb_wait_while(),
+ * so either the waiter sees the new value or we see the waiter. */
+static inline void rb_word_set(uint32_t *word, uint32_t val, uint32_t *waiters)
+{
+	__atomic_store_n(word, val, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+		rb_futex_wake(word);
+}
+
+/* Bumps a shared counter and wakes anybody sleeping on it */
+static inline void rb_word_inc(uint32_t *word, uint32_t *waiters)
+{
+	__atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+		rb_futex_wake(word);
+}
+
+/* Sleeps on the futex until `*word` no longer holds `old`. A `cancellable`
+ * waiter wakes up periodically to act on pthread_cancel(), since a raw futex
+ * syscall is not a cancellation point. */
+static inline void rb_sleep_while(uint32_t *word, uint32_t old,
+				  uint32_t *waiters, int cancellable)
+{
+	struct timespec poll = { 0, RB_CANCEL_POLL_NS };
+	for (;;) {
+		__atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == old)
+			rb_futex_wait(word, old, cancellable ? &poll : NULL);
+		__atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old)
+			return;
+		if (cancellable)
+			pthread_testcancel();
+	}
+}
+
+/* Polls `*word` up to `polls` times. Returns 1 if it stopped holding `old`. */
+static inline int rb_spin_while(uint32_t *word, uint32_t old, uint32_t polls)
+{
+	for (uint32_t i = 0; i < polls; ++i) {
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old)
+			return 1;
+		rb_cpu_relax();
+	}
+	return 0;
+}
+
+/* Spins for twice the policy's average wait, if that is short enough to be
+ * worth it, then sleeps; then folds how long this wait took into the
+ * average. The average is shared by every thread waiting under the policy,
+ * and the updates may race, which only costs a sample now and then. */
+static inline void rb_wait_adaptive(uint32_t *word, uint32_t old,
+				    uint32_t *waiters,
+				    struct rb_wait_policy *pol, int cancellable)
+{
+	uint64_t start = rb_now_ns();
+	uint64_t avg = __atomic_load_n(&pol->avg_ns, __ATOMIC_RELAXED);
+	uint64_t budget = avg * 2 < RB_ADAPTIVE_MIN_NS ? RB_ADAPTIVE_MIN_NS :
+			  avg * 2;
+	int changed = 0;
+	if (budget <= RB_ADAPTIVE_MAX_NS) {
+		/* the clock is only read every 32 polls */
+		while (!(changed = rb_spin_while(word, old, 32)) &&
+		       rb_now_ns() - start < budget)
+			;
+	}
+	if (!changed)
+		rb_sleep_while(word, old, waiters, cancellable);
+	uint64_t took = rb_now_ns() - start;
+	if (took > UINT32_MAX)
+		took = UINT32_MAX;
+	avg += ((int64_t)took - (int64_t)avg) / 8;
+	__atomic_store_n(&pol->avg_ns, (uint32_t)avg, __ATOMIC_RELAXED);
+}
+
+/* Waits until `*word` no longer holds `old`, the way `pol` says to. A
+ * `cancellable` waiter acts on pthread_cancel() while it waits. */
+static inline void rb_wait_while(uint32_t *word, uint32_t old,
+				 uint32_t *waiters,
+				 struct rb_wait_policy *pol, int cancellable)
+{
+	if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old)
+		return;
+	switch (__atomic_load_n(&pol->mode, __ATOMIC_RELAXED)) {
+	case RB_POLICY_BUSY:
+		while (!rb_spin_while(word, old, RB_BUSY_YIELD_POLLS)) {
+			if (cancellable)
+				pthread_testcancel();
+			sched_yield();
+		}
+		return;
+	case RB_POLICY_ADAPTIVE:
+		rb_wait_adaptive(word, old, waiters, pol, cancellable);
+		return;
+	case RB_POLICY_SPIN:
+		if (rb_spin_while(word, old, pol->spin))
+			return;
+		break;
+	}
+	rb_sleep_while(word, old, waiters, cancellable);
+}
+
+/* Waits until `*word == val`. Only valid if nobody can move the word past `val`
+ * until the caller has acted on it. */
+static inline void rb_wait_until(uint32_t *word, uint32_t val,
+				 uint32_t *waiters,
+				 struct rb_wait_policy *pol, int cancellable)
+{
+	uint32_t cur;
+	while ((cur = __atomic_load_n(word, __ATOMIC_ACQUIRE)) != val)
+		rb_wait_while(word, cur, waiters, pol, cancellable);
+}
+
+/* Fails to compile (negative array size) if `_cond` is false */
+#define RB_STATIC_ASSERT(_cond, _name)					\
+	typedef char _name[(_cond) ? 1 : -1]
+
+/* Fails to compile unless fields `_a` and `_b` of `_type` are on different
+ * cache lines, `_a` coming first */
+#define RB_ASSERT_APART(_type, _a, _b, _name)				\
+	RB_STATIC_ASSERT(offsetof(_type, _b) / RB_CACHE_LINE >		\
+			 offsetof(_type, _a) / RB_CACHE_LINE, _name)
+
+/* Checks the layout of a ring's slots, whatever the request and response
+ * types: each slot starts on a cache line and its payload starts on a line of
+ * its own, after the slot's header */
+#define RB_ASSERT_SLOT_LAYOUT(_tag)					\
+RB_STATIC_ASSERT(sizeof(struct _tag##_sring_slot) % RB_CACHE_LINE == 0,	\
+		 _tag##_slots_fill_whole_lines);			\
+RB_STATIC_ASSERT(offsetof(struct _tag##_sring_slot, entry) %		\
+		 RB_CACHE_LINE == 0, _tag##_payload_is_line_aligned);	\
+RB_STATIC_ASSERT(offsetof(struct _tag##_sring, ring) %			\
+		 RB_CACHE_LINE == 0, _tag##_slots_are_line_aligned)
+
 /* Defines the types for the ring buffer. Takes in a `_tag` that will be used in
  * defining the type and also in the request/response macros below. Also take
  * in the type of the request, `__req_t`; the type of the response, `__rsp_t`;
@@ -35,6 +309,7 @@
  * 		be passed into shm_open(), and it is to pointers of this type that
  * 		the return of shm_open() should be cast to.
  *
+ * and the functions used by the RB_* macros below.
  */
 #define DEFINE_RING_TYPES(_tag, __req_t, __rsp_t, _slot_count)		\
 typedef __req_t _tag##_req_t;						\
@@ -48,27 +323,34 @@ struct _tag##_sring_slot {						\
 	pthread_mutex_t mutex;						\
 	pthread_cond_t condvar;						\
 	int done;							\
-	union _tag##_sring_entry entry;					\
-};									\
+	union _tag##_sring_entry entry RB_CACHE_ALIGNED;		\
+} RB_CACHE_ALIGNED;							\
 									\
 struct _tag##_sring {							\
-	sem_t empty;							\
-	sem_t full;							\
-	sem_t mtx;							\
+	int slot_count;			/* never written after init */	\
+	sem_t empty RB_CACHE_ALIGNED;	/* waited on by clients */	\
+	sem_t full RB_CACHE_ALIGNED;	/* waited on by the server */	\
+	sem_t mtx RB_CACHE_ALIGNED;	/* client side only */		\
 	int client_index;						\
-	int slot_count;							\
 	struct _tag##_sring_slot ring[_slot_count];			\
-}
-
-/* Initialize a given ring. `_tag` is the tag used to create the data types,
- * `_ring` is a pointer to the shared memory (assumed already created), and
- * `_slot_count` is the number of elements that can fit in the ring buffer */
-#define RB_INIT(_tag, _ring, _slot_count) do {				\
-	(_ring)->slot_count = (_slot_count);				\
-	sem_init(&(_ring)->empty, 1, (_ring)->slot_count);		\
-	sem_init(&(_ring)->full, 1, 0);					\
-	sem_init(&(_ring)->mtx, 1, 1);					\
-	(_ring)->client_index = 0;					\
+};									\
+									\
+RB_ASSERT_SLOT_LAYOUT(_tag);						\
+RB_ASSERT_APART(struct _tag##_sring, slot_count, empty,			\
+		_tag##_count_apart_from_empty);				\
+RB_ASSERT_APART(struct _tag##_sring, empty, full,			\
+		_tag##_empty_apart_from_full);				\
+RB_ASSERT_APART(struct _tag##_sring, full, mtx,				\
+		_tag##_full_apart_from_mtx);				\
+									\
+static inline void _tag##_rb_init(struct _tag##_sring *_ring,		\
+				  int _count)				\
+{									\
+	_ring->slot_count = _count;					\
+	sem_init(&_ring->empty, 1, _ring->slot_count);			\
+	sem_init(&_ring->full, 1, 0);					\
+	sem_init(&_ring->mtx, 1, 1);					\
+	_ring->client_index = 0;					\
 									\
 	pthread_mutexattr_t m_attr;					\
 	pthread_mutexattr_init(&m_attr);				\
@@ -77,43 +359,381 @@ struct _tag##_sring {							\
 	pthread_condattr_init(&c_attr);					\
 	pthread_condattr_setpshared(&c_attr, PTHREAD_PROCESS_SHARED);	\
 	struct _tag##_sring_slot *slot;					\
-	for (int i = 0; i < (_ring)->slot_count; ++i) {			\
-		slot = &(_ring)->ring[i];				\
+	for (int i = 0; i < _ring->slot_count; ++i) {			\
+		slot = &_ring->ring[i];					\
 		pthread_mutex_init(&slot->mutex, &m_attr);		\
 		pthread_cond_init(&slot->condvar, &c_attr);		\
 		slot->done = 0;						\
 	}								\
-} while (0)
-
-/* For the client, makes a request and then blocks, waiting for a response.
- * `_req_ptr` should be the address of the request, and is first copied into the
- * shared buffer. The server's response is copied to `rsp_ptr` when the server
- * completes its response */
-#define RB_MAKE_REQUEST(_tag, _ring, _req_ptr, _rsp_ptr) do {		\
-	sem_wait(&(_ring)->empty);					\
-	sem_wait(&(_ring)->mtx);					\
+}									\
+									\
+static inline void _tag##_rb_make_request(struct _tag##_sring *_ring,	\
+					  const _tag##_req_t *_req,	\
+					  _tag##_rsp_t *_rsp)		\
+{									\
+	sem_wait(&_ring->empty);					\
+	sem_wait(&_ring->mtx);						\
 									\
-	struct _tag##_sring_slot *slot = 				\
-		&(_ring)->ring[(_ring)->client_index];			\
+	struct _tag##_sring_slot *slot =				\
+		&_ring->ring[_ring->client_index];			\
 	pthread_mutex_lock(&slot->mutex);				\
-	slot->entry.req = *(_req_ptr);					\
+	slot->entry.req = *_req;					\
 	slot->done = 0;							\
 	pthread_mutex_unlock(&slot->mutex);				\
 									\
-	(_ring)->client_index = ((_ring)->client_index + 1) %		\
-			(_ring)->slot_count;				\
+	_ring->client_index = (_ring->client_index + 1) %		\
+			_ring->slot_count;				\
 									\
-	sem_post(&(_ring)->mtx);					\
-	sem_post(&(_ring)->full);					\
+	sem_post(&_ring->mtx);						\
+	sem_post(&_ring->full);						\
 									\
 	pthread_mutex_lock(&slot->mutex);				\
 	while(!slot->done)						\
 		pthread_cond_wait(&slot->condvar, &slot->mutex);	\
-	*(_rsp_ptr) = slot->entry.rsp;					\
+	*_rsp = slot->entry.rsp;					\
 	slot->done = 0;							\
 	pthread_cond_signal(&slot->condvar);				\
 	pthread_mutex_unlock(&slot->mutex);				\
-} while (0)
+}									\
+									\
+/* Positions are slot indexes, kept below slot_count as they advance: the	\
+ * slot count need not divide 2^32, so a free-running counter taken	\
+ * modulo it would land on the wrong slot once it wrapped */		\
+static inline uint32_t _tag##_rb_next_pos(struct _tag##_sring *_ring,	\
+					  uint32_t _pos)		\
+{									\
+	return _pos + 1 == (uint32_t)_ring->slot_count ? 0 : _pos + 1;	\
+}									\
+									\
+static inline union _tag##_sring_entry *				\
+_tag##_rb_serve_wait(struct _tag##_sring *_ring, uint32_t _pos)		\
+{									\
+	sem_wait(&_ring->full);						\
+	struct _tag##_sring_slot *slot = &_ring->ring[_pos];		\
+	pthread_mutex_lock(&slot->mutex);				\
+	return &slot->entry;						\
+}									\
+									\
+static inline void _tag##_rb_serve_done(struct _tag##_sring *_ring,	\
+					uint32_t _pos)			\
+{									\
+	struct _tag##_sring_slot *slot = &_ring->ring[_pos];		\
+	slot->done = 1;							\
+	pthread_cond_signal(&slot->condvar);				\
+	while (slot->done)						\
+		pthread_cond_wait(&slot->condvar, &slot->mutex);	\
+	pthread_mutex_unlock(&slot->mutex);				\
+	sem_post(&_ring->empty);					\
+}									\
+typedef struct _tag##_sring _tag##_sring_t
+
+/* Same as DEFINE_RING_TYPES, but produces a lock-free ring.
+ *
+ * Each slot has a sequence number `seq`. For the request at position `pos`
+ * (positions count up forever and wrap at 2^32), the slot is free when
+ * `seq == pos`, and holds a published request when `seq == pos + 1`. The server
+ * answers by setting `done = pos + 1`, and the client frees the slot for the
+ * next lap by setting `seq = pos + slot_count` once it has copied the response
+ * out. The server therefore never waits for a client before moving on to the
+ * next slot, and may answer slots in any order.
+ *
+ * `waiters` counts the threads sleeping on a slot's `seq` or `done` word.
+ * The server sleeps on `submitted` rather than on a slot, so that a client
+ * can publish a whole batch of requests and bump it once; `sq_waiters`
+ * counts the server threads asleep on it. Likewise `completed` is bumped
+ * after a batch of responses so a client can sleep until any one of its
+ * requests is answered; `cq_waiters` counts the threads doing so.
+ * `client_wait` and `server_wait` are the wait policies of the two sides; each
+ * side sets its own with RB_SET_WAIT_POLICY.
+ *
+ * Besides the blocking request used by RB_MAKE_REQUEST, this flavour supports
+ * split submission and completion (RB_SUBMIT, RB_POLL, RB_WAIT, ...). A
+ * position returned by a submit is the request's "ticket". A slot is only
+ * freed when its ticket is reaped, so a thread holding unreaped tickets must
+ * use RB_TRY_SUBMIT: a blocking submit could wait on its own slot forever. */
+#define DEFINE_LOCKFREE_RING_TYPES(_tag, __req_t, __rsp_t, _slot_count)	\
+typedef __req_t _tag##_req_t;						\
+typedef __rsp_t _tag##_rsp_t;						\
+union _tag##_sring_entry {						\
+	_tag##_req_t req;						\
+	_tag##_rsp_t rsp;						\
+};									\
+									\
+struct _tag##_sring_slot {						\
+	uint32_t seq;							\
+	uint32_t done;							\
+	uint32_t waiters;						\
+	uint64_t user_tag;						\
+	union _tag##_sring_entry entry RB_CACHE_ALIGNED;		\
+} RB_CACHE_ALIGNED;							\
+									\
+struct _tag##_sring {							\
+	int slot_count;			/* never written after init */	\
+	uint32_t prod RB_CACHE_ALIGNED;	/* written by clients */	\
+	uint32_t submitted;						\
+	uint32_t sq_waiters;						\
+	struct rb_wait_policy client_wait RB_CACHE_ALIGNED;		\
+	uint32_t cons RB_CACHE_ALIGNED;	/* written by the server */	\
+	struct rb_wait_policy server_wait;				\
+	uint32_t completed RB_CACHE_ALIGNED;				\
+	uint32_t cq_waiters;						\
+	struct _tag##_sring_slot ring[_slot_count];			\
+};									\
+									\
+RB_ASSERT_SLOT_LAYOUT(_tag);						\
+RB_ASSERT_APART(struct _tag##_sring, slot_count, prod,			\
+		_tag##_count_apart_from_prod);				\
+RB_ASSERT_APART(struct _tag##_sring, prod, client_wait,			\
+		_tag##_prod_apart_from_client_wait);			\
+RB_ASSERT_APART(struct _tag##_sring, client_wait, cons,			\
+		_tag##_client_wait_apart_from_cons);			\
+RB_ASSERT_APART(struct _tag##_sring, cons, completed,			\
+		_tag##_cons_apart_from_completed);			\
+									\
+RB_STATIC_ASSERT(((_slot_count) & ((_slot_count) - 1)) == 0,		\
+		 _tag##_slot_count_is_power_of_two);			\
+									\
+static inline void _tag##_rb_init(struct _tag##_sring *_ring,		\
+				  int _count)				\
+{									\
+	_ring->slot_count = _count;					\
+	_ring->prod = 0;						\
+	_ring->submitted = 0;						\
+	_ring->sq_waiters = 0;						\
+	_ring->cons = 0;						\
+	_ring->completed = 0;						\
+	_ring->cq_waiters = 0;						\
+	_ring->client_wait = (struct rb_wait_policy)			\
+		RB_WAIT_POLICY_DEFAULT;					\
+	_ring->server_wait = (struct rb_wait_policy)			\
+		RB_WAIT_POLICY_DEFAULT;					\
+	for (int i = 0; i < _ring->slot_count; ++i) {			\
+		_ring->ring[i].seq = i;					\
+		_ring->ring[i].done = 0;				\
+		_ring->ring[i].waiters = 0;				\
+	}								\
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);			\
+}									\
+									\
+/* Positions run freely and wrap with the slot count, a power of two */	\
+static inline uint32_t _tag##_rb_next_pos(struct _tag##_sring *_ring,	\
+					  uint32_t _pos)		\
+{									\
+	return _pos + 1;						\
+}									\
+									\
+static inline struct _tag##_sring_slot *				\
+_tag##_rb_slot(struct _tag##_sring *_ring, uint32_t _pos)		\
+{									\
+	return &_ring->ring[_pos & (_ring->slot_count - 1)];		\
+}									\
+									\
+/* Claims the next free position into `*_pos`. Returns 0, or -1 if the	\
+ * ring is full and `_block` is false */				\
+static inline int _tag##_rb_claim(struct _tag##_sring *_ring,		\
+				  uint32_t *_pos, int _block)		\
+{									\
+	for (;;) {							\
+		uint32_t pos = __atomic_load_n(&_ring->prod,		\
+					       __ATOMIC_RELAXED);	\
+		struct _tag##_sring_slot *slot =			\
+			_tag##_rb_slot(_ring, pos);			\
+		uint32_t seq = __atomic_load_n(&slot->seq,		\
+					       __ATOMIC_ACQUIRE);	\
+		int32_t diff = (int32_t)(seq - pos);			\
+		if (diff == 0) {					\
+			if (__atomic_compare_exchange_n(&_ring->prod,	\
+					&pos, pos + 1, 0,		\
+					__ATOMIC_ACQ_REL,		\
+					__ATOMIC_RELAXED)) {		\
+				*_pos = pos;				\
+				return 0;				\
+			}						\
+		} else if (diff < 0) {					\
+			/* previous lap not yet released */		\
+			if (!_block)					\
+				return -1;				\
+			rb_wait_while(&slot->seq, seq, &slot->waiters,	\
+				      &_ring->client_wait, 0);		\
+		}							\
+	}								\
+}									\
+									\
+static inline void _tag##_rb_publish(struct _tag##_sring *_ring,	\
+				     uint32_t _pos,			\
+				     const _tag##_req_t *_req,		\
+				     uint64_t _utag)			\
+{									\
+	struct _tag##_sring_slot *slot = _tag##_rb_slot(_ring, _pos);	\
+	slot->entry.req = *_req;					\
+	slot->user_tag = _utag;						\
+	__atomic_store_n(&slot->seq, _pos + 1, __ATOMIC_RELEASE);	\
+}									\
+									\
+/* Wakes the server if it is asleep waiting for requests */		\
+static inline void							\
+_tag##_rb_signal_submits(struct _tag##_sring *_ring)			\
+{									\
+	rb_word_inc(&_ring->submitted, &_ring->sq_waiters);		\
+}									\
+									\
+/* Copies out an answered request and frees its slot */			\
+static inline void _tag##_rb_reap(struct _tag##_sring *_ring,		\
+				  uint32_t _ticket, _tag##_rsp_t *_rsp,	\
+				  uint64_t *_utag)			\
+{									\
+	struct _tag##_sring_slot *slot = _tag##_rb_slot(_ring, _ticket);\
+	*_rsp = slot->entry.rsp;					\
+	if (_utag)							\
+		*_utag = slot->user_tag;				\
+	rb_word_set(&slot->seq, _ticket + _ring->slot_count,		\
+		    &slot->waiters);					\
+}									\
+									\
+static inline uint32_t _tag##_rb_submit(struct _tag##_sring *_ring,	\
+					const _tag##_req_t *_req,	\
+					uint64_t _utag, int _signal)	\
+{									\
+	uint32_t pos;							\
+	_tag##_rb_claim(_ring, &pos, 1);				\
+	_tag##_rb_publish(_ring, pos, _req, _utag);			\
+	if (_signal)							\
+		_tag##_rb_signal_submits(_ring);			\
+	return pos;							\
+}									\
+									\
+static inline int _tag##_rb_try_submit(struct _tag##_sring *_ring,	\
+				       const _tag##_req_t *_req,	\
+				       uint64_t _utag,			\
+				       uint32_t *_ticket, int _signal)	\
+{									\
+	if (_tag##_rb_claim(_ring, _ticket, 0))				\
+		return -1;						\
+	_tag##_rb_publish(_ring, *_ticket, _req, _utag);		\
+	if (_signal)							\
+		_tag##_rb_signal_submits(_ring);			\
+	return 0;							\
+}									\
+									\
+static inline int _tag##_rb_poll(struct _tag##_sring *_ring,		\
+				 uint32_t _ticket, _tag##_rsp_t *_rsp,	\
+				 uint64_t *_utag)			\
+{									\
+	struct _tag##_sring_slot *slot = _tag##_rb_slot(_ring, _ticket);\
+	if (__atomic_load_n(&slot->done, __ATOMIC_ACQUIRE) != _ticket + 1)\
+		return 0;						\
+	_tag##_rb_reap(_ring, _ticket, _rsp, _utag);			\
+	return 1;							\
+}									\
+									\
+static inline void _tag##_rb_wait(struct _tag##_sring *_ring,		\
+				  uint32_t _ticket, _tag##_rsp_t *_rsp,	\
+				  uint64_t *_utag)			\
+{									\
+	struct _tag##_sring_slot *slot = _tag##_rb_slot(_ring, _ticket);\
+	rb_wait_until(&slot->done, _ticket + 1, &slot->waiters,		\
+		      &_ring->client_wait, 0);				\
+	_tag##_rb_reap(_ring, _ticket, _rsp, _utag);			\
+}									\
+									\
+/* Waits for any of `_n` tickets to be answered, reaps it and returns	\
+ * its index in `_tickets` */						\
+static inline int _tag##_rb_wait_any(struct _tag##_sring *_ring,	\
+				     const uint32_t *_tickets, int _n,	\
+				     _tag##_rsp_t *_rsp,		\
+				     uint64_t *_utag)			\
+{									\
+	for (;;) {							\
+		uint32_t seen = __atomic_load_n(&_ring->completed,	\
+						__ATOMIC_SEQ_CST);	\
+		for (int i = 0; i < _n; ++i)				\
+			if (_tag##_rb_poll(_ring, _tickets[i], _rsp, _utag))\
+				return i;				\
+		rb_wait_while(&_ring->completed, seen, &_ring->cq_waiters,\
+			      &_ring->client_wait, 0);			\
+	}								\
+}									\
+									\
+static inline void _tag##_rb_make_request(struct _tag##_sring *_ring,	\
+					  const _tag##_req_t *_req,	\
+					  _tag##_rsp_t *_rsp)		\
+{									\
+	uint32_t ticket = _tag##_rb_submit(_ring, _req, 0, 1);		\
+	_tag##_rb_wait(_ring, ticket, _rsp, NULL);			\
+}									\
+									\
+/* Returns the request at `_pos` if it has been published, or NULL */	\
+static inline union _tag##_sring_entry *				\
+_tag##_rb_serve_try(struct _tag##_sring *_ring, uint32_t _pos)		\
+{									\
+	struct _tag##_sring_slot *slot = _tag##_rb_slot(_ring, _pos);	\
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != _pos + 1)	\
+		return NULL;						\
+	__atomic_store_n(&_ring->cons, _pos + 1, __ATOMIC_RELAXED);	\
+	return &slot->entry;						\
+}									\
+									\
+/* Returns the request at `_pos`, sleeping until it is published. The	\
+ * clients' signal is read before the slot, so one that comes after	\
+ * the slot was found empty keeps us awake. */				\
+static inline union _tag##_sring_entry *				\
+_tag##_rb_serve_wait(struct _tag##_sring *_ring, uint32_t _pos)		\
+{									\
+	for (;;) {							\
+		uint32_t seen = __atomic_load_n(&_ring->submitted,	\
+						__ATOMIC_SEQ_CST);	\
+		union _tag##_sring_entry *entry =			\
+			_tag##_rb_serve_try(_ring, _pos);		\
+		if (entry)						\
+			return entry;					\
+		rb_wait_while(&_ring->submitted, seen, &_ring->sq_waiters,\
+			      &_ring->server_wait, 1);			\
+	}								\
+}									\
+									\
+/* Answers the request at `_pos`, waking only a client waiting on that	\
+ * very ticket. Clients waiting on any ticket are left for		\
+ * _rb_signal_completions(). */						\
+static inline void _tag##_rb_answer(struct _tag##_sring *_ring,		\
+				    uint32_t _pos)			\
+{									\
+	struct _tag##_sring_slot *slot = _tag##_rb_slot(_ring, _pos);	\
+	rb_word_set(&slot->done, _pos + 1, &slot->waiters);		\
+}									\
+									\
+/* Wakes the clients waiting for any of their requests to be answered */\
+static inline void							\
+_tag##_rb_signal_completions(struct _tag##_sring *_ring)		\
+{									\
+	rb_word_inc(&_ring->completed, &_ring->cq_waiters);		\
+}									\
+									\
+static inline void _tag##_rb_serve_done(struct _tag##_sring *_ring,	\
+					uint32_t _pos)			\
+{									\
+	_tag##_rb_answer(_ring, _pos);					\
+	_tag##_rb_signal_completions(_ring);				\
+}									\
+typedef struct _tag##_sring _tag##_sring_t
+
+/* Initialize a given ring. `_tag` is the tag used to create the data types,
+ * `_ring` is a pointer to the shared memory (assumed already created), and
+ * `_slot_count` is the number of elements that can fit in the ring buffer */
+#define RB_INIT(_tag, _ring, _slot_count)				\
+	_tag##_rb_init((_ring), (_slot_count))
+
+/* Sets how one side of a lock-free ring waits. `_side` is `client` or
+ * `server`, and `_policy_ptr` points to a struct rb_wait_policy. Each side
+ * should set only its own. */
+#define RB_SET_WAIT_POLICY(_ring, _side, _policy_ptr)			\
+	((_ring)->_side##_wait = *(_policy_ptr))
+
+/* For the client, makes a request and then blocks, waiting for a response.
+ * `_req_ptr` should be the address of the request, and is first copied into the
+ * shared buffer. The server's response is copied to `rsp_ptr` when the server
+ * completes its response */
+#define RB_MAKE_REQUEST(_tag, _ring, _req_ptr, _rsp_ptr)		\
+	_tag##_rb_make_request((_ring), (_req_ptr), (_rsp_ptr))
 
 /* Server infinite loop.
  * 	`_tag` is the tag used to create the data structures
@@ -127,21 +747,88 @@ struct _tag##_sring {							\
  * 	`_handler_arg` is arbitrary data passed through to `_handler()`
  */
 #define RB_SERVE(_tag, _ring, _stop_cond, _handler, _handler_arg) do {	\
-	struct _tag##_sring_slot *slot;					\
-	int server_index = 0;						\
+	union _tag##_sring_entry *entry;				\
+	uint32_t server_pos = 0;					\
+	while (!(_stop_cond)) {						\
+		entry = _tag##_rb_serve_wait((_ring), server_pos);	\
+		(_handler)(entry, (_handler_arg));			\
+		_tag##_rb_serve_done((_ring), server_pos);		\
+		server_pos = _tag##_rb_next_pos((_ring), server_pos);	\
+	}								\
+} while (0)
+
+/* Split submission and completion, lock-free rings only.
+ *
+ * RB_SUBMIT copies in a request along with a caller-chosen 64-bit `_utag`,
+ * waiting for a free slot if needed, and evaluates to the request's ticket.
+ * RB_TRY_SUBMIT does the same without waiting: it stores the ticket in
+ * `*_ticket_ptr` and evaluates to 0, or to -1 if the ring is full.
+ * RB_POLL evaluates to 1 and copies out the response and tag if the ticket has
+ * been answered, and to 0 otherwise. RB_WAIT blocks until it is answered.
+ * RB_WAIT_ANY blocks until one of `_n` tickets is answered and evaluates to its
+ * index. `_utag_ptr` may be NULL. Every ticket must be reaped exactly once by
+ * RB_POLL, RB_WAIT or RB_WAIT_ANY.
+ *
+ * RB_SUBMIT_QUIET and RB_TRY_SUBMIT_QUIET publish the request without waking
+ * the server, so that a client can write a batch of them and then wake it
+ * once with RB_SIGNAL_SUBMITS. A client must signal before it waits for any
+ * of them. */
+#define RB_SUBMIT(_tag, _ring, _req_ptr, _utag)				\
+	_tag##_rb_submit((_ring), (_req_ptr), (_utag), 1)
+#define RB_TRY_SUBMIT(_tag, _ring, _req_ptr, _utag, _ticket_ptr)	\
+	_tag##_rb_try_submit((_ring), (_req_ptr), (_utag), (_ticket_ptr), 1)
+#define RB_SUBMIT_QUIET(_tag, _ring, _req_ptr, _utag)			\
+	_tag##_rb_submit((_ring), (_req_ptr), (_utag), 0)
+#define RB_TRY_SUBMIT_QUIET(_tag, _ring, _req_ptr, _utag, _ticket_ptr)	\
+	_tag##_rb_try_submit((_ring), (_req_ptr), (_utag), (_ticket_ptr), 0)
+#define RB_SIGNAL_SUBMITS(_tag, _ring)					\
+	_tag##_rb_signal_submits((_ring))
+#define RB_POLL(_tag, _ring, _ticket, _rsp_ptr, _utag_ptr)		\
+	_tag##_rb_poll((_ring), (_ticket), (_rsp_ptr), (_utag_ptr))
+#define RB_WAIT(_tag, _ring, _ticket, _rsp_ptr, _utag_ptr)		\
+	_tag##_rb_wait((_ring), (_ticket), (_rsp_ptr), (_utag_ptr))
+#define RB_WAIT_ANY(_tag, _ring, _tickets, _n, _rsp_ptr, _utag_ptr)	\
+	_tag##_rb_wait_any((_ring), (_tickets), (_n), (_rsp_ptr), (_utag_ptr))
+
+/* Asynchronous server loop, lock-free rings only. Same as RB_SERVE, except that
+ * `_handler` also gets the position of the request as its second argument
+ * and does not have to answer it before returning. Whoever finishes the
+ * request calls RB_COMPLETE with that position, from any thread, once the
+ * response is in the entry. The loop goes straight on to the next slot, so
+ * every slot of the ring can be in service at once, and it only sleeps once
+ * every published request has been handed over.
+ *
+ * RB_COMPLETE_QUIET answers a request without waking the clients waiting for
+ * any of theirs; a server answering a batch of requests does that for each,
+ * then wakes them once with RB_SIGNAL_COMPLETIONS. */
+#define RB_SERVE_ASYNC(_tag, _ring, _stop_cond, _handler, _handler_arg) do {\
+	union _tag##_sring_entry *entry;				\
+	uint32_t server_pos = 0;					\
 	while (!(_stop_cond)) {						\
-		sem_wait(&(_ring)->full);				\
-		slot = &(_ring)->ring[server_index];			\
-		pthread_mutex_lock(&slot->mutex);			\
-		(_handler)(&slot->entry, (_handler_arg));		\
-		slot->done = 1;						\
-		pthread_cond_signal(&slot->condvar);			\
-		while (slot->done)					\
-			pthread_cond_wait(&slot->condvar, &slot->mutex);\
-		pthread_mutex_unlock(&slot->mutex);			\
-									\
-		sem_post(&(_ring)->empty);				\
-		server_index = (server_index + 1) % (_ring)->slot_count;\
+		entry = _tag##_rb_serve_wait((_ring), server_pos);	\
+		(_handler)(entry, server_pos, (_handler_arg));		\
+		++server_pos;						\
+	}								\
+} while (0)
+
+#define RB_COMPLETE(_tag, _ring, _pos)					\
+	_tag##_rb_serve_done((_ring), (_pos))
+#define RB_COMPLETE_QUIET(_tag, _ring, _pos)				\
+	_tag##_rb_answer((_ring), (_pos))
+#define RB_SIGNAL_COMPLETIONS(_tag, _ring)				\
+	_tag##_rb_signal_completions((_ring))
+
+/* Non-blocking step of RB_SERVE_ASYNC, lock-free rings only, for a thread that
+ * serves many rings. Hands every request published from position `_pos` on to
+ * `_handler`, the way RB_SERVE_ASYNC does, and returns as soon as it finds a
+ * slot that is not. `_pos` must be an lvalue; it is left at that slot. The
+ * number of requests handed over is added to `_count`. */
+#define RB_SERVE_POLL(_tag, _ring, _pos, _handler, _handler_arg, _count) do {\
+	union _tag##_sring_entry *entry;				\
+	while ((entry = _tag##_rb_serve_try((_ring), (_pos)))) {	\
+		(_handler)(entry, (_pos), (_handler_arg));		\
+		++(_pos);						\
+		++(_count);						\
 	}								\
 } while (0)
 
@@ -0,0 +1,406 @@
+/*
+ * Sharded sector cache with pluggable eviction.
+ *
+ * Each shard is a fixed array of entries. The first `cap` entries are resident
+ * and own a sector of data each; 2Q also keeps `ghost_cap` ghost entries that
+ * only remember the numbers of recently evicted sectors. A chained hash table
+ * indexes both kinds. Entries are linked into doubly linked lists by index,
+ * with one sentinel entry per list at the end of the array.
+ */
+
+#include <pthread.h>
+
+#include "sector_cache.h"
+#include "file_service.h"
+
+/* Most shards to split a cache into, and the fewest sectors worth a shard */
+#define CACHE_MAX_SHARDS 64
+#define CACHE_MIN_SHARD_SECTORS 64
+
+/* The lists an entry can be on. LRU uses Q_MAIN, 2Q uses Q_MAIN as its Am
+ * queue, Q_IN as A1in and Q_OUT as A1out. CLOCK uses no lists. */
+enum { Q_NONE, Q_MAIN, Q_IN, Q_OUT, Q_GHOST_FREE, NQUEUES };
+
+struct cache_entry {
+	int sector;
+	int hnext;			// next entry in the hash chain, or -1
+	int prev;
+	int next;
+	unsigned char queue;		// list the entry is on
+	unsigned char ref;		// CLOCK reference bit
+};
+
+struct cache_shard {
+	pthread_mutex_t mtx;		// protects the whole shard
+	int cap;			// resident entries
+	int ghost_cap;			// 2Q ghost entries
+	int in_cap;			// 2Q target length of A1in
+	int used;			// resident entries handed out so far
+	int free;			// resident entries given back, chained
+					// by hnext, or -1
+	int hand;			// CLOCK hand
+	int qlen[NQUEUES];
+	struct cache_entry *e;		// resident, ghosts, then list heads
+	char *data;			// a sector for each resident entry
+	int *buckets;
+	unsigned int bucket_mask;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t insertions;
+	uint64_t evictions;
+} __attribute__((aligned(64)));
+
+/* An eviction policy. `touch` is called on a hit. `admit` is called on an
+ * insert of a sector that is not resident, and returns a free resident entry
+ * for it, evicting one if needed; the caller fills in the entry and hashes it. */
+struct cache_policy_ops {
+	const char *name;
+	void (*touch)(struct cache_shard *s, int i);
+	int (*admit)(struct cache_shard *s, int sector);
+};
+
+struct sector_cache {
+	const struct cache_policy_ops *ops;
+	int shard_mask;
+	struct cache_shard *shards;
+};
+
+static uint32_t hash_sector(int sector)
+{
+	uint32_t h = (uint32_t)sector * 2654435761u;
+	return h ^ (h >> 16);
+}
+
+/* list handling */
+
+static int list_head(struct cache_shard *s, int q)
+{
+	return s->cap + s->ghost_cap + q;
+}
+
+static void list_remove(struct cache_shard *s, int i)
+{
+	struct cache_entry *e = s->e;
+	e[e[i].prev].next = e[i].next;
+	e[e[i].next].prev = e[i].prev;
+	--s->qlen[e[i].queue];
+	e[i].queue = Q_NONE;
+}
+
+static void list_push(struct cache_shard *s, int q, int i)
+{
+	struct cache_entry *e = s->e;
+	int h = list_head(s, q);
+	e[i].next = e[h].next;
+	e[i].prev = h;
+	e[e[h].next].prev = i;
+	e[h].next = i;
+	e[i].queue = q;
+	++s->qlen[q];
+}
+
+/* Returns the oldest entry on a list, or -1 if it is empty */
+static int list_tail(struct cache_shard *s, int q)
+{
+	int h = list_head(s, q);
+	return s->e[h].prev == h ? -1 : s->e[h].prev;
+}
+
+/* hash handling */
+
+static int hash_find(struct cache_shard *s, int sector)
+{
+	int i = s->buckets[hash_sector(sector) & s->bucket_mask];
+	while (i != -1 && s->e[i].sector != sector)
+		i = s->e[i].hnext;
+	return i;
+}
+
+static void hash_insert(struct cache_shard *s, int i)
+{
+	int *b = &s->buckets[hash_sector(s->e[i].sector) & s->bucket_mask];
+	s->e[i].hnext = *b;
+	*b = i;
+}
+
+static void hash_remove(struct cache_shard *s, int i)
+{
+	int *p = &s->buckets[hash_sector(s->e[i].sector) & s->bucket_mask];
+	while (*p != i)
+		p = &s->e[*p].hnext;
+	*p = s->e[i].hnext;
+}
+
+/* Drops a resident entry from the cache */
+static void evict(struct cache_shard *s, int i)
+{
+	hash_remove(s, i);
+	if (s->e[i].queue != Q_NONE)
+		list_remove(s, i);
+	++s->evictions;
+}
+
+/* Hands out a resident entry that holds nothing, or returns -1 if they are
+ * all in use */
+static int take_free(struct cache_shard *s)
+{
+	int i = s->free;
+	if (i != -1)
+		s->free = s->e[i].hnext;
+	else if (s->used < s->cap)
+		i = s->used++;
+	return i;
+}
+
+/* LRU */
+
+static void lru_touch(struct cache_shard *s, int i)
+{
+	list_remove(s, i);
+	list_push(s, Q_MAIN, i);
+}
+
+static int lru_admit(struct cache_shard *s, int sector)
+{
+	int i = take_free(s);
+	if (i == -1) {
+		i = list_tail(s, Q_MAIN);
+		evict(s, i);
+	}
+	list_push(s, Q_MAIN, i);
+	return i;
+}
+
+/* CLOCK: a hit sets the entry's reference bit. The hand sweeps round the
+ * resident entries, clearing set bits, and evicts the first entry it finds
+ * with a clear bit. */
+
+static void clock_touch(struct cache_shard *s, int i)
+{
+	s->e[i].ref = 1;
+}
+
+static int clock_admit(struct cache_shard *s, int sector)
+{
+	int i = take_free(s);
+	if (i == -1) {
+		for (;;) {
+			i = s->hand;
+			s->hand = (s->hand + 1) % s->cap;
+			if (!s->e[i].ref)
+				break;
+			s->e[i].ref = 0;
+		}
+		evict(s, i);
+	}
+	s->e[i].ref = 0;
+	return i;
+}
+
+/* 2Q (Johnson and Shasha). New sectors go on the A1in FIFO. When A1in grows
+ * past `in_cap` its oldest sector is evicted and remembered on the A1out ghost
+ * FIFO. A sector that is asked for again while on A1out was not a one-off, so
+ * it is admitted to the Am LRU list. Sectors read once by a scan therefore
+ * only ever displace other A1in sectors. */
+
+static void twoq_touch(struct cache_shard *s, int i)
+{
+	if (s->e[i].queue == Q_MAIN) {
+		list_remove(s, i);
+		list_push(s, Q_MAIN, i);
+	}
+}
+
+/* Frees a resident entry, remembering the sector in a ghost if it came off
+ * A1in */
+static int twoq_reclaim(struct cache_shard *s)
+{
+	int v = take_free(s);
+	if (v != -1)
+		return v;
+	if (s->qlen[Q_IN] > s->in_cap || !s->qlen[Q_MAIN]) {
+		v = list_tail(s, Q_IN);
+		int g = list_tail(s, Q_GHOST_FREE);
+		if (g == -1) {
+			g = list_tail(s, Q_OUT);
+			hash_remove(s, g);
+		}
+		list_remove(s, g);
+		evict(s, v);
+		s->e[g].sector = s->e[v].sector;
+		hash_insert(s, g);
+		list_push(s, Q_OUT, g);
+	} else {
+		v = list_tail(s, Q_MAIN);
+		evict(s, v);
+	}
+	return v;
+}
+
+static int twoq_admit(struct cache_shard *s, int sector)
+{
+	/* a resident sector never gets here, so this can only be a ghost */
+	int g = hash_find(s, sector);
+	if (g != -1) {
+		hash_remove(s, g);
+		list_remove(s, g);
+		list_push(s, Q_GHOST_FREE, g);
+	}
+	int i = twoq_reclaim(s);
+	list_push(s, g != -1 ? Q_MAIN : Q_IN, i);
+	return i;
+}
+
+static const struct cache_policy_ops policies[] = {
+	[CACHE_CLOCK] = { "clock", &clock_touch, &clock_admit },
+	[CACHE_LRU] = { "lru", &lru_touch, &lru_admit },
+	[CACHE_2Q] = { "2q", &twoq_touch, &twoq_admit },
+};
+
+int cache_policy_parse(const char *name, enum cache_policy *policy)
+{
+	for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+		if (!strcmp(policies[i].name, name)) {
+			*policy = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *cache_policy_name(enum cache_policy policy)
+{
+	return policies[policy].name;
+}
+
+static void shard_init(struct cache_shard *s, int cap)
+{
+	memset(s, 0, sizeof(*s));
+	pthread_mutex_init(&s->mtx, NULL);
+	s->cap = cap;
+	s->free = -1;
+	s->ghost_cap = cap / 2 + 1;
+	s->in_cap = cap / 4 > 0 ? cap / 4 : 1;
+	int n = s->cap + s->ghost_cap;
+	s->e = emalloc((n + NQUEUES) * sizeof(*s->e));
+	s->data = emalloc((size_t)cap * SECTOR_SIZE);
+	for (int q = 0; q < NQUEUES; ++q) {
+		int h = list_head(s, q);
+		s->e[h].prev = s->e[h].next = h;
+	}
+	for (int i = 0; i < n; ++i)
+		s->e[i].queue = Q_NONE;
+	for (int i = s->cap; i < n; ++i)
+		list_push(s, Q_GHOST_FREE, i);
+
+	unsigned int nbuckets = 1;
+	while (nbuckets < n)
+		nbuckets <<= 1;
+	s->bucket_mask = nbuckets - 1;
+	s->buckets = emalloc(nbuckets * sizeof(*s->buckets));
+	for (int i = 0; i < nbuckets; ++i)
+		s->buckets[i] = -1;
+}
+
+struct sector_cache *sector_cache_create(size_t bytes, enum cache_policy policy)
+{
+	size_t total = bytes / SECTOR_SIZE;
+	if (!total)
+		return NULL;
+
+	int nshards = 1;
+	while (nshards * 2 <= CACHE_MAX_SHARDS &&
+	       total / (nshards * 2) >= CACHE_MIN_SHARD_SECTORS)
+		nshards *= 2;
+
+	struct sector_cache *c = emalloc(sizeof(*c));
+	c->ops = &policies[policy];
+	c->shard_mask = nshards - 1;
+	if (posix_memalign((void **)&c->shards, 64,
+			   nshards * sizeof(*c->shards)))
+		fail("posix_memalign");
+	for (int i = 0; i < nshards; ++i)
+		shard_init(&c->shards[i], total / nshards +
+			   (i < total % nshards));
+	return c;
+}
+
+void sector_cache_destroy(struct sector_cache *c)
+{
+	for (int i = 0; i <= c->shard_mask; ++i) {
+		struct cache_shard *s = &c->shards[i];
+		pthread_mutex_destroy(&s->mtx);
+		free(s->e);
+		free(s->data);
+		free(s->buckets);
+	}
+	free(c->shards);
+	free(c);
+}
+
+static struct cache_shard *shard_of(struct sector_cache *c, int sector)
+{
+	return &c->shards[(hash_sector(sector) >> 24) & c->shard_mask];
+}
+
+bool sector_cache_lookup(struct sector_cache *c, int sector, char *buf)
+{
+	struct cache_shard *s = shard_of(c, sector);
+	pthread_mutex_lock(&s->mtx);
+	int i = hash_find(s, sector);
+	bool hit = i != -1 && i < s->cap;
+	if (hit) {
+		c->ops->touch(s, i);
+		memcpy(buf, s->data + (size_t)i * SECTOR_SIZE, SECTOR_SIZE);
+		++s->hits;
+	} else {
+		++s->misses;
+	}
+	pthread_mutex_unlock(&s->mtx);
+	return hit;
+}
+
+void sector_cache_insert(struct sector_cache *c, int sector, const char *buf)
+{
+	struct cache_shard *s = shard_of(c, sector);
+	pthread_mutex_lock(&s->mtx);
+	int i = hash_find(s, sector);
+	if (i == -1 || i >= s->cap) {
+		i = c->ops->admit(s, sector);
+		s->e[i].sector = sector;
+		hash_insert(s, i);
+		++s->insertions;
+	}
+	memcpy(s->data + (size_t)i * SECTOR_SIZE, buf, SECTOR_SIZE);
+	pthread_mutex_unlock(&s->mtx);
+}
+
+void sector_cache_invalidate(struct sector_cache *c, int sector)
+{
+	struct cache_shard *s = shard_of(c, sector);
+	pthread_mutex_lock(&s->mtx);
+	int i = hash_find(s, sector);
+	if (i != -1 && i < s->cap) {
+		hash_remove(s, i);
+		if (s->e[i].queue != Q_NONE)
+			list_remove(s, i);
+		s->e[i].hnext = s->free;
+		s->free = i;
+	}
+	pthread_mutex_unlock(&s->mtx);
+}
+
+void sector_cache_stats(struct sector_cache *c, struct cache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i <= c->shard_mask; ++i) {
+		struct cache_shard *s = &c->shards[i];
+		pthread_mutex_lock(&s->mtx);
+		stats->hits += s->hits;
+		stats->misses += s->misses;
+		stats->insertions += s->insertions;
+		stats->evictions += s->evictions;
+		stats->capacity += s->cap;
+		pthread_mutex_unlock(&s->mtx);
+	}
+}
@@ -0,0 +1,59 @@
+/*
+ * In-server cache of sector contents, shared by all the I/O threads.
+ *
+ * The cache is split into shards by a hash of the sector number, each with its
+ * own lock, so threads looking up different sectors rarely touch the same lock
+ * and there is no global one. The eviction policy is chosen when the cache is
+ * created.
+ */
+
+#ifndef SECTOR_CACHE_H_
+#define SECTOR_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+
+enum cache_policy {
+	CACHE_CLOCK,		// second-chance clock
+	CACHE_LRU,		// least recently used
+	CACHE_2Q,		// 2Q: scan resistant, remembers recent evictions
+};
+
+struct cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t insertions;
+	uint64_t evictions;
+	size_t capacity;		// in sectors
+};
+
+struct sector_cache;
+
+/* Creates a cache that holds as many sectors as fit in `bytes`. Returns NULL if
+ * that is not even one sector. */
+struct sector_cache *sector_cache_create(size_t bytes, enum cache_policy policy);
+
+void sector_cache_destroy(struct sector_cache *c);
+
+/* Copies a cached sector into `buf` (SECTOR_SIZE bytes). Returns True on a hit,
+ * and False, leaving `buf` untouched, on a miss. */
+bool sector_cache_lookup(struct sector_cache *c, int sector, char *buf);
+
+/* Adds or refreshes a sector, evicting another if the cache is full */
+void sector_cache_insert(struct sector_cache *c, int sector, const char *buf);
+
+/* Drops a sector, if it is cached, for one whose contents are no longer
+ * known */
+void sector_cache_invalidate(struct sector_cache *c, int sector);
+
+/* Adds up the counters of all the shards */
+void sector_cache_stats(struct sector_cache *c, struct cache_stats *stats);
+
+/* Parses "clock", "lru" or "2q". Returns -1 for anything else. */
+int cache_policy_parse(const char *name, enum cache_policy *policy);
+
+const char *cache_policy_name(enum cache_policy policy);
+
+#endif /* end of include guard: SECTOR_CACHE_H_ */
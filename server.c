@@ -1,9 +1,10 @@
-/* Necessary for O_DIRECT flag to open() */
+/* Necessary for pread() */
 #define _GNU_SOURCE
 
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sched.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -12,25 +13,121 @@
 #include "file_service.h"
 #include "common.h"
 #include "stlist.h"
+#include "work_queue.h"
+#include "io_sched.h"
+#include "coalesce.h"
+#include "readahead.h"
+#include "io_engine.h"
+#include "sector_cache.h"
+#include "write_cache.h"
 
 /* number of seconds to wait for incoming requests before timing out */
 #define TIMEOUT 300
 
+/* most I/O threads that may be asked for on the command line */
+#define MAX_IO_THREADS 256
+
+/* most requests of one client that can wait for the I/O threads at once: a
+ * request's slot is not reused until it has been answered */
+#define WORK_QUEUE_SIZE FS_PROCESS_SLOT_COUNT
+
 /* global circular linked list */
 struct stlist server_list;
 
+struct io_thread_info;
+
+/* A file being served. Each has I/O threads, an engine context for each of
+ * them, a sector cache and a write cache of its own. Clients' requests for it
+ * wait in its own queues, so volumes on different devices are read in
+ * parallel and a busy one does not hold the others up. */
+struct volume {
+	int index;			// in the registration's response
+	int fd;
+	bool writable;			// opened for writing
+	size_t size;			// of the file, in bytes
+	int nsectors;			// max sector number + 1
+	const struct io_engine *engine;	// how its I/O threads read it
+	struct sector_cache *cache;	// or NULL if caching is off
+	struct write_cache *wcache;	// or NULL if it is served read-only
+	/* requests from every client, waiting for its I/O threads: a queue
+	 * per client, each served by the I/O thread that is its home, in
+	 * proportion to the client's weight */
+	struct work_queue_set queues;
+	struct io_thread_info *threads;
+	int nthreads;
+};
+
+struct volume volumes[FS_MAX_VOLUMES];
+int volume_count;
+
+/* An I/O thread, reading one volume. Each client is given one of each
+ * volume's as its home for that volume when it registers. */
+struct io_thread_info {
+	int index;			// its home in its volume's queues
+	struct volume *vol;
+	int cpu;			// CPU it is pinned to, or -1
+	int load;			// weight of the clients that call it
+					// home
+	struct io_sched *sched;		// orders the requests it takes
+	uint64_t coalesced;		// requests that shared a read
+	uint64_t reads_saved;		// reads merged into others
+	uint64_t ra_reads;		// readahead reads started
+	uint64_t ra_sectors;		// and the sectors they read
+	pthread_t tid;
+};
+
+struct io_thread_info io_threads[MAX_IO_THREADS];
+int io_thread_count;
+
+/* how the I/O threads order the requests they take */
+enum sched_policy sched_policy = IOSCHED_FIFO;
+int sched_window;
+uint64_t sched_max_latency_us = IOSCHED_DEFAULT_MAX_LATENCY_US;
+
+/* How client rings are served: by a worker thread each, or by a fixed set of
+ * poller threads between them */
+enum serve_mode { SERVE_THREADS, SERVE_EVENTS };
+enum serve_mode serve_mode = SERVE_THREADS;
+
+/* A poller thread, in event mode. It serves the rings on its list, and sleeps
+ * on its doorbell when none of them has a new request. */
+struct poller {
+	struct stlist clients;
+	int nclients;
+	struct fs_doorbell *bell;
+	struct rb_wait_policy wait;	// how it waits on its doorbell
+	pthread_t tid;
+};
+
+struct poller pollers[FS_MAX_POLLERS];
+int poller_count;
+
+/* the pollers' doorbells, shared with the clients */
+struct fs_doorbells *doorbells;
+
+/* how the server side waits for requests: the worker threads on their rings,
+ * and the pollers on their doorbells */
+struct rb_wait_policy server_wait = RB_WAIT_POLICY_DEFAULT;
+
 /* set to 1 when we must exit */
 volatile sig_atomic_t done = 0;
 
-/* max sector number that can be requested (min is 0) */
-int max_sector_number = 0;
+/* most sectors read ahead of a client's stream, or 0 for no readahead */
+int readahead_window = RA_DEFAULT_MAX_WINDOW;
+
+/* default size of the write cache, split between the volumes like the sector
+ * cache */
+#define WRITE_CACHE_DEFAULT_SIZE (4 << 20)
 
-/* file size (in bytes) of the file we are serving */
-size_t file_size;
+/* pieces of readahead an I/O thread may have waiting or in flight */
+#define READAHEAD_PIECES RA_MAX_WINDOW
 
-/* ring ptr and shm_name pair for server worker threads*/
+/* set to 1 when the statistics should be printed */
+volatile sig_atomic_t dump_stats = 0;
+
+/* shm segment and shm_name pair for server worker threads*/
 struct ring_name {
-	struct fs_process_sring* ring;
+	struct fs_process_shm* shm;
         char shm_name[50];
 };
 
@@ -52,6 +149,12 @@ static void exit_handler(int signo)
 	done = 1;
 }
 
+/* Sig handler for the statistics signal */
+static void stats_handler(int signo)
+{
+	dump_stats = 1;
+}
+
 static void pidfile_create(char *pidfile_name)
 {
 	FILE *pidfile;
@@ -86,111 +189,858 @@ static void daemonize()
 		fail_en("daemon");
 }
 
-/* Loop around, finding the first node that has work to be done */
-static struct stlist_node *find_work(struct stlist_node *p)
+/* Opens a file we will be serving as volume `index`, and sets its size.
+ * Sectors are read into buffers that are not aligned the way O_DIRECT
+ * requires, so the page cache is used. The file is opened for writing too if
+ * we may. */
+static void init_file_to_serve(struct volume *v, int index, const char *path)
 {
-	int has_work = False;
-	sem_wait(&server_list.mtx);
-	do {
-		p = p->next;
-		pthread_mutex_lock(&p->mtx);
-		has_work = p->has_work;
-		pthread_mutex_unlock(&p->mtx);
-	} while (!has_work);
-	sem_post(&server_list.mtx);
-	return p;
-}
-
-
-/* Fill a buffer with a sector */
-static void fill_sector_data(int sector, char *buf, FILE *file)
-{
-	checkpoint("filling sector %d", sector);
-	size_t start = sector * SECTOR_SIZE;
-	fseek(file, start, SEEK_SET);
-	size_t written = fread(buf, 1, SECTOR_SIZE, file);
-	if (written < SECTOR_SIZE) {
-		if (feof(file)) {
-			memset(buf + written, 0, SECTOR_SIZE - written);
-		} else if (ferror(file)) {
-			fprintf(stderr, "Error in fread()n");
+	v->index = index;
+	v->fd = open(path, O_RDWR);
+	v->writable = v->fd != -1;
+	if (v->fd == -1 && (errno == EACCES || errno == EROFS || errno == EPERM))
+		v->fd = open(path, O_RDONLY);
+	if (v->fd == -1)
+		fail_en(path);
+	struct stat st;
+	if (fstat(v->fd, &st) == -1)
+		fail_en("fstat");
+	v->size = st.st_size;
+	v->nsectors = ((v->size - 1) / SECTOR_SIZE) + 1;
+}
+
+/* A client request being served. It is answered once all of its pieces have
+ * been read. */
+struct io_request {
+	struct fs_process_shm *shm;
+	struct fs_process_sring *ring;
+	union fs_process_sring_entry *entry;
+	unsigned int pos;
+	int pending;			// pieces not yet read, plus one until
+					// its batch has been started
+	int error;			// first error seen
+	int buf;			// pool buffers the data goes in
+	int nbufs;
+	bool shared;			// shares a read with another request
+	int npieces;
+	struct read_piece pieces[FS_MAX_VEC];
+	struct io_request *next_free;
+};
+
+/* A read being done by the I/O engine, for the pieces of one or more
+ * requests */
+struct io_work {
+	struct io_req io;		// must be first
+	struct read_piece *pieces;	// NULL when the read is not in use
+	char *staging;			// FS_MAX_SECTORS sectors to read into
+					// when no piece may be read into
+	void *client;			// whose memory it reads into, or NULL
+					// for staging
+	char *overlay;			// and as many written sectors
+	uint64_t written;		// mask of the sectors in `overlay`
+	uint64_t wseq;			// write_cache_seq() when it started
+	struct io_thread_state *owner;
+	struct io_work *next_free;
+};
+
+/* State of one I/O thread. Every read in flight has at least one request
+ * waiting on it, and each batch holds at most sched_window requests, so
+ * engine->queue_depth reads and that many more requests are enough. */
+struct io_thread_state {
+	struct io_thread_info *self;
+	struct volume *vol;
+	const struct io_engine *engine;	// the volume's
+	void *ctx;			// engine context
+	struct io_work *work;
+	struct io_work *free;
+	char *staging;			// of all the reads
+	char *overlays;
+	struct io_request *reqs;
+	struct io_request *free_reqs;
+	int in_flight;			// reads
+	struct fs_process_sring **answered;	// rings with answers not yet
+	int nanswered;				// signalled, queue_depth at most
+	struct io_request **batch;	// requests whose reads are not started
+	int nbatch;
+	struct read_piece **pieces;	// of the requests in the batch
+	int npieces;
+	struct read_extent *extents;	// of a batch, or of its readahead
+	struct read_piece *ra_pool;
+	struct read_piece *ra_free;
+	struct read_piece **ra;		// readahead asked for by the batch
+	int nra;
+};
+
+/* Wakes the clients waiting on each ring that has had requests answered since
+ * the last call, once per ring however many were answered */
+static void signal_completions(struct io_thread_state *st)
+{
+	for (int i = 0; i < st->nanswered; ++i)
+		RB_SIGNAL_COMPLETIONS(fs_process, st->answered[i]);
+	st->nanswered = 0;
+}
+
+/* Notes that a request on `ring` has been answered, to be signalled with the
+ * rest of the batch */
+static void defer_signal(struct io_thread_state *st,
+			 struct fs_process_sring *ring)
+{
+	for (int i = 0; i < st->nanswered; ++i)
+		if (st->answered[i] == ring)
+			return;
+	if (st->nanswered == st->engine->queue_depth)
+		signal_completions(st);
+	st->answered[st->nanswered++] = ring;
+}
+
+/* Drops a reference to a request, answering it on the client's ring and
+ * freeing it if that was the last one. A failed request's buffers are given
+ * back to the pool here, since the client never sees them. */
+static void put_request(struct io_thread_state *st, struct io_request *r)
+{
+	if (--r->pending)
+		return;
+	struct fs_response *rsp = &r->entry->rsp;
+	if (r->error && r->nbufs) {
+		fs_pool_release(r->shm, r->buf, r->nbufs);
+		r->nbufs = 0;
+	}
+	rsp->error = r->error;
+	rsp->buf = r->nbufs ? r->buf : -1;
+	rsp->nbufs = r->nbufs;
+	RB_COMPLETE_QUIET(fs_process, r->ring, r->pos);
+	defer_signal(st, r->ring);
+	r->next_free = st->free_reqs;
+	st->free_reqs = r;
+}
+
+/* Counts a request as coalesced, the first time it shares a read. Readahead
+ * pieces have no request. */
+static void mark_shared(struct io_thread_state *st, struct io_request *r)
+{
+	if (!r || r->shared)
+		return;
+	r->shared = True;
+	++st->self->coalesced;
+}
+
+/* Frees an io_work whose read is done, and drops the requests of its
+ * pieces. Readahead pieces, which have no request, go back to the pool. */
+static void finish_work(struct io_work *w)
+{
+	struct io_thread_state *st = w->owner;
+	struct read_piece *p = w->pieces, *next;
+	w->pieces = NULL;
+	w->next_free = st->free;
+	st->free = w;
+	--st->in_flight;
+	for (; p; p = next) {
+		next = p->next;
+		if (p->owner) {
+			put_request(st, p->owner);
+		} else {
+			p->next = st->ra_free;
+			st->ra_free = p;
 		}
 	}
 }
 
-/* Returns the size of a file in bytes */
-static size_t fsize(FILE *file)
+/* Copies the sectors clients had written, but that were not yet on the file
+ * when a read started, over what it read */
+static void apply_overlay(struct io_work *w)
 {
-	size_t start = ftell(file);
-	fseek(file, 0L, SEEK_END);
-	size_t size = ftell(file);
-	fseek(file, start, SEEK_SET);
-	return size;
+	for (uint64_t m = w->written; m; m &= m - 1) {
+		int i = __builtin_ctzll(m);
+		memcpy(w->io.buf + i * SECTOR_SIZE,
+		       w->overlay + i * SECTOR_SIZE, SECTOR_SIZE);
+	}
 }
 
-/* Opens the file we will be serving, and sets max_sector_number */
-static FILE *init_file_to_serve(const char *path)
+/* Whether a read of `vol` started when its write cache's count was `wseq`
+ * has seen every write made since: true if there has been none */
+static bool read_current(struct volume *vol, uint64_t wseq)
 {
-	int fd = open(path, O_RDONLY | O_DIRECT);
-	if (!fd)
-		fail_en("open");
-	FILE *file = fdopen(fd, "r");
-	if (!file)
-		fail_en("fopen");
-	file_size = fsize(file);
-	max_sector_number = ((file_size - 1) / SECTOR_SIZE) + 1;
-	return file;
+	return !vol->wcache || write_cache_seq(vol->wcache) == wseq;
 }
 
-/* Main file server thread. Continually waits for work to be put in the circular
- * linked list of worker threads. When there is work to be done, it loops around
- * the list taking each job in round-robin fasion. It performs each job and
- * signals to the worker thread that it is done.  */
-static void file_server(FILE *file)
+/* Called by the engine when a read is done. Caches the sectors, copies them
+ * out to the pieces the read stands in for, and drops their requests. A read
+ * that raced with a write is not cached, since the file may have been written
+ * back under it, and nor is one in a client's memory. */
+static void io_work_complete(struct io_req *req)
 {
-	checkpoint("%s", "File server starting");
-	sem_wait(&server_list.mtx);
-	struct stlist_node *p = server_list.first;
-	sem_post(&server_list.mtx);
-	while (!done) {
-		checkpoint("%s", "File server waiting");
-		alarm(TIMEOUT);
-		if (sem_wait(&server_list.full) == -1) {
-			int en = errno;
-			if (en == EINTR) {
-				continue;
-			} else {
-				fail_en("sem_wait");
+	struct io_work *w = (struct io_work *)req;
+	struct volume *vol = w->owner->vol;
+	if (req->error) {
+		fprintf(stderr, "Error reading sector %d: %s\n", req->sector,
+			strerror(req->error));
+		for (struct read_piece *p = w->pieces; p; p = p->next) {
+			struct io_request *r = p->owner;
+			if (r && !r->error)
+				r->error = req->error;
+		}
+	} else {
+		apply_overlay(w);
+		if (vol->cache && !w->client && read_current(vol, w->wseq))
+			for (int i = 0; i < req->count; ++i)
+				sector_cache_insert(vol->cache, req->sector + i,
+						    req->buf + i * SECTOR_SIZE);
+		coalesce_scatter(w->pieces, req->sector, req->buf);
+	}
+	finish_work(w);
+}
+
+/* Copies `count` sectors from `sector` on out of a cache into `buf`, if it
+ * has all of them but those in the mask `skip` */
+static bool read_cached(struct sector_cache *cache, int sector, int count,
+			char *buf, uint64_t skip)
+{
+	for (int i = 0; i < count; ++i)
+		if (!(skip >> i & 1) &&
+		    !sector_cache_lookup(cache, sector + i, buf + i * SECTOR_SIZE))
+			return False;
+	return True;
+}
+
+/* Reads an extent, waiting for one of the thread's reads to finish first if
+ * they are all in use. The data goes straight into a piece that covers the
+ * whole extent if there is one and the extent is all one client's, unless it
+ * is to be cached: a client may scribble over its own buffers, so what others
+ * are given or the cache keeps must come from the server's own memory. Sectors written but not yet written back are
+ * taken from the write cache, and the rest are only read if there are any.
+ * If `lookup`, they are looked for in the sector cache before going to the
+ * engine. */
+static void start_read(struct io_thread_state *st, struct read_extent *e,
+		       bool lookup)
+{
+	struct volume *vol = st->vol;
+	while (!st->free)
+		st->engine->poll(st->ctx, 1);
+	struct io_work *w = st->free;
+	st->free = w->next_free;
+	++st->in_flight;
+	w->pieces = e->pieces;
+	w->io.sector = e->sector;
+	w->io.count = e->count;
+	w->client = e->target && !vol->cache ? e->client : NULL;
+	w->io.buf = w->client ? e->target : w->staging;
+	w->written = 0;
+	if (vol->wcache) {
+		w->wseq = write_cache_seq(vol->wcache);
+		w->written = write_cache_snapshot(vol->wcache, e->sector,
+						  e->count, w->overlay);
+	}
+	uint64_t all = e->count == 64 ? ~0ull : (1ull << e->count) - 1;
+	if (w->written == all || (lookup && vol->cache &&
+	    read_cached(vol->cache, e->sector, e->count, w->io.buf,
+			w->written))) {
+		apply_overlay(w);
+		coalesce_scatter(w->pieces, e->sector, w->io.buf);
+		finish_work(w);
+	} else {
+		st->engine->submit(st->ctx, &w->io);
+	}
+}
+
+/* A read in flight that covers all of an extent, or NULL. One that started
+ * before a write since may return older data than the write, so it is not
+ * joined, and nor is one into a client's memory by another client's pieces. */
+static struct io_work *find_read(struct io_thread_state *st,
+				 struct read_extent *e)
+{
+	for (int i = 0; i < st->engine->queue_depth; ++i) {
+		struct io_work *w = &st->work[i];
+		if (w->pieces && w->io.sector <= e->sector &&
+		    e->sector + e->count <= w->io.sector + w->io.count &&
+		    (!w->client || w->client == e->client) &&
+		    read_current(st->vol, w->wseq))
+			return w;
+	}
+	return NULL;
+}
+
+/* Has the pieces of an extent wait for a read already in flight, rather than
+ * reading the sectors again */
+static void join_read(struct io_thread_state *st, struct io_work *w,
+		      struct read_extent *e)
+{
+	struct read_piece *p = w->pieces;
+	for (; p; p = p->next)
+		mark_shared(st, p->owner);
+	for (p = e->pieces; p->next; p = p->next)
+		mark_shared(st, p->owner);
+	mark_shared(st, p->owner);
+	p->next = w->pieces;
+	w->pieces = e->pieces;
+	st->self->reads_saved += e->npieces;
+}
+
+/* Starts the reads for the batch of requests taken since the last call, in
+ * the order the scheduler gave them. Pieces of the same, overlapping or
+ * adjacent sectors are read together, and pieces already being read by a read
+ * in flight wait for it. */
+static void start_batch(struct io_thread_state *st)
+{
+	int n = coalesce(st->pieces, st->npieces, FS_MAX_SECTORS, st->extents);
+	for (int i = 0; i < n; ++i) {
+		struct read_extent *e = &st->extents[i];
+		struct io_work *w = st->in_flight ? find_read(st, e) : NULL;
+		if (w) {
+			join_read(st, w, e);
+			continue;
+		}
+		if (e->shared)
+			for (struct read_piece *p = e->pieces; p; p = p->next)
+				mark_shared(st, p->owner);
+		st->self->reads_saved += e->npieces - 1;
+		start_read(st, e, True);
+	}
+	for (int i = 0; i < st->nbatch; ++i)
+		put_request(st, st->batch[i]);
+	st->nbatch = 0;
+	st->npieces = 0;
+}
+
+/* Starts the readahead asked for by the last batch, into the reads' own
+ * buffers, from where it goes into the cache. Readahead is dropped rather
+ * than waited for when every read is in use, and skipped when a read in
+ * flight already covers it. */
+static void start_readahead(struct io_thread_state *st)
+{
+	int n = coalesce(st->ra, st->nra, FS_MAX_SECTORS, st->extents);
+	for (int i = 0; i < n; ++i) {
+		struct read_extent *e = &st->extents[i];
+		if (!st->free || (st->in_flight && find_read(st, e))) {
+			struct read_piece *p = e->pieces, *next;
+			for (; p; p = next) {
+				next = p->next;
+				p->next = st->ra_free;
+				st->ra_free = p;
 			}
+			continue;
 		}
+		++st->self->ra_reads;
+		st->self->ra_sectors += e->count;
+		start_read(st, e, False);
+	}
+	st->nra = 0;
+}
+
+/* The sector a request starts at, for the scheduler */
+static uint64_t request_sector(const struct fs_request *q)
+{
+	int sector = q->op == FS_READ_VEC ? q->vec[0] :
+		     q->op == FS_FLUSH ? 0 : q->sector;
+	return sector < 0 ? 0 : sector;
+}
+
+/* Adds `count` sectors to be read into `buf` for a request to the batch */
+static void add_piece(struct io_thread_state *st, struct io_request *r,
+		      int sector, int count, char *buf)
+{
+	struct read_piece *p = &r->pieces[r->npieces++];
+	p->sector = sector;
+	p->count = count;
+	p->buf = buf;
+	p->owner = r;
+	p->client = r->shm;
+	++r->pending;
+	st->pieces[st->npieces++] = p;
+}
+
+/* Adds the records of a readahead plan that lie in the file to the batch's
+ * readahead, as far as there are pieces for them */
+static void add_readahead(struct io_thread_state *st,
+			  const struct ra_plan *plan)
+{
+	for (int k = 0; k < plan->n && st->ra_free; ++k) {
+		int sector = plan->sector + k * plan->stride;
+		if (sector < 0 || sector > st->vol->nsectors - plan->count)
+			return;
+		struct read_piece *p = st->ra_free;
+		st->ra_free = p->next;
+		p->sector = sector;
+		p->count = plan->count;
+		p->buf = NULL;
+		p->owner = NULL;
+		p->client = NULL;
+		st->ra[st->nra++] = p;
+	}
+}
+
+/* A flush waiting for the write cache */
+struct flush_waiter {
+	struct fs_process_sring *ring;
+	union fs_process_sring_entry *entry;
+	unsigned int pos;
+};
+
+/* Answers a flush, from the write cache's flusher */
+static void flush_done(void *arg, int error)
+{
+	struct flush_waiter *f = arg;
+	struct fs_response *rsp = &f->entry->rsp;
+	rsp->error = error;
+	rsp->buf = -1;
+	rsp->nbufs = 0;
+	RB_COMPLETE(fs_process, f->ring, f->pos);
+	free(f);
+}
+
+/* Puts a write's sectors in the write cache. While it is too dirty to take
+ * them, the thread starts the batch taken so far and goes on finishing its
+ * reads and waking their clients, and only sleeps until the flusher makes
+ * room once it has no reads left in flight. */
+static void write_sectors(struct io_thread_state *st,
+			  const struct fs_request *q, const char *data)
+{
+	struct write_cache *wcache = st->vol->wcache;
+	for (int i = 0; i < q->count; ++i) {
+		while (!write_cache_try_write(wcache, q->sector + i,
+					      data + i * SECTOR_SIZE)) {
+			if (st->nbatch)
+				start_batch(st);
+			signal_completions(st);
+			if (st->in_flight)
+				st->engine->poll(st->ctx, 1);
+			else
+				write_cache_wait(wcache);
+		}
+	}
+}
+
+/* Adds a request to the batch, with its data going to buffers claimed from
+ * the client's pool. Runs of consecutive sectors in a vectored request are
+ * one piece. A request that cannot be served is answered straight away, and
+ * so is a write, once its sectors are in the write cache. A flush is answered
+ * by the write cache when it is done. */
+static void take_request(struct io_thread_state *st, struct work_item w)
+{
+	struct stlist_node *n = w.node;
+	/* the response overwrites the request, so take a copy */
+	struct fs_request q = w.entry->req;
+	struct write_cache *wcache = st->vol->wcache;
+	if (q.op == FS_FLUSH && q.volume == st->vol->index && wcache) {
+		struct flush_waiter *f = emalloc(sizeof(*f));
+		f->ring = n->ring;
+		f->entry = w.entry;
+		f->pos = w.pos;
+		write_cache_barrier(wcache, &flush_done, f);
+		return;
+	}
+	struct io_request *r = st->free_reqs;
+	st->free_reqs = r->next_free;
+	r->shm = n->shm;
+	r->ring = n->ring;
+	r->entry = w.entry;
+	r->pos = w.pos;
+	r->pending = 1;
+	r->error = 0;
+	r->nbufs = 0;
+	r->shared = False;
+	r->npieces = 0;
+
+	if (!fs_request_valid(&q, st->vol->index, st->vol->nsectors)) {
+		r->error = EINVAL;
+		goto fail;
+	}
+	if (q.op == FS_FLUSH)
+		goto fail; // nothing is ever dirty
+	if (q.op == FS_WRITE) {
+		if (!wcache)
+			r->error = EROFS;
+		else
+			write_sectors(st, &q, n->shm->pool[q.buf]);
+		goto fail;
+	}
+	int count = q.op == FS_READ ? 1 : q.count;
+	r->buf = fs_pool_alloc(n->shm, FS_POOL_BUFFERS_FOR(count));
+	if (r->buf == -1) {
+		r->error = ENOBUFS;
+		goto fail;
+	}
+	r->nbufs = FS_POOL_BUFFERS_FOR(count);
+	char *data = n->shm->pool[r->buf];
+
+	if (q.op == FS_READ) {
+		add_piece(st, r, q.sector, 1, data);
+	} else if (q.op == FS_READ_RANGE) {
+		add_piece(st, r, q.sector, q.count, data);
+	} else {
+		for (int i = 0, j; i < q.count; i = j) {
+			for (j = i + 1; j < q.count; ++j)
+				if (q.vec[j] != q.vec[j - 1] + 1)
+					break;
+			add_piece(st, r, q.vec[i], j - i,
+				  data + i * SECTOR_SIZE);
+		}
+	}
+	st->batch[st->nbatch++] = r;
+	if (w.ra.n)
+		add_readahead(st, &w.ra);
+	return;
+fail:
+	put_request(st, r);
+}
+
+static void io_thread_cleanup(void *arg)
+{
+	struct io_thread_state *st = arg;
+	st->engine->thread_exit(st->ctx);
+	free(st->work);
+	free(st->staging);
+	free(st->overlays);
+	free(st->reqs);
+	free(st->answered);
+	free(st->batch);
+	free(st->pieces);
+	free(st->extents);
+	free(st->ra_pool);
+	free(st->ra);
+}
+
+/* Takes requests off the work queues into the scheduler's window until it is
+ * full or there are no more. Sleeps for one only if the thread has nothing at
+ * all to do. */
+static void fill_window(struct io_thread_state *st, struct io_thread_info *self)
+{
+	while (!io_sched_full(self->sched)) {
+		bool idle = !st->in_flight && !st->nbatch &&
+			    !io_sched_count(self->sched);
+		if (idle)
+			signal_completions(st); // before sleeping
+		checkpoint("%s", "I/O thread waiting");
+		struct work_item w;
+		if (work_queue_set_take(&self->vol->queues, self->index, &w,
+					idle))
+			return;
 		checkpoint("%s", "New work!");
-		p = find_work(p);
-		pthread_mutex_lock(&p->mtx);
-		int sector = p->entry->req;
-		fill_sector_data(sector, p->entry->rsp.data, file);
-		p->has_work = False;
-		pthread_cond_signal(&p->cond);
-		pthread_mutex_unlock(&p->mtx);
+		alarm(TIMEOUT);
+		io_sched_add(self->sched, w, request_sector(&w.entry->req),
+			     rb_now_ns());
 	}
 }
 
-/* Handler for the worker thread servers. Note that the fs_process_sring_entry
- * is locked by a mutex through the duration of this call */
-static void data_lookup_handle(union fs_process_sring_entry *entry,
-			       struct stlist_node *ll_node)
+/* I/O thread. Continually takes requests off its work queue, which the worker
+ * threads of its home clients fill, and hands their reads to the I/O engine;
+ * each request is answered directly on the client's ring when the last of its
+ * reads is done. When its own queue is empty it steals from the other I/O
+ * threads' queues. Requests wait in the scheduler's window, which picks the
+ * order they are taken in. They are taken in batches of up to a window, whose
+ * reads are coalesced before going to the engine in that order. It hands over
+ * as much work as the engine has room for before polling the engine, and only
+ * sleeps waiting for new work when it has nothing in flight. The clients
+ * waiting on a ring are woken once for all the requests of theirs answered in
+ * a batch. Any number of these run at once. */
+static void *io_thread(void *arg)
 {
-	/* We let the file server thread we have work to do, and wait till it
-	 * finishes */
-	pthread_mutex_lock(&ll_node->mtx);
-	ll_node->entry = entry;
-	ll_node->has_work = True;
-	sem_post(&server_list.full);
-	checkpoint("%s", "Waiting for file server");
-	while (ll_node->has_work) {
-		pthread_cond_wait(&ll_node->cond, &ll_node->mtx);
+	struct io_thread_info *self = arg;
+	checkpoint("I/O thread %d starting", self->index);
+
+	struct io_thread_state st;
+	const struct io_engine *engine = self->vol->engine;
+	int nreqs = engine->queue_depth + sched_window;
+	st.self = self;
+	st.vol = self->vol;
+	st.engine = engine;
+	st.ctx = engine->thread_init(self->vol->fd);
+	if (!st.ctx)
+		fail("I/O engine failed to start");
+	st.work = emalloc(engine->queue_depth * sizeof(*st.work));
+	st.staging = emalloc(engine->queue_depth * FS_MAX_SECTORS *
+			     SECTOR_SIZE);
+	st.overlays = st.vol->wcache ? emalloc(engine->queue_depth * FS_MAX_SECTORS *
+				       SECTOR_SIZE) : NULL;
+	st.reqs = emalloc(nreqs * sizeof(*st.reqs));
+	st.free = NULL;
+	st.free_reqs = NULL;
+	st.in_flight = 0;
+	st.answered = emalloc(engine->queue_depth * sizeof(*st.answered));
+	st.nanswered = 0;
+	st.batch = emalloc(sched_window * sizeof(*st.batch));
+	st.nbatch = 0;
+	st.pieces = emalloc(sched_window * FS_MAX_VEC * sizeof(*st.pieces));
+	st.npieces = 0;
+	int nextents = sched_window * FS_MAX_VEC;
+	if (nextents < READAHEAD_PIECES)
+		nextents = READAHEAD_PIECES;
+	st.extents = emalloc(nextents * sizeof(*st.extents));
+	st.ra_pool = emalloc(READAHEAD_PIECES * sizeof(*st.ra_pool));
+	st.ra_free = NULL;
+	st.ra = emalloc(READAHEAD_PIECES * sizeof(*st.ra));
+	st.nra = 0;
+	for (int i = 0; i < READAHEAD_PIECES; ++i) {
+		st.ra_pool[i].next = st.ra_free;
+		st.ra_free = &st.ra_pool[i];
+	}
+	for (int i = 0; i < engine->queue_depth; ++i) {
+		st.work[i].io.complete = &io_work_complete;
+		st.work[i].pieces = NULL;
+		st.work[i].staging = st.staging +
+				     i * FS_MAX_SECTORS * SECTOR_SIZE;
+		if (st.vol->wcache)
+			st.work[i].overlay = st.overlays +
+					     i * FS_MAX_SECTORS * SECTOR_SIZE;
+		st.work[i].written = 0;
+		st.work[i].wseq = 0;
+		st.work[i].owner = &st;
+		st.work[i].next_free = st.free;
+		st.free = &st.work[i];
+	}
+	for (int i = 0; i < nreqs; ++i) {
+		st.reqs[i].next_free = st.free_reqs;
+		st.free_reqs = &st.reqs[i];
+	}
+
+	pthread_cleanup_push(&io_thread_cleanup, &st);
+	for (;;) {
+		while (st.in_flight < engine->queue_depth && st.free_reqs &&
+		       st.nbatch < sched_window) {
+			struct work_item w;
+			fill_window(&st, self);
+			if (io_sched_next(self->sched, &w, rb_now_ns()))
+				break;
+			take_request(&st, w);
+		}
+		start_batch(&st);
+		signal_completions(&st);
+		if (st.nra)
+			start_readahead(&st);
+		if (st.in_flight) {
+			engine->poll(st.ctx, 1);
+			signal_completions(&st);
+		}
+	}
+	pthread_cleanup_pop(1); // 1 => execute cleanup unconditionally
+	return NULL;
+}
+
+/* Splits the I/O threads evenly between the volumes, each volume's being
+ * consecutive, and sets up each volume's queues with a home for each of its
+ * threads */
+static void assign_io_threads()
+{
+	for (int v = 0, i = 0; v < volume_count; ++v) {
+		struct volume *vol = &volumes[v];
+		vol->threads = &io_threads[i];
+		vol->nthreads = io_thread_count / volume_count +
+				(v < io_thread_count % volume_count);
+		work_queue_set_init(&vol->queues, vol->nthreads);
+		for (int k = 0; k < vol->nthreads; ++k, ++i) {
+			io_threads[i].index = k;
+			io_threads[i].vol = vol;
+		}
+	}
+}
+
+/* Starts the I/O threads. If `pin`, I/O thread i is pinned to the i-th CPU we
+ * may run on (wrapping around), so that its queue and its clients' rings stay
+ * in that core's cache, and each volume's threads have CPUs of their own as
+ * long as there are enough. */
+static void start_io_threads(bool pin)
+{
+	cpu_set_t allowed;
+	int ncpus = 0;
+	if (pin) {
+		if (sched_getaffinity(0, sizeof(allowed), &allowed))
+			fail_en("sched_getaffinity");
+		ncpus = CPU_COUNT(&allowed);
+	}
+	for (int i = 0, cpu = -1; i < io_thread_count; ++i) {
+		struct io_thread_info *t = &io_threads[i];
+		t->cpu = -1;
+		t->sched = io_sched_create(sched_policy, sched_window,
+					   sched_max_latency_us * 1000);
+		if (ncpus) {
+			do
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			while (!CPU_ISSET(cpu, &allowed));
+			t->cpu = cpu;
+		}
+		if (pthread_create(&t->tid, NULL, &io_thread, t))
+			fail("pthread_create");
+		if (t->cpu != -1) {
+			cpu_set_t one;
+			CPU_ZERO(&one);
+			CPU_SET(t->cpu, &one);
+			if ((errno = pthread_setaffinity_np(t->tid, sizeof(one),
+							    &one)))
+				fail_en("pthread_setaffinity_np");
+		}
+	}
+}
+
+static void kill_io_threads()
+{
+	for (int i = 0; i < io_thread_count; ++i)
+		pthread_cancel(io_threads[i].tid);
+	for (int i = 0; i < io_thread_count; ++i) {
+		pthread_join(io_threads[i].tid, NULL);
+		io_sched_destroy(io_threads[i].sched);
+	}
+}
+
+/* Prints the server's counters to stdout */
+static void print_stats()
+{
+	if (sched_policy != IOSCHED_FIFO) {
+		uint64_t dispatched = 0, expired = 0;
+		for (int i = 0; i < io_thread_count; ++i) {
+			uint64_t d, e;
+			io_sched_stats(io_threads[i].sched, &d, &e);
+			dispatched += d;
+			expired += e;
+		}
+		printf("scheduler: %s, window %d, dispatched %llu, "
+		       "past deadline %llu\n", sched_policy_name(sched_policy),
+		       sched_window, (unsigned long long)dispatched,
+		       (unsigned long long)expired);
+	}
+	uint64_t coalesced = 0, saved = 0;
+	for (int i = 0; i < io_thread_count; ++i) {
+		coalesced += io_threads[i].coalesced;
+		saved += io_threads[i].reads_saved;
+	}
+	printf("coalescing: %llu requests shared a read, %llu reads saved\n",
+	       (unsigned long long)coalesced, (unsigned long long)saved);
+	if (readahead_window) {
+		uint64_t reads = 0, sectors = 0;
+		for (int i = 0; i < io_thread_count; ++i) {
+			reads += io_threads[i].ra_reads;
+			sectors += io_threads[i].ra_sectors;
+		}
+		printf("readahead: %llu reads, %llu sectors\n",
+		       (unsigned long long)reads, (unsigned long long)sectors);
+	}
+	for (int v = 0; v < volume_count; ++v) {
+		struct volume *vol = &volumes[v];
+		/* the volume is only named when there is more than one */
+		char name[32] = "";
+		if (volume_count > 1)
+			sprintf(name, "volume %d ", v);
+		if (vol->cache) {
+			struct cache_stats cs;
+			sector_cache_stats(vol->cache, &cs);
+			uint64_t lookups = cs.hits + cs.misses;
+			printf("%scache: %zu sectors, hits %llu, misses %llu "
+			       "(%.1f%% hit), insertions %llu, evictions %llu\n",
+			       name, cs.capacity, (unsigned long long)cs.hits,
+			       (unsigned long long)cs.misses,
+			       lookups ? 100.0 * cs.hits / lookups : 0.0,
+			       (unsigned long long)cs.insertions,
+			       (unsigned long long)cs.evictions);
+		}
+		if (vol->wcache) {
+			struct write_cache_stats ws;
+			write_cache_stats(vol->wcache, &ws);
+			printf("%swrite cache: %zu sectors, %zu dirty, writes "
+			       "%llu, written back %llu in %llu calls, barriers "
+			       "%llu, throttled %llu\n", name, ws.capacity,
+			       ws.dirty, (unsigned long long)ws.writes,
+			       (unsigned long long)ws.writebacks,
+			       (unsigned long long)ws.write_calls,
+			       (unsigned long long)ws.barriers,
+			       (unsigned long long)ws.throttled);
+		}
 	}
-	pthread_mutex_unlock(&ll_node->mtx);
-	checkpoint("%s", "file server done");
+	fflush(stdout);
+}
+
+/* Sleeps until a signal handler sets `done`, printing the statistics whenever
+ * they are asked for. `oldset` is the mask to sleep with; the handled signals
+ * are blocked in between checks so none can be missed */
+static void wait_for_exit(sigset_t *oldset)
+{
+	sigset_t exitset;
+	sigemptyset(&exitset);
+	sigaddset(&exitset, SIGTERM);
+	sigaddset(&exitset, SIGALRM);
+	sigaddset(&exitset, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &exitset, NULL);
+	while (!done) {
+		sigsuspend(oldset);
+		if (dump_stats) {
+			dump_stats = 0;
+			print_stats();
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, oldset, NULL);
+}
+
+/* Parses a size in bytes, with an optional k, m or g suffix. Returns -1 if it
+ * is not one. */
+static long long parse_size(const char *str)
+{
+	char *end;
+	long long size = strtoll(str, &end, 10);
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		size <<= 10;
+		++end;
+	}
+	return (end == str || *end || size < 0) ? -1 : size;
+}
+
+/* Parses the write cache's `size[:background_ratio[:dirty_ratio]]`, with the
+ * ratios in percent. Returns -1 if that is not what it is. */
+static int parse_write_cache(const char *str, long long *size,
+			     int *background_ratio, int *dirty_ratio)
+{
+	char buf[64];
+	if (strlen(str) >= sizeof(buf))
+		return -1;
+	strcpy(buf, str);
+	char *ratios = strchr(buf, ':');
+	if (ratios)
+		*ratios++ = '\0';
+	if ((*size = parse_size(buf)) == -1)
+		return -1;
+	if (!ratios)
+		return 0;
+	char *end;
+	*background_ratio = strtol(ratios, &end, 10);
+	if (end == ratios)
+		return -1;
+	if (*end == ':') {
+		ratios = end + 1;
+		*dirty_ratio = strtol(ratios, &end, 10);
+		if (end == ratios)
+			return -1;
+	}
+	return *end ? -1 : 0;
+}
+
+/* Handler for the worker thread servers. Queues the request for the client's
+ * home I/O thread on the volume it is for and returns straight away, so the
+ * worker can go on taking requests off the ring; an I/O thread answers the
+ * request when it gets to it. */
+static void data_lookup_handle(union fs_process_sring_entry *entry,
+			       uint32_t pos, struct stlist_node *ll_node)
+{
+	const struct fs_request *q = &entry->req;
+	/* a bad volume is caught when the request is started */
+	int v = q->volume >= 0 && q->volume < volume_count ? q->volume : 0;
+	struct work_item w = { ll_node, entry, pos,
+			       q->op == FS_READ || q->op == FS_FLUSH ? 1 :
+			       q->count };
+	/* a bad count is caught when the request is started */
+	if (w.cost < 1 || w.cost > WORK_QUANTUM)
+		w.cost = 1;
+	/* vectored requests are taken to be random */
+	if (readahead_window &&
+	    (q->op == FS_READ ||
+	     (q->op == FS_READ_RANGE && q->count <= FS_MAX_SECTORS)))
+		readahead_observe(&ll_node->readahead[v], q->sector,
+				  q->op == FS_READ ? 1 : q->count,
+				  readahead_window, &w.ra);
+	work_queue_set_push(&volumes[v].queues, ll_node->source[v], w);
+	checkpoint("%s", "Queued for file server");
 }
 
 /* Cleanup functions for ring buffers. This will be called from a cancellation
@@ -202,11 +1052,27 @@ static void fs_registrar_ring_cleanup(void *arg)
 	shm_destroy(rname->shm_name, rname->ring, sizeof(*rname->ring));
 }
 
+/* Takes a client whose ring is gone out of the volumes' round robins, and
+ * off its home I/O threads' loads */
+static void release_sources(struct stlist_node *node)
+{
+	for (int v = 0; v < volume_count; ++v) {
+		struct volume *vol = &volumes[v];
+		struct work_source *src = node->source[v];
+		if (!src)
+			continue;
+		vol->threads[src->home].load -= src->qos.weight;
+		work_queue_set_remove(&vol->queues, src);
+		node->source[v] = NULL;
+	}
+}
+
 static void fs_process_ring_cleanup(void *arg_)
 {
         struct worker_arg *arg = arg_;
         struct ring_name *rname = &arg->rData;
-	shm_destroy(rname->shm_name, rname->ring, sizeof(*rname->ring));
+	release_sources(arg->ll_node);
+	shm_destroy(rname->shm_name, rname->shm, sizeof(*rname->shm));
 	free(arg);
 }
 
@@ -214,47 +1080,93 @@ static void *start_worker(void* arg_)
 {
         struct worker_arg *arg = arg_;
 	struct ring_name *rData = &arg->rData;
-        struct fs_process_sring *reg = rData->ring;
+        struct fs_process_sring *reg = &rData->shm->ring;
 	struct stlist_node *ll_node = arg->ll_node;
 
 	checkpoint("%s", "Worker thread starting");
 
 	pthread_cleanup_push(&fs_process_ring_cleanup, arg);
-	RB_SERVE(fs_process, reg, done, &data_lookup_handle, ll_node);
+	RB_SERVE_ASYNC(fs_process, reg, done, &data_lookup_handle, ll_node);
 	pthread_cleanup_pop(1); // 1 => execute cleanup unconditionally
 
 	return 0;
 }
 
 /* Handles a single request/response for client registration. Takes in the
- * client pid in entry->req, and pushes the sector limits for the served file in
- * entry->rsp. */
+ * client pid and its share of the server in entry->req, and pushes the volumes
+ * and their sector limits in entry->rsp. */
 static void reg_handle_request(union fs_registrar_sring_entry *entry, void *nil)
 {
 	// process_request
-	int client_pid = entry->req;
+	struct fs_registration reg = entry->req;
+	int client_pid = reg.pid;
 	checkpoint("server: client request %d", client_pid);
 
 	//create new ring
 	struct worker_arg *arg = emalloc(sizeof(*arg));
 	sprintf(arg->rData.shm_name, "%s.%d",
 		shm_ring_buffer_prefix, client_pid);
-	arg->rData.ring = shm_create(arg->rData.shm_name,
-				     sizeof(*arg->rData.ring));
-	RB_INIT(fs_process, arg->rData.ring, FS_PROCESS_SLOT_COUNT);
+	arg->rData.shm = shm_create(arg->rData.shm_name,
+				    sizeof(*arg->rData.shm));
+	RB_INIT(fs_process, &arg->rData.shm->ring, FS_PROCESS_SLOT_COUNT);
+	RB_SET_WAIT_POLICY(&arg->rData.shm->ring, server, &server_wait);
 
 	//create new linked list node
 	arg->ll_node = stlist_node_create();
-	stlist_insert(&server_list, arg->ll_node);
+	arg->ll_node->ring = &arg->rData.shm->ring;
+	arg->ll_node->shm = arg->rData.shm;
+	arg->ll_node->client_pid = client_pid;
+
+	/* give the client a queue on each volume, and a home I/O thread there:
+	 * the one of the volume's with the least weight on it. Only this thread
+	 * registers clients, so the loads need no lock. */
+	struct work_qos qos;
+	qos.weight = reg.weight < 1 ? 1 : reg.weight > FS_MAX_WEIGHT ?
+		     FS_MAX_WEIGHT : reg.weight;
+	qos.ops_per_sec = reg.max_iops;
+	qos.cost_per_sec = reg.max_bandwidth ?
+			   (reg.max_bandwidth + SECTOR_SIZE - 1) / SECTOR_SIZE : 0;
+	for (int v = 0; v < volume_count; ++v) {
+		struct volume *vol = &volumes[v];
+		int home = 0;
+		for (int i = 1; i < vol->nthreads; ++i)
+			if (vol->threads[i].load < vol->threads[home].load)
+				home = i;
+		vol->threads[home].load += qos.weight;
+		arg->ll_node->source[v] = work_source_create(&qos,
+							     WORK_QUEUE_SIZE);
+		work_queue_set_add(&vol->queues, home, arg->ll_node->source[v]);
+		checkpoint("Client %d, weight %d, given to I/O thread %d of "
+			   "volume %d", client_pid, qos.weight, home, v);
+	}
 
-	//spawn new worker thread)
-	pthread_create(&arg->ll_node->tid, NULL, start_worker, arg);
+	if (serve_mode == SERVE_EVENTS) {
+		/* hand the ring to the poller with the fewest */
+		int p = 0;
+		for (int i = 1; i < poller_count; ++i)
+			if (pollers[i].nclients < pollers[p].nclients)
+				p = i;
+		arg->rData.shm->doorbell = p;
+		++pollers[p].nclients;
+		stlist_insert(&pollers[p].clients, arg->ll_node);
+		free(arg);
+		checkpoint("Ring given to poller %d", p);
+	} else {
+		arg->rData.shm->doorbell = -1;
+		stlist_insert(&server_list, arg->ll_node);
 
-	checkpoint("Worker thread created. shm %s", arg->rData.shm_name);
+		//spawn new worker thread)
+		pthread_create(&arg->ll_node->tid, NULL, start_worker, arg);
+		checkpoint("Worker thread created. shm %s",
+			   arg->rData.shm_name);
+	}
 
 	// push_response
-	entry->rsp.start = 0;
-	entry->rsp.end =  max_sector_number;
+	entry->rsp.count = volume_count;
+	for (int v = 0; v < volume_count; ++v) {
+		entry->rsp.limits[v].start = 0;
+		entry->rsp.limits[v].end = volumes[v].nsectors;
+	}
 }
 
 /* starts the infinite loop for the client registrar */
@@ -285,6 +1197,75 @@ static void kill_registrar(pthread_t reg)
 	pthread_join(reg, NULL);
 }
 
+/* Poller thread, in event mode. Takes every new request off the rings of its
+ * clients and queues it for the I/O threads, the way a worker thread does for
+ * its one ring. Clients ring the doorbell after submitting, so the poller
+ * notes the doorbell before looking at the rings, and only goes to sleep if it
+ * has not been rung since. */
+static void *poller_thread(void *arg)
+{
+	struct poller *pl = arg;
+	checkpoint("%s", "Poller thread starting");
+	for (;;) {
+		uint32_t seen = __atomic_load_n(&pl->bell->seq, __ATOMIC_SEQ_CST);
+		int found = 0;
+		sem_wait(&pl->clients.mtx);
+		if (!stlist_is_empty(&pl->clients)) {
+			struct stlist_node *n = pl->clients.first;
+			do {
+				RB_SERVE_POLL(fs_process, n->ring, n->serve_pos,
+					      &data_lookup_handle, n, found);
+				n = n->next;
+			} while (n != pl->clients.first);
+		}
+		sem_post(&pl->clients.mtx);
+		if (!found)
+			rb_wait_while(&pl->bell->seq, seen, &pl->bell->waiters,
+				      &pl->wait, 1);
+	}
+	return NULL;
+}
+
+/* Creates the doorbells and starts the pollers, in event mode */
+static void start_pollers()
+{
+	doorbells = shm_create(shm_doorbell_name, sizeof(*doorbells));
+	for (int i = 0; i < poller_count; ++i) {
+		stlist_init(&pollers[i].clients);
+		pollers[i].nclients = 0;
+		pollers[i].bell = &doorbells->bell[i];
+		pollers[i].wait = server_wait;
+		if (pthread_create(&pollers[i].tid, NULL, &poller_thread,
+				   &pollers[i]))
+			fail("pthread_create");
+	}
+}
+
+/* Stops the pollers, and destroys the rings they were serving and the
+ * doorbells */
+static void kill_pollers()
+{
+	for (int i = 0; i < poller_count; ++i)
+		pthread_cancel(pollers[i].tid);
+	for (int i = 0; i < poller_count; ++i) {
+		pthread_join(pollers[i].tid, NULL);
+		struct stlist *list = &pollers[i].clients;
+		if (!stlist_is_empty(list)) {
+			struct stlist_node *p = list->first;
+			do {
+				char name[50];
+				sprintf(name, "%s.%d", shm_ring_buffer_prefix,
+					p->client_pid);
+				release_sources(p);
+				shm_destroy(name, p->shm, sizeof(*p->shm));
+				p = p->next;
+			} while (p != list->first);
+		}
+		stlist_destroy(list);
+	}
+	shm_destroy(shm_doorbell_name, doorbells, sizeof(*doorbells));
+}
+
 /* Kills all the worker threads in the linked list and waits for them finish */
 static void kill_worker_threads(struct stlist *list)
 {
@@ -308,16 +1289,120 @@ static void kill_worker_threads(struct stlist *list)
 int main(int argc, char *argv[])
 {
 	char usage[1024];
-	sprintf(usage, "Usage: %s %s %s", argv[0], "<pidfile>", "<file_to_serve>");
-	if (argc < 3)
+	sprintf(usage, "Usage: %s %s %s %s %s %s %s %s %s", argv[0],
+		"[-t <io_threads>] [-a] [-e <pread|uring|mmap[:opts]>]",
+		"[-c <cache_size>] [-r <clock|lru|2q>] [-A <max_sectors>]",
+		"[-b <write_cache_size>[:background%[:dirty%]]]",
+		"[-m <threads|events>] [-p <pollers>]",
+		"[-w <block|spin[:polls]|adaptive|busy>]",
+		"[-s <fifo|cscan|deadline>[:window[:max_latency_us]]]",
+		"<pidfile>",
+		"<file_to_serve>...");
+	io_thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	bool pin_io_threads = False;
+	poller_count = sysconf(_SC_NPROCESSORS_ONLN);
+	char *engine_name = "pread";
+	long long cache_size = 0;
+	enum cache_policy cache_policy = CACHE_CLOCK;
+	long long wcache_size = WRITE_CACHE_DEFAULT_SIZE;
+	int background_ratio = WC_DEFAULT_BACKGROUND_RATIO;
+	int dirty_ratio = WC_DEFAULT_DIRTY_RATIO;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:ae:c:r:A:b:m:p:w:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (!strcmp(optarg, "threads"))
+				serve_mode = SERVE_THREADS;
+			else if (!strcmp(optarg, "events"))
+				serve_mode = SERVE_EVENTS;
+			else
+				fail(usage);
+			break;
+		case 'p':
+			poller_count = atoi(optarg);
+			break;
+		case 'w':
+			if (rb_wait_policy_parse(optarg, &server_wait))
+				fail(usage);
+			break;
+		case 's':
+			if (sched_policy_parse(optarg, &sched_policy,
+					       &sched_window,
+					       &sched_max_latency_us))
+				fail(usage);
+			break;
+		case 'c':
+			if ((cache_size = parse_size(optarg)) == -1)
+				fail(usage);
+			break;
+		case 'r':
+			if (cache_policy_parse(optarg, &cache_policy))
+				fail(usage);
+			break;
+		case 'A':
+			readahead_window = atoi(optarg);
+			break;
+		case 'b':
+			if (parse_write_cache(optarg, &wcache_size,
+					      &background_ratio, &dirty_ratio))
+				fail(usage);
+			break;
+		case 't':
+			io_thread_count = atoi(optarg);
+			break;
+		case 'a':
+			pin_io_threads = True;
+			break;
+		case 'e':
+			engine_name = optarg;
+			break;
+		default:
+			fail(usage);
+		}
+	}
+	if (argc - optind < 2)
 		fail(usage);
+	volume_count = argc - optind - 1;
+	if (volume_count > FS_MAX_VOLUMES)
+		fail("too many files to serve");
+	/* every volume needs a thread of its own */
+	if (io_thread_count >= 1 && io_thread_count < volume_count)
+		io_thread_count = volume_count;
+	if (io_thread_count < 1 || io_thread_count > MAX_IO_THREADS)
+		fail("I/O thread count out of range");
+	if (poller_count < 1 || poller_count > FS_MAX_POLLERS)
+		fail("poller count out of range");
+	if (readahead_window < 0 || readahead_window > RA_MAX_WINDOW)
+		fail("readahead window out of range");
+	if (background_ratio < 1 || dirty_ratio > 100 ||
+	    background_ratio > dirty_ratio)
+		fail("write cache ratios out of range");
+	/* FIFO gains nothing from a window, so by default it holds only the
+	 * request it is about to start and leaves the rest to be stolen */
+	if (!sched_window)
+		sched_window = sched_default_window(sched_policy);
+
+	/* open the files before daemonizing, so any problem is reported. The
+	 * caches are split evenly between them. */
+	for (int v = 0; v < volume_count; ++v) {
+		struct volume *vol = &volumes[v];
+		init_file_to_serve(vol, v, argv[optind + 1 + v]);
+		vol->engine = io_engine_select(engine_name, vol->fd);
+		if (!vol->engine)
+			fail(usage);
+		if (cache_size)
+			vol->cache = sector_cache_create(cache_size /
+							 volume_count,
+							 cache_policy);
+	}
+	/* readahead only pays off through the cache */
+	if (!cache_size)
+		readahead_window = 0;
 	daemonize();
 
-	char *pidfile_path = argv[1];
+	char *pidfile_path = argv[optind];
 	pidfile_create(pidfile_path);
 
-	FILE *file_to_serve = init_file_to_serve(argv[2]);
-
 	/* block all signals */
 	sigset_t sigset, oldset;
 	sigfillset(&sigset);
@@ -325,23 +1410,56 @@ int main(int argc, char *argv[])
 
 	/* Create the internal circular linked list for worker threads */
 	stlist_init(&server_list);
+	assign_io_threads();
 
-	/* start the registrar */
+	/* a file we cannot write is served read-only; so is one with no room
+	 * for writes */
+	for (int v = 0; v < volume_count; ++v) {
+		struct volume *vol = &volumes[v];
+		if (vol->writable)
+			vol->wcache = write_cache_create(vol->fd, vol->size,
+							 wcache_size /
+							 volume_count,
+							 background_ratio,
+							 dirty_ratio,
+							 vol->cache);
+	}
+
+	/* start the pollers, the registrar and the I/O threads */
+	if (serve_mode == SERVE_EVENTS)
+		start_pollers();
 	pthread_t reg = start_registrar();
+	start_io_threads(pin_io_threads);
 
 	/* Unblock "done" signal(s) */
 	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
 	install_sig_handler(SIGTERM, &exit_handler);
 	install_sig_handler(SIGALRM, &exit_handler);
+	install_sig_handler(SIGUSR1, &stats_handler);
+	alarm(TIMEOUT);
 
-	/* Start the file server */
-	file_server(file_to_serve);
+	wait_for_exit(&oldset);
 
 	/* Kill all the threads */
 	kill_registrar(reg);
+	kill_io_threads();
+	print_stats();
+	/* write back what is left, and answer the flushes still waiting while
+	 * their rings are still there */
+	for (int v = 0; v < volume_count; ++v)
+		if (volumes[v].wcache)
+			write_cache_destroy(volumes[v].wcache);
+	if (serve_mode == SERVE_EVENTS)
+		kill_pollers();
 	kill_worker_threads(&server_list);
 
-	fclose(file_to_serve);
+	for (int v = 0; v < volume_count; ++v) {
+		struct volume *vol = &volumes[v];
+		work_queue_set_destroy(&vol->queues);
+		if (vol->cache)
+			sector_cache_destroy(vol->cache);
+		close(vol->fd);
+	}
 	pidfile_destroy(pidfile_path);
 	return 0;
 }
@@ -11,9 +11,10 @@ RUNDIR="$( cd "$( dirname "$0" )" && pwd )"
 server_name="server"
 daemon_name="serviced"
 pidfile=$RUNDIR/$daemon_name.pid
-imgfile=$RUNDIR/../disk1.img
+# the images to serve, one volume each; space separated
+imgfiles=${FS_IMAGES:-$RUNDIR/../disk1.img}
 
-usage="$0 [start | stop]"
+usage="$0 [start [server options] | stop]"
 
 start() {
 	if [ -f $pidfile ]
@@ -21,7 +22,7 @@ start() {
 		echo "Daemon is already running"
 		exit
 	else
-		cmd="${RUNDIR}/${server_name} $pidfile $imgfile"
+		cmd="${RUNDIR}/${server_name} $server_opts $pidfile $imgfiles"
 		echo "Running $cmd"
 		$cmd
 	fi
@@ -40,13 +41,17 @@ stop() {
 }
 
 
-if [ "$#" != 1 ]
+if [ "$#" -lt 1 ]
 then
 	echo $usage
 	exit
 fi
 
-case "$1" in
+action=$1
+shift
+server_opts="$*"
+
+case "$action" in
 	"start")
 		start
 		;;
@@ -1,8 +1,24 @@
 # Add all source files (not headers) here
 
 SERVER_SRCS = server.c \
+	      coalesce.c \
+	      data_pool.c \
+	      io_engine.c \
+	      io_sched.c \
+	      io_uring_engine.c \
+	      mmap_engine.c \
+	      readahead.c \
+	      request.c \
+	      sector_cache.c \
 	      shm.c \
-	      stlist.c
+	      stlist.c \
+	      work_queue.c \
+	      write_cache.c
 
 CLIENT_SRCS = client.c \
-	      shm.c
+	      data_pool.c \
+	      histogram.c \
+	      result_stream.c \
+	      shm.c \
+	      verify.c \
+	      workload.c
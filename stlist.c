@@ -7,22 +7,17 @@
 
 #include "stlist.h"
 #include "common.h"
-#include "file_service.h"
 
 /* Alloc's, initializes and returns a new server_list_node */
 struct stlist_node *stlist_node_create()
 {
 	struct stlist_node *n = ecalloc(sizeof(*n));
-	pthread_mutex_init(&n->mtx, NULL);
-	pthread_cond_init(&n->cond, NULL);
 	return n;
 }
 
 /* Destroy's a server_list_node */
 void stlist_node_destroy(struct stlist_node *n)
 {
-	pthread_mutex_destroy(&n->mtx);
-	pthread_cond_destroy(&n->cond);
 	free(n);
 }
 
@@ -31,7 +26,6 @@ void stlist_init(struct stlist *list)
 	/* A dummy sentinal node. The list is empty when first==nil */
 	list->nil = stlist_node_create();
 	list->first = list->nil;
-	sem_init(&list->full, 0, 0);
 	sem_init(&list->mtx, 0, 1);
 }
 
@@ -6,20 +6,28 @@
 #ifndef STLIST_H_
 #define STLIST_H_
 
+#include <stdint.h>
 #include <pthread.h>
 #include <semaphore.h>
 
 #include "common.h"
+#include "file_service.h"
+#include "readahead.h"
 
-union fs_process_sring_entry;
+struct fs_process_sring;
+struct fs_process_shm;
+struct work_source;
 
 /* Node for the linked list of registered server threads */
 struct stlist_node {
 	struct stlist_node *next;
-	union fs_process_sring_entry *entry;
-	int has_work;
-	pthread_mutex_t mtx;		// protects has_work
-	pthread_cond_t cond;
+	struct fs_process_sring *ring;
+	struct fs_process_shm *shm;	// the client's segment, for its pool
+	int client_pid;
+	uint32_t serve_pos;		// next ring position, when polled
+	struct work_source *source[FS_MAX_VOLUMES];	// queues its requests
+							// wait in, by volume
+	struct ra_state readahead[FS_MAX_VOLUMES];	// streams it is reading
 	pthread_t tid;			// use to cancel() the pthread
 };
 
@@ -27,7 +35,6 @@ struct stlist_node {
 struct stlist {
 	struct stlist_node *first;
 	struct stlist_node *nil;	// used for implementation
-	sem_t full;			// 0 when there is no work to be done
 	sem_t mtx;			// protects the "first" pointer and all
 					// the node->next pointers
 };
@@ -0,0 +1,144 @@
+#include "CuTest.h"
+#include <coalesce.c>
+
+static char tc_client[1];
+
+/* Fills in `n` pieces, the i-th owned by owners[i], all of one client */
+static void make_pieces(struct read_piece *pieces, struct read_piece **ptrs,
+			const int *sectors, const int *counts,
+			const long *owners, int n)
+{
+	for (int i = 0; i < n; ++i) {
+		pieces[i].sector = sectors[i];
+		pieces[i].count = counts[i];
+		pieces[i].buf = NULL;
+		pieces[i].owner = (void *)owners[i];
+		pieces[i].client = tc_client;
+		ptrs[i] = &pieces[i];
+	}
+}
+
+/* Reads of the same sector, and of adjacent or overlapping sectors, become one
+ * extent each; a gap starts a new one. Extents come in the order of their
+ * first pieces. */
+void test_coalesce_merge(CuTest *tc)
+{
+	int sectors[] = { 10, 3, 11, 10, 4, 20 };
+	int counts[] = { 1, 1, 2, 1, 3, 1 };
+	long owners[] = { 1, 2, 3, 4, 2, 5 };
+	struct read_piece pieces[6], *ptrs[6];
+	struct read_extent e[6];
+	make_pieces(pieces, ptrs, sectors, counts, owners, 6);
+
+	CuAssertIntEquals(tc, 3, coalesce(ptrs, 6, 64, e));
+	CuAssertIntEquals(tc, 10, e[0].sector);
+	CuAssertIntEquals(tc, 3, e[0].count);
+	CuAssertIntEquals(tc, 3, e[0].npieces);
+	CuAssertTrue(tc, e[0].shared);
+	CuAssertIntEquals(tc, 3, e[1].sector);
+	CuAssertIntEquals(tc, 4, e[1].count);
+	CuAssertIntEquals(tc, 2, e[1].npieces);
+	CuAssertTrue(tc, !e[1].shared);
+	CuAssertIntEquals(tc, 20, e[2].sector);
+	CuAssertIntEquals(tc, 1, e[2].npieces);
+
+	int n = 0;
+	for (struct read_piece *p = e[0].pieces; p; p = p->next)
+		n += p->sector >= 10 && p->sector < 13;
+	CuAssertIntEquals(tc, 3, n);
+}
+
+/* An extent stops growing at the most sectors a read may cover, though pieces
+ * inside it still join */
+void test_coalesce_max_count(CuTest *tc)
+{
+	int sectors[] = { 0, 3, 4, 1 };
+	int counts[] = { 4, 2, 1, 2 };
+	long owners[] = { 1, 2, 3, 4 };
+	struct read_piece pieces[4], *ptrs[4];
+	struct read_extent e[4];
+	make_pieces(pieces, ptrs, sectors, counts, owners, 4);
+
+	CuAssertIntEquals(tc, 2, coalesce(ptrs, 4, 4, e));
+	CuAssertIntEquals(tc, 0, e[0].sector);
+	CuAssertIntEquals(tc, 4, e[0].count);
+	CuAssertIntEquals(tc, 2, e[0].npieces);
+	CuAssertIntEquals(tc, 3, e[1].sector);
+	CuAssertIntEquals(tc, 2, e[1].count);
+	CuAssertIntEquals(tc, 2, e[1].npieces);
+}
+
+/* A piece covering its whole extent is read into directly, and the others are
+ * copied from it */
+void test_coalesce_scatter(CuTest *tc)
+{
+	char whole[3 * SECTOR_SIZE], mid[SECTOR_SIZE], last[SECTOR_SIZE];
+	int sectors[] = { 6, 5, 7 };
+	int counts[] = { 1, 3, 1 };
+	long owners[] = { 1, 2, 3 };
+	struct read_piece pieces[3], *ptrs[3];
+	struct read_extent e[3];
+	make_pieces(pieces, ptrs, sectors, counts, owners, 3);
+	pieces[0].buf = mid;
+	pieces[1].buf = whole;
+	pieces[2].buf = last;
+
+	CuAssertIntEquals(tc, 1, coalesce(ptrs, 3, 64, e));
+	CuAssertPtrEquals(tc, whole, e[0].target);
+	for (int i = 0; i < 3; ++i)
+		memset(whole + i * SECTOR_SIZE, 'a' + i, SECTOR_SIZE);
+	coalesce_scatter(e[0].pieces, e[0].sector, e[0].target);
+	CuAssertIntEquals(tc, 'b', mid[0]);
+	CuAssertIntEquals(tc, 'b', mid[SECTOR_SIZE - 1]);
+	CuAssertIntEquals(tc, 'c', last[0]);
+	CuAssertIntEquals(tc, 'a', whole[0]);
+}
+
+/* Adjacent pieces with no piece covering them all need a buffer of their
+ * own */
+void test_coalesce_no_target(CuTest *tc)
+{
+	int sectors[] = { 8, 9 };
+	int counts[] = { 1, 1 };
+	long owners[] = { 1, 1 };
+	struct read_piece pieces[2], *ptrs[2];
+	struct read_extent e[2];
+	make_pieces(pieces, ptrs, sectors, counts, owners, 2);
+
+	CuAssertIntEquals(tc, 1, coalesce(ptrs, 2, 64, e));
+	CuAssertPtrEquals(tc, NULL, e[0].target);
+	CuAssertTrue(tc, !e[0].shared);
+}
+
+/* Nor may pieces of more than one client be read into one of theirs */
+void test_coalesce_clients(CuTest *tc)
+{
+	char whole[2 * SECTOR_SIZE], other[SECTOR_SIZE];
+	int sectors[] = { 8, 9 };
+	int counts[] = { 2, 1 };
+	long owners[] = { 1, 2 };
+	struct read_piece pieces[2], *ptrs[2];
+	struct read_extent e[2];
+	make_pieces(pieces, ptrs, sectors, counts, owners, 2);
+	pieces[0].buf = whole;
+	pieces[1].buf = other;
+	pieces[1].client = other;
+
+	CuAssertIntEquals(tc, 1, coalesce(ptrs, 2, 64, e));
+	CuAssertPtrEquals(tc, NULL, e[0].client);
+	CuAssertPtrEquals(tc, NULL, e[0].target);
+	CuAssertTrue(tc, e[0].shared);
+}
+
+CuSuite* test_coalesce_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_coalesce_merge);
+	SUITE_ADD_TEST(suite, test_coalesce_max_count);
+	SUITE_ADD_TEST(suite, test_coalesce_scatter);
+	SUITE_ADD_TEST(suite, test_coalesce_no_target);
+	SUITE_ADD_TEST(suite, test_coalesce_clients);
+
+	return suite;
+}
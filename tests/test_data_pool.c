@@ -0,0 +1,62 @@
+#include "CuTest.h"
+#include <data_pool.c>
+
+static struct fs_process_shm *pool_create()
+{
+	struct fs_process_shm *shm;
+	if (posix_memalign((void **)&shm, FS_POOL_BUFFER_SIZE, sizeof(*shm)))
+		fail("posix_memalign");
+	memset(shm->pool_map, 0, sizeof(shm->pool_map));
+	return shm;
+}
+
+void test_data_pool_buffers_are_page_aligned(CuTest *tc)
+{
+	struct fs_process_shm *shm = pool_create();
+	CuAssertIntEquals(tc, 0, (int)((uintptr_t)shm->pool[0] %
+				       FS_POOL_BUFFER_SIZE));
+	free(shm);
+}
+
+void test_data_pool_runs_do_not_overlap(CuTest *tc)
+{
+	struct fs_process_shm *shm = pool_create();
+	int a = fs_pool_alloc(shm, 3);
+	int b = fs_pool_alloc(shm, 5);
+	int c = fs_pool_alloc(shm, 1);
+	CuAssertIntEquals(tc, 0, a);
+	CuAssertIntEquals(tc, 3, b);
+	CuAssertIntEquals(tc, 8, c);
+
+	/* a released run is reused */
+	fs_pool_release(shm, b, 5);
+	CuAssertIntEquals(tc, 3, fs_pool_alloc(shm, 4));
+	CuAssertIntEquals(tc, 9, fs_pool_alloc(shm, 2));
+	free(shm);
+}
+
+void test_data_pool_full(CuTest *tc)
+{
+	struct fs_process_shm *shm = pool_create();
+	for (int i = 0; i < FS_POOL_BUFFERS / 8; ++i)
+		CuAssertIntEquals(tc, i * 8, fs_pool_alloc(shm, 8));
+	CuAssertIntEquals(tc, -1, fs_pool_alloc(shm, 1));
+
+	/* a run never spans two words of the map */
+	fs_pool_release(shm, 56, 8);
+	fs_pool_release(shm, 64, 8);
+	CuAssertIntEquals(tc, 56, fs_pool_alloc(shm, 8));
+	CuAssertIntEquals(tc, -1, fs_pool_alloc(shm, 9));
+	free(shm);
+}
+
+CuSuite* test_data_pool_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_data_pool_buffers_are_page_aligned);
+	SUITE_ADD_TEST(suite, test_data_pool_runs_do_not_overlap);
+	SUITE_ADD_TEST(suite, test_data_pool_full);
+
+	return suite;
+}
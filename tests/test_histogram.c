@@ -0,0 +1,61 @@
+#include "CuTest.h"
+#include <histogram.c>
+
+/* Small values are counted exactly, and large ones to within 1 / HIST_SUB */
+void test_histogram_precision(CuTest *tc)
+{
+	static struct histogram h;
+	uint64_t values[] = { 0, 1, 7, 511, 512, 513, 1000, 123456,
+			      999999999, 1ULL << 39 };
+	for (int i = 0; i < 10; ++i) {
+		histogram_reset(&h);
+		histogram_record(&h, values[i]);
+		uint64_t p = histogram_percentile(&h, 50);
+		CuAssertTrue(tc, p == values[i]);
+		CuAssertIntEquals(tc, 1, (int)h.buckets[bucket_of(values[i])]);
+	}
+	for (uint64_t v = 2 * HIST_SUB; v < 1ULL << 36; v = v * 3 + 1) {
+		int b = bucket_of(v);
+		uint64_t top = bucket_top(b);
+		CuAssertTrue(tc, b < HIST_BUCKETS);
+		CuAssertTrue(tc, top >= v && top - v <= v / HIST_SUB);
+		CuAssertTrue(tc, bucket_of(top) == b &&
+			     bucket_of(top + 1) == b + 1);
+	}
+	CuAssertIntEquals(tc, HIST_BUCKETS - 1, bucket_of(UINT64_MAX));
+}
+
+/* Percentiles of merged histograms are those of all their values */
+void test_histogram_percentiles(CuTest *tc)
+{
+	static struct histogram a, b;
+	histogram_reset(&a);
+	histogram_reset(&b);
+	CuAssertTrue(tc, histogram_percentile(&a, 99) == 0);
+	for (int i = 1; i <= 10000; ++i)
+		histogram_record(i % 2 ? &a : &b, i * 1000);
+	histogram_merge(&a, &b);
+	CuAssertIntEquals(tc, 10000, (int)a.count);
+	CuAssertTrue(tc, a.min == 1000 && a.max == 10000000);
+	struct { double p; uint64_t expect; } cases[] = {
+		{ 50, 5000000 }, { 90, 9000000 }, { 99, 9900000 },
+		{ 99.9, 9990000 }, { 99.99, 9999000 }, { 100, 10000000 },
+		{ 0, 1000 }
+	};
+	for (int i = 0; i < 7; ++i) {
+		uint64_t got = histogram_percentile(&a, cases[i].p);
+		CuAssertTrue(tc, got >= cases[i].expect &&
+			     got - cases[i].expect <= cases[i].expect / HIST_SUB);
+	}
+	CuAssertDblEquals(tc, 5000500, histogram_mean(&a), 0.001);
+}
+
+CuSuite* test_histogram_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_histogram_precision);
+	SUITE_ADD_TEST(suite, test_histogram_percentiles);
+
+	return suite;
+}
@@ -0,0 +1,173 @@
+#include "CuTest.h"
+#include "coalesce.h"
+#include <io_sched.c>
+
+/* Adds requests for `sectors`, each tagged with its index, arriving at 0 */
+static void add_all(struct io_sched *s, const uint64_t *sectors, int n)
+{
+	for (int i = 0; i < n; ++i) {
+		struct work_item w = { NULL, NULL, i };
+		io_sched_add(s, w, sectors[i], 0);
+	}
+}
+
+/* Checks the next `n` requests come out in the order of the indexes in
+ * `want` */
+static void check_order(CuTest *tc, struct io_sched *s, const int *want, int n,
+			uint64_t now)
+{
+	struct work_item w;
+	for (int i = 0; i < n; ++i) {
+		CuAssertIntEquals(tc, 0, io_sched_next(s, &w, now));
+		CuAssertIntEquals(tc, want[i], w.pos);
+	}
+}
+
+void test_io_sched_fifo(CuTest *tc)
+{
+	uint64_t sectors[] = { 50, 10, 30, 10 };
+	int want[] = { 0, 1, 2, 3 };
+	struct io_sched *s = io_sched_create(IOSCHED_FIFO, 4, 0);
+	add_all(s, sectors, 4);
+	CuAssertTrue(tc, io_sched_full(s));
+	check_order(tc, s, want, 4, 0);
+	CuAssertIntEquals(tc, 0, io_sched_count(s));
+	io_sched_destroy(s);
+}
+
+/* The sweep goes upward from the last sector served, then wraps around */
+void test_io_sched_cscan(CuTest *tc)
+{
+	uint64_t first[] = { 40 };
+	int first_want[] = { 0 };
+	uint64_t sectors[] = { 50, 10, 30, 45, 10 };
+	int want[] = { 3, 0, 1, 4, 2 };
+	struct io_sched *s = io_sched_create(IOSCHED_CSCAN, 8, 0);
+	add_all(s, first, 1);
+	check_order(tc, s, first_want, 1, 0);
+	add_all(s, sectors, 5);
+	check_order(tc, s, want, 5, 0);
+	CuAssertIntEquals(tc, 0, io_sched_count(s));
+	io_sched_destroy(s);
+}
+
+/* A request past its deadline goes first, the rest in sweep order */
+void test_io_sched_deadline(CuTest *tc)
+{
+	struct io_sched *s = io_sched_create(IOSCHED_DEADLINE, 8, 100);
+	struct work_item w = { NULL, NULL, 0 };
+	io_sched_add(s, w, 90, 0);
+	w.pos = 1;
+	io_sched_add(s, w, 20, 50);
+	w.pos = 2;
+	io_sched_add(s, w, 10, 60);
+	int before[] = { 2 };
+	check_order(tc, s, before, 1, 99);
+	int after[] = { 0, 1 };
+	check_order(tc, s, after, 2, 100);
+	CuAssertIntEquals(tc, -1, io_sched_next(s, &w, 100));
+	uint64_t dispatched, expired;
+	io_sched_stats(s, &dispatched, &expired);
+	CuAssertIntEquals(tc, 3, (int)dispatched);
+	CuAssertIntEquals(tc, 1, (int)expired);
+	io_sched_destroy(s);
+}
+
+/* A batch's reads start in the order the scheduler picked, so a request past
+ * its deadline is read first even though coalescing sorts by sector */
+void test_io_sched_deadline_batch(CuTest *tc)
+{
+	struct io_sched *s = io_sched_create(IOSCHED_DEADLINE, 8, 100);
+	uint64_t sectors[] = { 90, 10, 11, 20 };
+	uint64_t arrived[] = { 0, 50, 50, 60 };
+	for (int i = 0; i < 4; ++i) {
+		struct work_item w = { NULL, NULL, i };
+		io_sched_add(s, w, sectors[i], arrived[i]);
+	}
+	struct read_piece pieces[4], *batch[4];
+	struct read_extent e[4];
+	struct work_item w;
+	for (int i = 0; i < 4; ++i) {
+		CuAssertIntEquals(tc, 0, io_sched_next(s, &w, 100));
+		pieces[i].sector = sectors[w.pos];
+		pieces[i].count = 1;
+		pieces[i].buf = NULL;
+		pieces[i].owner = &pieces[i];
+		pieces[i].client = NULL;
+		batch[i] = &pieces[i];
+	}
+	CuAssertIntEquals(tc, 3, coalesce(batch, 4, 64, e));
+	CuAssertIntEquals(tc, 90, e[0].sector);
+	CuAssertIntEquals(tc, 10, e[1].sector);
+	CuAssertIntEquals(tc, 2, e[1].count);
+	CuAssertIntEquals(tc, 20, e[2].sector);
+	io_sched_destroy(s);
+}
+
+/* With the default options, two clients reading the same sector at once are
+ * taken in one batch, and so share one read */
+void test_io_sched_fifo_batch(CuTest *tc)
+{
+	enum sched_policy p = IOSCHED_FIFO;
+	int window = sched_default_window(p);
+	struct io_sched *s = io_sched_create(p, window, 0);
+	char client_a[1], client_b[1];
+	char *clients[] = { client_a, client_b };
+	for (int i = 0; i < 2; ++i) {
+		struct work_item w = { NULL, NULL, i };
+		io_sched_add(s, w, 7, 0);
+	}
+	struct read_piece pieces[2], *batch[2];
+	struct read_extent e[2];
+	struct work_item w;
+	int n = 0;
+	while (n < window && !io_sched_next(s, &w, 0)) {
+		pieces[n].sector = 7;
+		pieces[n].count = 1;
+		pieces[n].buf = clients[w.pos];
+		pieces[n].owner = &pieces[n];
+		pieces[n].client = clients[w.pos];
+		batch[n] = &pieces[n];
+		++n;
+	}
+	CuAssertIntEquals(tc, 2, n);
+	CuAssertIntEquals(tc, 1, coalesce(batch, n, 64, e));
+	CuAssertIntEquals(tc, 2, e[0].npieces);
+	CuAssertTrue(tc, e[0].shared);
+	CuAssertPtrEquals(tc, NULL, e[0].target);
+	io_sched_destroy(s);
+}
+
+void test_io_sched_parse(CuTest *tc)
+{
+	enum sched_policy p = IOSCHED_FIFO;
+	int window = 0;
+	uint64_t lat = 7;
+	CuAssertIntEquals(tc, 0, sched_policy_parse("cscan", &p, &window, &lat));
+	CuAssertIntEquals(tc, IOSCHED_CSCAN, p);
+	CuAssertIntEquals(tc, 0, window);
+	CuAssertIntEquals(tc, 0, sched_policy_parse("deadline:16:500", &p,
+						    &window, &lat));
+	CuAssertIntEquals(tc, IOSCHED_DEADLINE, p);
+	CuAssertIntEquals(tc, 16, window);
+	CuAssertIntEquals(tc, 500, (int)lat);
+	CuAssertIntEquals(tc, -1, sched_policy_parse("cscan:0", &p, &window,
+						     &lat));
+	CuAssertIntEquals(tc, -1, sched_policy_parse("scan", &p, &window, &lat));
+	CuAssertIntEquals(tc, -1, sched_policy_parse("fifo:4:x", &p, &window,
+						     &lat));
+}
+
+CuSuite* test_io_sched_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_io_sched_fifo);
+	SUITE_ADD_TEST(suite, test_io_sched_cscan);
+	SUITE_ADD_TEST(suite, test_io_sched_deadline);
+	SUITE_ADD_TEST(suite, test_io_sched_deadline_batch);
+	SUITE_ADD_TEST(suite, test_io_sched_fifo_batch);
+	SUITE_ADD_TEST(suite, test_io_sched_parse);
+
+	return suite;
+}
@@ -4,7 +4,7 @@
 void test_stlist_node_create(CuTest *tc)
 {
 	struct stlist_node *n = stlist_node_create();
-	CuAssertIntEquals(tc, 0, n->has_work);
+	CuAssertPtrEquals(tc, NULL, n->ring);
 	CuAssertPtrEquals(tc, NULL, n->next);
 	stlist_node_destroy(n);
 }
@@ -0,0 +1,81 @@
+#include "CuTest.h"
+#include <readahead.c>
+
+/* A sequential stream is prefetched for once it has moved on twice, and the
+ * window grows as the stream catches up with what was prefetched */
+void test_readahead_sequential(CuTest *tc)
+{
+	struct ra_state ra = { { { 0 } } };
+	struct ra_plan plan;
+	CuAssertIntEquals(tc, 0, readahead_observe(&ra, 100, 4, 64, &plan));
+	CuAssertIntEquals(tc, 0, readahead_observe(&ra, 104, 4, 64, &plan));
+	CuAssertIntEquals(tc, RA_INIT_WINDOW / 4,
+			  readahead_observe(&ra, 108, 4, 64, &plan));
+	CuAssertIntEquals(tc, 112, plan.sector);
+	CuAssertIntEquals(tc, 4, plan.count);
+	CuAssertIntEquals(tc, 4, plan.stride);
+
+	int sector = 112, grown = 0;
+	for (int i = 0; i < 40; ++i, sector += 4)
+		if (readahead_observe(&ra, sector, 4, 64, &plan))
+			++grown;
+	CuAssertTrue(tc, grown > 0);
+	CuAssertIntEquals(tc, 64, ra.window);
+	CuAssertIntEquals(tc, 0, ra.wasted);
+}
+
+/* A strided stream is prefetched for record by record */
+void test_readahead_strided(CuTest *tc)
+{
+	struct ra_state ra = { { { 0 } } };
+	struct ra_plan plan;
+	readahead_observe(&ra, 0, 1, 64, &plan);
+	readahead_observe(&ra, 10, 1, 64, &plan);
+	CuAssertIntEquals(tc, RA_INIT_WINDOW,
+			  readahead_observe(&ra, 20, 1, 64, &plan));
+	CuAssertIntEquals(tc, 30, plan.sector);
+	CuAssertIntEquals(tc, 10, plan.stride);
+}
+
+/* Streams of different clients' threads are told apart, and one breaking off
+ * with prefetched records left unread cuts the window */
+void test_readahead_streams(CuTest *tc)
+{
+	struct ra_state ra = { { { 0 } } };
+	struct ra_plan plan;
+	int a = 0, b = 50000, plans = 0;
+	for (int i = 0; i < 8; ++i) {
+		plans += readahead_observe(&ra, a++, 1, 64, &plan) > 0;
+		plans += readahead_observe(&ra, b++, 1, 64, &plan) > 0;
+	}
+	CuAssertIntEquals(tc, 2, plans);
+	int window = ra.window;
+	for (int i = 0; i < RA_STREAMS; ++i)
+		readahead_observe(&ra, 90000 + 5000 * i, 1, 64, &plan);
+	CuAssertTrue(tc, ra.wasted > 0);
+	CuAssertTrue(tc, ra.window < window);
+}
+
+/* Requests all over the place are never prefetched for */
+void test_readahead_random(CuTest *tc)
+{
+	struct ra_state ra = { { { 0 } } };
+	struct ra_plan plan;
+	int sectors[] = { 500, 20, 9000, 130, 7, 4000, 40000, 600, 3 };
+	for (int i = 0; i < 9; ++i)
+		CuAssertIntEquals(tc, 0, readahead_observe(&ra, sectors[i], 1,
+							   64, &plan));
+	CuAssertIntEquals(tc, 0, readahead_observe(&ra, 0, 1, 0, &plan));
+}
+
+CuSuite* test_readahead_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_readahead_sequential);
+	SUITE_ADD_TEST(suite, test_readahead_strided);
+	SUITE_ADD_TEST(suite, test_readahead_streams);
+	SUITE_ADD_TEST(suite, test_readahead_random);
+
+	return suite;
+}
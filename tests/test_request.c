@@ -0,0 +1,73 @@
+#include "CuTest.h"
+#include <request.c>
+
+#define NSECTORS 4096
+
+static struct fs_request make_request(int op, int sector, int count)
+{
+	struct fs_request q;
+	memset(&q, 0, sizeof(q));
+	q.op = op;
+	q.sector = sector;
+	q.count = count;
+	return q;
+}
+
+/* Reads must stay on the volume they name */
+void test_request_reads(CuTest *tc)
+{
+	struct fs_request q = make_request(FS_READ, NSECTORS - 1, 0);
+	CuAssertTrue(tc, fs_request_valid(&q, 0, NSECTORS));
+	CuAssertTrue(tc, !fs_request_valid(&q, 1, NSECTORS));
+	q.sector = NSECTORS;
+	CuAssertTrue(tc, !fs_request_valid(&q, 0, NSECTORS));
+
+	q = make_request(FS_READ_RANGE, NSECTORS - FS_MAX_SECTORS,
+			 FS_MAX_SECTORS);
+	CuAssertTrue(tc, fs_request_valid(&q, 0, NSECTORS));
+	++q.sector;
+	CuAssertTrue(tc, !fs_request_valid(&q, 0, NSECTORS));
+	q = make_request(FS_READ_RANGE, 0, FS_MAX_SECTORS + 1);
+	CuAssertTrue(tc, !fs_request_valid(&q, 0, NSECTORS));
+
+	q = make_request(FS_READ_VEC, 0, 2);
+	q.vec[0] = 5;
+	q.vec[1] = NSECTORS;
+	CuAssertTrue(tc, !fs_request_valid(&q, 0, NSECTORS));
+	q.vec[1] = NSECTORS - 1;
+	CuAssertTrue(tc, fs_request_valid(&q, 0, NSECTORS));
+}
+
+/* A write is as long as a range read at most, stays on the volume, and has
+ * its data in the pool */
+void test_request_writes(CuTest *tc)
+{
+	struct fs_request q = make_request(FS_WRITE, NSECTORS - 1, 1);
+	CuAssertTrue(tc, fs_request_valid(&q, 0, NSECTORS));
+	q.count = 2;
+	CuAssertTrue(tc, !fs_request_valid(&q, 0, NSECTORS));
+	q.count = 2048;
+	CuAssertTrue(tc, !fs_request_valid(&q, 0, NSECTORS));
+	q = make_request(FS_WRITE, 0, FS_MAX_SECTORS + 1);
+	CuAssertTrue(tc, !fs_request_valid(&q, 0, NSECTORS));
+	q.count = 0;
+	CuAssertTrue(tc, !fs_request_valid(&q, 0, NSECTORS));
+
+	q = make_request(FS_WRITE, 0, FS_MAX_SECTORS);
+	q.buf = FS_POOL_BUFFERS - FS_POOL_BUFFERS_FOR(FS_MAX_SECTORS);
+	CuAssertTrue(tc, fs_request_valid(&q, 0, NSECTORS));
+	++q.buf;
+	CuAssertTrue(tc, !fs_request_valid(&q, 0, NSECTORS));
+	q.buf = -1;
+	CuAssertTrue(tc, !fs_request_valid(&q, 0, NSECTORS));
+}
+
+CuSuite* test_request_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_request_reads);
+	SUITE_ADD_TEST(suite, test_request_writes);
+
+	return suite;
+}
@@ -0,0 +1,85 @@
+#include <unistd.h>
+
+#include "CuTest.h"
+#include <result_stream.c>
+
+#define APPENDERS 4
+#define REQUESTS 500
+
+struct appender {
+	struct result_stream *rs;
+	int id;
+};
+
+/* Appends REQUESTS requests of 1 to 4 sectors, each sector's data holding its
+ * number */
+static void *append_requests(void *arg)
+{
+	struct appender *a = arg;
+	char data[4 * SECTOR_SIZE];
+	int sectors[4];
+	for (int i = 0; i < REQUESTS; ++i) {
+		int count = i % 4 + 1;
+		for (int j = 0; j < count; ++j) {
+			sectors[j] = a->id * 100000 + i * 4 + j;
+			memset(data + j * SECTOR_SIZE, 0, SECTOR_SIZE);
+			sprintf(data + j * SECTOR_SIZE, "%d", sectors[j]);
+		}
+		result_stream_append(a->rs, sectors, data, count);
+	}
+	return NULL;
+}
+
+/* Results appended by several threads, through buffers that fill many times
+ * over, all reach the files, with each sector's data where its number is */
+void test_result_stream_pairs(CuTest *tc)
+{
+	char data_name[] = "/tmp/test_result_stream.XXXXXX";
+	char sectors_name[] = "/tmp/test_result_stream.XXXXXX";
+	close(mkstemp(data_name));
+	close(mkstemp(sectors_name));
+	struct result_stream *rs = result_stream_open(data_name, sectors_name,
+						      0);
+	CuAssertPtrNotNull(tc, rs);
+
+	pthread_t threads[APPENDERS];
+	struct appender a[APPENDERS];
+	for (int i = 0; i < APPENDERS; ++i) {
+		a[i].rs = rs;
+		a[i].id = i;
+		pthread_create(&threads[i], NULL, &append_requests, &a[i]);
+	}
+	for (int i = 0; i < APPENDERS; ++i)
+		pthread_join(threads[i], NULL);
+	CuAssertIntEquals(tc, 0, result_stream_close(rs));
+
+	FILE *data = fopen(data_name, "r"), *sectors = fopen(sectors_name, "r");
+	char buf[SECTOR_SIZE], expect[SECTOR_SIZE];
+	int sector, n = 0, seen[APPENDERS] = { 0 };
+	while (fscanf(sectors, "%d", &sector) == 1) {
+		CuAssertIntEquals(tc, SECTOR_SIZE,
+				  (int)fread(buf, 1, SECTOR_SIZE, data));
+		memset(expect, 0, SECTOR_SIZE);
+		sprintf(expect, "%d", sector);
+		CuAssertIntEquals(tc, 0, memcmp(buf, expect, SECTOR_SIZE));
+		++seen[sector / 100000];
+		++n;
+	}
+	CuAssertIntEquals(tc, 0, (int)fread(buf, 1, 1, data));
+	for (int i = 0; i < APPENDERS; ++i)
+		CuAssertIntEquals(tc, REQUESTS / 4 * 10, seen[i]);
+	CuAssertIntEquals(tc, APPENDERS * REQUESTS / 4 * 10, n);
+	fclose(data);
+	fclose(sectors);
+	unlink(data_name);
+	unlink(sectors_name);
+}
+
+CuSuite* test_result_stream_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_result_stream_pairs);
+
+	return suite;
+}
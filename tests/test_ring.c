@@ -0,0 +1,283 @@
+#include "CuTest.h"
+#include <ring.h>
+
+#define TEST_THREADS 4
+#define TEST_REQUESTS 2000
+
+DEFINE_RING_TYPES(test_sem, int, int, 4);
+/* a slot count that does not divide 2^32, like the registrar's */
+DEFINE_RING_TYPES(test_sem10, int, int, 10);
+DEFINE_LOCKFREE_RING_TYPES(test_lf, int, int, 4);
+
+/* an odd-sized payload, which still has to get the cache-line layout */
+struct test_odd { char c[3]; };
+DEFINE_LOCKFREE_RING_TYPES(test_odd, struct test_odd, struct test_odd, 2);
+
+static void square_handler(union test_sem_sring_entry *entry, void *nil)
+{
+	entry->rsp = entry->req * entry->req;
+}
+
+static void lf_square_handler(union test_lf_sring_entry *entry, void *nil)
+{
+	entry->rsp = entry->req * entry->req;
+}
+
+static void *sem_server(void *ring)
+{
+	RB_SERVE(test_sem, (struct test_sem_sring *)ring, 0, &square_handler,
+		 NULL);
+	return NULL;
+}
+
+static void *lf_server(void *ring)
+{
+	RB_SERVE(test_lf, (struct test_lf_sring *)ring, 0, &lf_square_handler,
+		 NULL);
+	return NULL;
+}
+
+static void *sem_client(void *ring)
+{
+	long bad = 0;
+	for (int i = 0; i < TEST_REQUESTS; ++i) {
+		int rsp;
+		RB_MAKE_REQUEST(test_sem, (struct test_sem_sring *)ring, &i,
+				&rsp);
+		bad += rsp != i * i;
+	}
+	return (void *)bad;
+}
+
+static void *lf_client(void *ring)
+{
+	long bad = 0;
+	for (int i = 0; i < TEST_REQUESTS; ++i) {
+		int rsp;
+		RB_MAKE_REQUEST(test_lf, (struct test_lf_sring *)ring, &i,
+				&rsp);
+		bad += rsp != i * i;
+	}
+	return (void *)bad;
+}
+
+/* Runs TEST_THREADS clients against one server thread and checks every
+ * response matched its own request */
+static void run_ring(CuTest *tc, void *ring, void *(*server)(void *),
+		     void *(*client)(void *))
+{
+	pthread_t srv, cli[TEST_THREADS];
+	pthread_create(&srv, NULL, server, ring);
+	for (int i = 0; i < TEST_THREADS; ++i)
+		pthread_create(&cli[i], NULL, client, ring);
+	for (int i = 0; i < TEST_THREADS; ++i) {
+		void *bad;
+		pthread_join(cli[i], &bad);
+		CuAssertIntEquals(tc, 0, (int)(long)bad);
+	}
+	pthread_cancel(srv);
+	pthread_join(srv, NULL);
+}
+
+void test_sem_ring_round_trip(CuTest *tc)
+{
+	struct test_sem_sring ring;
+	RB_INIT(test_sem, &ring, 4);
+	run_ring(tc, &ring, &sem_server, &sem_client);
+}
+
+/* Server positions stay slot indexes, so a slot count that does not divide
+ * 2^32 never makes the server read a slot other than the client filled */
+void test_sem_ring_positions(CuTest *tc)
+{
+	struct test_sem10_sring ring;
+	RB_INIT(test_sem10, &ring, 10);
+	uint32_t pos = 0;
+	for (int i = 0; i < 25; ++i) {
+		CuAssertIntEquals(tc, i % 10, (int)pos);
+		pos = test_sem10_rb_next_pos(&ring, pos);
+	}
+}
+
+void test_lockfree_ring_init(CuTest *tc)
+{
+	struct test_lf_sring ring;
+	RB_INIT(test_lf, &ring, 4);
+	CuAssertIntEquals(tc, 0, ring.prod);
+	for (int i = 0; i < 4; ++i)
+		CuAssertIntEquals(tc, i, ring.ring[i].seq);
+}
+
+void test_lockfree_ring_round_trip(CuTest *tc)
+{
+	struct test_lf_sring ring;
+	RB_INIT(test_lf, &ring, 4);
+	run_ring(tc, &ring, &lf_server, &lf_client);
+	CuAssertIntEquals(tc, TEST_THREADS * TEST_REQUESTS, ring.prod);
+	CuAssertIntEquals(tc, TEST_THREADS * TEST_REQUESTS, ring.cons);
+}
+
+/* Fills the ring without a server thread, then answers the requests out of
+ * order and checks each ticket gets back its own response and tag */
+void test_lockfree_ring_split_submit(CuTest *tc)
+{
+	struct test_lf_sring ring;
+	RB_INIT(test_lf, &ring, 4);
+
+	uint32_t tickets[4];
+	for (int i = 0; i < 4; ++i) {
+		int req = i + 1;
+		CuAssertIntEquals(tc, 0, RB_TRY_SUBMIT(test_lf, &ring, &req,
+						       100 + i, &tickets[i]));
+	}
+	int req = 5;
+	uint32_t extra = 0;
+	CuAssertIntEquals(tc, -1, RB_TRY_SUBMIT(test_lf, &ring, &req, 0, &extra));
+
+	union test_lf_sring_entry *entries[4];
+	for (int i = 0; i < 4; ++i)
+		entries[i] = test_lf_rb_serve_wait(&ring, i);
+
+	int rsp;
+	uint64_t tag;
+	entries[2]->rsp = entries[2]->req * 10;
+	RB_COMPLETE(test_lf, &ring, 2);
+	CuAssertIntEquals(tc, 0, RB_POLL(test_lf, &ring, tickets[0], &rsp, &tag));
+	CuAssertIntEquals(tc, 2, RB_WAIT_ANY(test_lf, &ring, tickets, 4, &rsp,
+					     &tag));
+	CuAssertIntEquals(tc, 30, rsp);
+	CuAssertIntEquals(tc, 102, (int)tag);
+
+	/* the reaped slot is not the next one to be claimed, so still full */
+	CuAssertIntEquals(tc, -1, RB_TRY_SUBMIT(test_lf, &ring, &req, 0, &extra));
+
+	for (int i = 0; i < 4; ++i) {
+		if (i == 2)
+			continue;
+		entries[i]->rsp = entries[i]->req * 10;
+		RB_COMPLETE(test_lf, &ring, i);
+		RB_WAIT(test_lf, &ring, tickets[i], &rsp, &tag);
+		CuAssertIntEquals(tc, (i + 1) * 10, rsp);
+		CuAssertIntEquals(tc, 100 + i, (int)tag);
+	}
+	CuAssertIntEquals(tc, 0, RB_TRY_SUBMIT(test_lf, &ring, &req, 0, &extra));
+	CuAssertIntEquals(tc, 4, extra);
+}
+
+static void lf_poll_handler(union test_lf_sring_entry *entry, uint32_t pos,
+			    struct test_lf_sring *ring)
+{
+	entry->rsp = -entry->req;
+	RB_COMPLETE(test_lf, ring, pos);
+}
+
+/* A polling server takes exactly the requests published so far */
+void test_lockfree_ring_serve_poll(CuTest *tc)
+{
+	struct test_lf_sring ring;
+	RB_INIT(test_lf, &ring, 4);
+	uint32_t pos = 0, tickets[3];
+	int found = 0;
+	RB_SERVE_POLL(test_lf, &ring, pos, &lf_poll_handler, &ring, found);
+	CuAssertIntEquals(tc, 0, found);
+
+	for (int i = 0; i < 3; ++i)
+		tickets[i] = RB_SUBMIT(test_lf, &ring, &i, i);
+	RB_SERVE_POLL(test_lf, &ring, pos, &lf_poll_handler, &ring, found);
+	CuAssertIntEquals(tc, 3, found);
+	CuAssertIntEquals(tc, 3, pos);
+	for (int i = 0; i < 3; ++i) {
+		int rsp = 1;
+		CuAssertIntEquals(tc, 1, RB_POLL(test_lf, &ring, tickets[i],
+						 &rsp, NULL));
+		CuAssertIntEquals(tc, -i, rsp);
+	}
+}
+
+/* A batch of quiet submits and completions is signalled once each way */
+void test_lockfree_ring_batch_signal(CuTest *tc)
+{
+	struct test_lf_sring ring;
+	RB_INIT(test_lf, &ring, 4);
+	uint32_t tickets[3];
+	for (int i = 0; i < 3; ++i)
+		CuAssertIntEquals(tc, 0, RB_TRY_SUBMIT_QUIET(test_lf, &ring, &i,
+							     i, &tickets[i]));
+	CuAssertIntEquals(tc, 0, ring.submitted);
+	RB_SIGNAL_SUBMITS(test_lf, &ring);
+	CuAssertIntEquals(tc, 1, ring.submitted);
+
+	for (uint32_t pos = 0; pos < 3; ++pos) {
+		union test_lf_sring_entry *entry = test_lf_rb_serve_wait(&ring,
+									 pos);
+		entry->rsp = entry->req + 10;
+		RB_COMPLETE_QUIET(test_lf, &ring, pos);
+	}
+	CuAssertIntEquals(tc, 0, ring.completed);
+	RB_SIGNAL_COMPLETIONS(test_lf, &ring);
+	CuAssertIntEquals(tc, 1, ring.completed);
+	for (int i = 0; i < 3; ++i) {
+		int rsp = 0;
+		RB_WAIT(test_lf, &ring, tickets[i], &rsp, NULL);
+		CuAssertIntEquals(tc, i + 10, rsp);
+	}
+}
+
+void test_wait_policy_parse(CuTest *tc)
+{
+	struct rb_wait_policy pol = RB_WAIT_POLICY_DEFAULT;
+	CuAssertIntEquals(tc, 0, rb_wait_policy_parse("spin:50", &pol));
+	CuAssertIntEquals(tc, RB_POLICY_SPIN, pol.mode);
+	CuAssertIntEquals(tc, 50, pol.spin);
+	CuAssertIntEquals(tc, 0, rb_wait_policy_parse("adaptive", &pol));
+	CuAssertIntEquals(tc, RB_POLICY_ADAPTIVE, pol.mode);
+	CuAssertIntEquals(tc, -1, rb_wait_policy_parse("spin:", &pol));
+	CuAssertIntEquals(tc, -1, rb_wait_policy_parse("spinning", &pol));
+	CuAssertIntEquals(tc, -1, rb_wait_policy_parse("nap", &pol));
+}
+
+/* Every wait policy gets every response back, on both sides of the ring */
+void test_lockfree_ring_wait_policies(CuTest *tc)
+{
+	const char *names[] = { "block", "spin:10", "adaptive", "busy" };
+	for (int i = 0; i < 4; ++i) {
+		struct rb_wait_policy pol = RB_WAIT_POLICY_DEFAULT;
+		struct test_lf_sring ring;
+		RB_INIT(test_lf, &ring, 4);
+		rb_wait_policy_parse(names[i], &pol);
+		RB_SET_WAIT_POLICY(&ring, client, &pol);
+		RB_SET_WAIT_POLICY(&ring, server, &pol);
+		run_ring(tc, &ring, &lf_server, &lf_client);
+		CuAssertIntEquals(tc, TEST_THREADS * TEST_REQUESTS, ring.cons);
+	}
+}
+
+void test_lockfree_ring_layout(CuTest *tc)
+{
+	CuAssertIntEquals(tc, 0, offsetof(struct test_odd_sring, prod) %
+			  RB_CACHE_LINE);
+	CuAssertTrue(tc, offsetof(struct test_odd_sring, cons) -
+		     offsetof(struct test_odd_sring, prod) >= RB_CACHE_LINE);
+	CuAssertIntEquals(tc, RB_CACHE_LINE,
+			  offsetof(struct test_odd_sring_slot, entry));
+	CuAssertIntEquals(tc, 2 * RB_CACHE_LINE,
+			  sizeof(struct test_odd_sring_slot));
+}
+
+CuSuite* test_ring_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_sem_ring_round_trip);
+	SUITE_ADD_TEST(suite, test_sem_ring_positions);
+	SUITE_ADD_TEST(suite, test_lockfree_ring_init);
+	SUITE_ADD_TEST(suite, test_lockfree_ring_round_trip);
+	SUITE_ADD_TEST(suite, test_lockfree_ring_split_submit);
+	SUITE_ADD_TEST(suite, test_lockfree_ring_serve_poll);
+	SUITE_ADD_TEST(suite, test_lockfree_ring_batch_signal);
+	SUITE_ADD_TEST(suite, test_wait_policy_parse);
+	SUITE_ADD_TEST(suite, test_lockfree_ring_wait_policies);
+	SUITE_ADD_TEST(suite, test_lockfree_ring_layout);
+
+	return suite;
+}
@@ -0,0 +1,164 @@
+#include "CuTest.h"
+#include <sector_cache.c>
+
+/* A cache small enough to be a single shard, so eviction order is exact */
+#define SMALL_CACHE 4
+
+static void fill(char *buf, int sector)
+{
+	memset(buf, 0, SECTOR_SIZE);
+	sprintf(buf, "sector %d", sector);
+}
+
+static void insert(struct sector_cache *c, int sector)
+{
+	char buf[SECTOR_SIZE];
+	fill(buf, sector);
+	sector_cache_insert(c, sector, buf);
+}
+
+static bool lookup(struct sector_cache *c, int sector)
+{
+	char buf[SECTOR_SIZE];
+	return sector_cache_lookup(c, sector, buf);
+}
+
+void test_sector_cache_hit_returns_data(CuTest *tc)
+{
+	struct sector_cache *c = sector_cache_create(SMALL_CACHE * SECTOR_SIZE,
+						     CACHE_LRU);
+	char buf[SECTOR_SIZE], expect[SECTOR_SIZE];
+	CuAssertIntEquals(tc, False, sector_cache_lookup(c, 7, buf));
+	insert(c, 7);
+	CuAssertIntEquals(tc, True, sector_cache_lookup(c, 7, buf));
+	fill(expect, 7);
+	CuAssertIntEquals(tc, 0, memcmp(buf, expect, SECTOR_SIZE));
+
+	struct cache_stats st;
+	sector_cache_stats(c, &st);
+	CuAssertIntEquals(tc, 1, (int)st.hits);
+	CuAssertIntEquals(tc, 1, (int)st.misses);
+	CuAssertIntEquals(tc, 1, (int)st.insertions);
+	CuAssertIntEquals(tc, SMALL_CACHE, (int)st.capacity);
+	sector_cache_destroy(c);
+}
+
+void test_sector_cache_too_small(CuTest *tc)
+{
+	CuAssertPtrEquals(tc, NULL, sector_cache_create(SECTOR_SIZE - 1,
+							CACHE_LRU));
+}
+
+void test_sector_cache_lru_evicts_least_recent(CuTest *tc)
+{
+	struct sector_cache *c = sector_cache_create(SMALL_CACHE * SECTOR_SIZE,
+						     CACHE_LRU);
+	for (int i = 0; i < SMALL_CACHE; ++i)
+		insert(c, i);
+	lookup(c, 0);
+	insert(c, 100);		// evicts 1, the least recently used
+	CuAssertIntEquals(tc, True, lookup(c, 0));
+	CuAssertIntEquals(tc, False, lookup(c, 1));
+	CuAssertIntEquals(tc, True, lookup(c, 2));
+
+	struct cache_stats st;
+	sector_cache_stats(c, &st);
+	CuAssertIntEquals(tc, 1, (int)st.evictions);
+	sector_cache_destroy(c);
+}
+
+void test_sector_cache_clock_second_chance(CuTest *tc)
+{
+	struct sector_cache *c = sector_cache_create(SMALL_CACHE * SECTOR_SIZE,
+						     CACHE_CLOCK);
+	for (int i = 0; i < SMALL_CACHE; ++i)
+		insert(c, i);
+	lookup(c, 0);
+	lookup(c, 1);
+	insert(c, 100);		// 0 and 1 get a second chance, 2 goes
+	CuAssertIntEquals(tc, True, lookup(c, 0));
+	CuAssertIntEquals(tc, True, lookup(c, 1));
+	CuAssertIntEquals(tc, False, lookup(c, 2));
+	CuAssertIntEquals(tc, True, lookup(c, 100));
+	sector_cache_destroy(c);
+}
+
+/* A hot set that has been asked for twice survives a long one-off scan under
+ * 2Q, but not under LRU */
+void test_sector_cache_2q_scan_resistant(CuTest *tc)
+{
+	enum cache_policy policies[] = { CACHE_LRU, CACHE_2Q };
+	int survivors[2];
+	for (int p = 0; p < 2; ++p) {
+		struct sector_cache *c = sector_cache_create(
+			16 * SECTOR_SIZE, policies[p]);
+		/* first touch of the hot set, then push it out to A1out */
+		for (int i = 0; i < 8; ++i)
+			insert(c, i);
+		for (int i = 1000; i < 1016; ++i)
+			insert(c, i);
+		/* second touch: promoted to Am under 2Q */
+		for (int i = 0; i < 8; ++i)
+			if (!lookup(c, i))
+				insert(c, i);
+		for (int i = 2000; i < 2100; ++i)
+			insert(c, i);
+		survivors[p] = 0;
+		for (int i = 0; i < 8; ++i)
+			survivors[p] += lookup(c, i);
+		sector_cache_destroy(c);
+	}
+	CuAssertIntEquals(tc, 0, survivors[0]);
+	CuAssertIntEquals(tc, 8, survivors[1]);
+}
+
+/* An invalidated sector is gone, and its entry is taken before any other
+ * sector is evicted */
+void test_sector_cache_invalidate(CuTest *tc)
+{
+	enum cache_policy policies[] = { CACHE_CLOCK, CACHE_LRU, CACHE_2Q };
+	for (int p = 0; p < 3; ++p) {
+		struct sector_cache *c =
+			sector_cache_create(SMALL_CACHE * SECTOR_SIZE,
+					    policies[p]);
+		for (int i = 0; i < SMALL_CACHE; ++i)
+			insert(c, i);
+		sector_cache_invalidate(c, 2);
+		sector_cache_invalidate(c, 50);
+		CuAssertIntEquals(tc, False, lookup(c, 2));
+		insert(c, 100);
+		CuAssertIntEquals(tc, True, lookup(c, 100));
+		for (int i = 0; i < SMALL_CACHE; ++i)
+			CuAssertIntEquals(tc, i != 2, lookup(c, i));
+
+		struct cache_stats st;
+		sector_cache_stats(c, &st);
+		CuAssertIntEquals(tc, 0, (int)st.evictions);
+		sector_cache_destroy(c);
+	}
+}
+
+void test_sector_cache_policy_parse(CuTest *tc)
+{
+	enum cache_policy p;
+	CuAssertIntEquals(tc, 0, cache_policy_parse("2q", &p));
+	CuAssertIntEquals(tc, CACHE_2Q, p);
+	CuAssertIntEquals(tc, 0, cache_policy_parse("clock", &p));
+	CuAssertIntEquals(tc, CACHE_CLOCK, p);
+	CuAssertIntEquals(tc, -1, cache_policy_parse("arc", &p));
+}
+
+CuSuite* test_sector_cache_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_sector_cache_hit_returns_data);
+	SUITE_ADD_TEST(suite, test_sector_cache_too_small);
+	SUITE_ADD_TEST(suite, test_sector_cache_lru_evicts_least_recent);
+	SUITE_ADD_TEST(suite, test_sector_cache_clock_second_chance);
+	SUITE_ADD_TEST(suite, test_sector_cache_2q_scan_resistant);
+	SUITE_ADD_TEST(suite, test_sector_cache_invalidate);
+	SUITE_ADD_TEST(suite, test_sector_cache_policy_parse);
+
+	return suite;
+}
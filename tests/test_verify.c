@@ -0,0 +1,98 @@
+#include <unistd.h>
+
+#include "CuTest.h"
+#include <verify.c>
+
+/* Sector `sector` of a make_test_file.py image of `nsectors` sectors */
+static void make_pattern(char *buf, int sector, int nsectors)
+{
+	char head[64];
+	int digits = snprintf(head, sizeof(head), "%d", nsectors);
+	int n = snprintf(head, sizeof(head), "Sector %0*d%s", digits, sector,
+			 pattern_content);
+	memset(buf, '.', SECTOR_SIZE);
+	memcpy(buf, head, n);
+	memcpy(buf + SECTOR_SIZE - 4, "end.", 4);
+}
+
+/* CRC32C gives the standard check value, the same with or without SSE4.2 */
+void test_verify_crc32c(CuTest *tc)
+{
+	CuAssertTrue(tc, crc32c("123456789", 9) == 0xe3069283);
+	CuAssertTrue(tc, crc32c("", 0) == 0);
+	char buf[1000];
+	for (int i = 0; i < 1000; ++i)
+		buf[i] = i * 7 + 3;
+	for (int len = 0; len < 1000; len += 37)
+		CuAssertTrue(tc, crc32c(buf + 1, len) ==
+			     ~crc_update_table(~0U, (unsigned char *)buf + 1,
+					       len));
+}
+
+/* The pattern verifier knows each sector by its digits, and takes what
+ * clients write too */
+void test_verify_pattern(CuTest *tc)
+{
+	struct verifier *v = verifier_pattern(20480);
+	char buf[SECTOR_SIZE];
+	int sectors[] = { 0, 7, 1234, 20479 };
+	for (int i = 0; i < 4; ++i) {
+		make_pattern(buf, sectors[i], 20480);
+		CuAssertTrue(tc, verifier_check(v, sectors[i], buf));
+		CuAssertTrue(tc, !verifier_check(v, sectors[i] + 1, buf));
+	}
+	make_pattern(buf, 1234, 20480);
+	buf[300] = 'x';
+	CuAssertTrue(tc, !verifier_check(v, 1234, buf));
+	make_pattern(buf, 1234, 2048);
+	CuAssertTrue(tc, !verifier_check(v, 1234, buf));
+	verify_fill(buf, 99);
+	CuAssertTrue(tc, verifier_check(v, 99, buf));
+	CuAssertTrue(tc, !verifier_check(v, 98, buf));
+	CuAssertTrue(tc, !verifier_check(v, 20480, buf));
+	verifier_destroy(v);
+}
+
+/* The image verifier checks sectors against the image's, a partial last one
+ * as if padded with zeros */
+void test_verify_image(CuTest *tc)
+{
+	char name[] = "/tmp/test_verify.XXXXXX";
+	int fd = mkstemp(name);
+	char buf[SECTOR_SIZE];
+	for (int s = 0; s < 300; ++s) {
+		make_pattern(buf, s, 301);
+		CuAssertIntEquals(tc, SECTOR_SIZE, (int)write(fd, buf,
+							      SECTOR_SIZE));
+	}
+	CuAssertIntEquals(tc, 10, (int)write(fd, "last bits.", 10));
+	close(fd);
+	struct verifier *v = verifier_image(name, 301);
+	unlink(name);
+	CuAssertPtrNotNull(tc, v);
+
+	make_pattern(buf, 257, 301);
+	CuAssertTrue(tc, verifier_check(v, 257, buf));
+	CuAssertTrue(tc, !verifier_check(v, 256, buf));
+	memset(buf, 0, SECTOR_SIZE);
+	memcpy(buf, "last bits.", 10);
+	CuAssertTrue(tc, verifier_check(v, 300, buf));
+	buf[SECTOR_SIZE - 1] = '.';
+	CuAssertTrue(tc, !verifier_check(v, 300, buf));
+	verify_fill(buf, 300);
+	CuAssertTrue(tc, verifier_check(v, 300, buf));
+	verifier_destroy(v);
+
+	CuAssertPtrEquals(tc, NULL, verifier_image(name, 301));
+}
+
+CuSuite* test_verify_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_verify_crc32c);
+	SUITE_ADD_TEST(suite, test_verify_pattern);
+	SUITE_ADD_TEST(suite, test_verify_image);
+
+	return suite;
+}
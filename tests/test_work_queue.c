@@ -0,0 +1,220 @@
+#include <errno.h>
+
+#include "CuTest.h"
+#include <work_queue.c>
+
+#define WQ_THREADS 4
+#define WQ_ITEMS 20000
+
+void test_work_queue_fifo(CuTest *tc)
+{
+	struct work_queue q;
+	work_queue_init(&q, 4);
+	for (unsigned int i = 0; i < 4; ++i) {
+		struct work_item w = { NULL, NULL, i };
+		work_queue_push(&q, w);
+	}
+	struct work_item w;
+	for (unsigned int i = 0; i < 4; ++i) {
+		CuAssertIntEquals(tc, 0, work_queue_take(&q, &w));
+		CuAssertIntEquals(tc, i, w.pos);
+	}
+	CuAssertIntEquals(tc, -1, work_queue_take(&q, &w));
+	CuAssertIntEquals(tc, EAGAIN, errno);
+	work_queue_destroy(&q);
+}
+
+static struct work_source *add_source(struct work_queue_set *s, int home,
+				      int weight, uint64_t ops_per_sec,
+				      unsigned int size)
+{
+	struct work_qos qos = { weight, ops_per_sec, 0 };
+	struct work_source *src = work_source_create(&qos, size);
+	work_queue_set_add(s, home, src);
+	return src;
+}
+
+/* A thread takes its own home's requests first, and steals the others' once
+ * its own are gone */
+void test_work_queue_steal(CuTest *tc)
+{
+	struct work_queue_set s;
+	work_queue_set_init(&s, 3);
+	struct work_source *src0 = add_source(&s, 0, 1, 0, 4);
+	struct work_source *src1 = add_source(&s, 1, 1, 0, 4);
+	struct work_item w = { NULL, NULL, 0, 1 };
+	work_queue_set_push(&s, src0, w);
+	w.pos = 1;
+	work_queue_set_push(&s, src1, w);
+	CuAssertIntEquals(tc, 0, work_queue_set_take(&s, 1, &w, False));
+	CuAssertIntEquals(tc, 1, w.pos);
+	CuAssertIntEquals(tc, 0, work_queue_set_take(&s, 1, &w, False));
+	CuAssertIntEquals(tc, 0, w.pos);
+	CuAssertIntEquals(tc, -1, work_queue_set_take(&s, 2, &w, False));
+	CuAssertIntEquals(tc, EAGAIN, errno);
+	work_queue_set_destroy(&s);
+}
+
+/* Two busy clients on one home share it in proportion to their weights */
+void test_work_queue_weights(CuTest *tc)
+{
+	struct work_queue_set s;
+	work_queue_set_init(&s, 1);
+	struct work_source *light = add_source(&s, 0, 1, 0, 64);
+	struct work_source *heavy = add_source(&s, 0, 3, 0, 64);
+	for (unsigned int i = 0; i < 64; ++i) {
+		struct work_item w = { NULL, NULL, 0, 16 };
+		work_queue_set_push(&s, light, w);
+		w.pos = 1;
+		work_queue_set_push(&s, heavy, w);
+	}
+	int taken[2] = { 0, 0 };
+	for (int i = 0; i < 32; ++i) {
+		struct work_item w;
+		CuAssertIntEquals(tc, 0, work_queue_set_take(&s, 0, &w, False));
+		++taken[w.pos];
+	}
+	CuAssertIntEquals(tc, 8, taken[0]);
+	CuAssertIntEquals(tc, 24, taken[1]);
+	work_queue_set_destroy(&s);
+}
+
+/* A capped client waits for its tokens even when nobody else is busy */
+void test_work_queue_rate_cap(CuTest *tc)
+{
+	struct work_queue_set s;
+	work_queue_set_init(&s, 1);
+	struct work_source *src = add_source(&s, 0, 1, 10, 4);
+	struct work_item w = { NULL, NULL, 0, 1 };
+	work_queue_set_push(&s, src, w);
+	work_queue_set_push(&s, src, w);
+	CuAssertIntEquals(tc, 0, work_queue_set_take(&s, 0, &w, False));
+	CuAssertIntEquals(tc, -1, work_queue_set_take(&s, 0, &w, False));
+	CuAssertTrue(tc, src->throttled > 0);
+	struct timespec pause = { 0, 150000000 };
+	nanosleep(&pause, NULL);
+	CuAssertIntEquals(tc, 0, work_queue_set_take(&s, 0, &w, False));
+	work_queue_set_destroy(&s);
+}
+
+struct wq_arg {
+	struct work_queue_set *set;
+	struct work_source *src;
+	int index;
+};
+
+/* Only the sources with work queued are in the round robin: idle ones leave
+ * it when they run dry and come back when pushed to, and removed ones are
+ * gone */
+void test_work_queue_idle(CuTest *tc)
+{
+	struct work_queue_set s;
+	work_queue_set_init(&s, 1);
+	struct work_source *src[100];
+	for (int i = 0; i < 100; ++i)
+		src[i] = add_source(&s, 0, 1, 0, 4);
+	CuAssertIntEquals(tc, 100, s.homes[0].count);
+	CuAssertIntEquals(tc, 0, s.homes[0].nactive);
+	struct work_item w = { NULL, NULL, 7, 1 };
+	work_queue_set_push(&s, src[42], w);
+	work_queue_set_push(&s, src[42], w);
+	CuAssertIntEquals(tc, 1, s.homes[0].nactive);
+	CuAssertIntEquals(tc, 0, work_queue_set_take(&s, 0, &w, False));
+	CuAssertIntEquals(tc, 0, work_queue_set_take(&s, 0, &w, False));
+	CuAssertIntEquals(tc, 7, w.pos);
+	CuAssertIntEquals(tc, -1, work_queue_set_take(&s, 0, &w, False));
+	CuAssertIntEquals(tc, 0, s.homes[0].nactive);
+	CuAssertPtrEquals(tc, NULL, s.homes[0].cursor);
+
+	/* one that ran dry is back once pushed to again */
+	w.pos = 1;
+	work_queue_set_push(&s, src[1], w);
+	w.pos = 2;
+	work_queue_set_push(&s, src[2], w);
+	w.pos = 3;
+	work_queue_set_push(&s, src[3], w);
+	work_queue_set_remove(&s, src[2]);
+	CuAssertIntEquals(tc, 99, s.homes[0].count);
+	CuAssertIntEquals(tc, 2, s.homes[0].nactive);
+	CuAssertIntEquals(tc, 0, work_queue_set_take(&s, 0, &w, False));
+	CuAssertIntEquals(tc, 1, w.pos);
+	CuAssertIntEquals(tc, 0, work_queue_set_take(&s, 0, &w, False));
+	CuAssertIntEquals(tc, 3, w.pos);
+	CuAssertIntEquals(tc, 1, s.homes[0].nactive);
+	w.pos = 1;
+	work_queue_set_push(&s, src[1], w);
+	CuAssertIntEquals(tc, 2, s.homes[0].nactive);
+	CuAssertIntEquals(tc, 0, work_queue_set_take(&s, 0, &w, False));
+	CuAssertIntEquals(tc, 1, w.pos);
+	CuAssertIntEquals(tc, -1, work_queue_set_take(&s, 0, &w, False));
+	for (int i = 0; i < 100; ++i)
+		if (i != 2)
+			work_queue_set_remove(&s, src[i]);
+	CuAssertIntEquals(tc, 0, s.homes[0].count);
+	CuAssertPtrEquals(tc, NULL, s.homes[0].first);
+	work_queue_set_destroy(&s);
+}
+
+static void *wq_producer(void *arg)
+{
+	struct wq_arg *a = arg;
+	for (unsigned int i = 1; i <= WQ_ITEMS; ++i) {
+		struct work_item w = { NULL, NULL, i, 1 };
+		work_queue_set_push(a->set, a->src, w);
+	}
+	return NULL;
+}
+
+static void *wq_consumer(void *arg)
+{
+	struct wq_arg *a = arg;
+	long sum = 0;
+	struct work_item w;
+	for (int i = 0; i < WQ_ITEMS; ++i) {
+		work_queue_set_take(a->set, a->index, &w, True);
+		sum += w.pos;
+	}
+	return (void *)sum;
+}
+
+/* Every item pushed by several producers through small queues comes out
+ * exactly once, however the takers steal */
+void test_work_queue_mpmc(CuTest *tc)
+{
+	struct work_queue_set s;
+	work_queue_set_init(&s, WQ_THREADS);
+	pthread_t prod[WQ_THREADS], cons[WQ_THREADS];
+	struct wq_arg args[WQ_THREADS];
+	for (int i = 0; i < WQ_THREADS; ++i) {
+		args[i].set = &s;
+		args[i].src = add_source(&s, i, 1, 0, 16);
+		args[i].index = i;
+	}
+	for (int i = 0; i < WQ_THREADS; ++i) {
+		pthread_create(&prod[i], NULL, &wq_producer, &args[i]);
+		pthread_create(&cons[i], NULL, &wq_consumer, &args[i]);
+	}
+	long sum = 0;
+	for (int i = 0; i < WQ_THREADS; ++i) {
+		void *part;
+		pthread_join(prod[i], NULL);
+		pthread_join(cons[i], &part);
+		sum += (long)part;
+	}
+	CuAssertTrue(tc, sum == (long)WQ_THREADS * WQ_ITEMS * (WQ_ITEMS + 1) / 2);
+	work_queue_set_destroy(&s);
+}
+
+CuSuite* test_work_queue_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_work_queue_fifo);
+	SUITE_ADD_TEST(suite, test_work_queue_steal);
+	SUITE_ADD_TEST(suite, test_work_queue_weights);
+	SUITE_ADD_TEST(suite, test_work_queue_rate_cap);
+	SUITE_ADD_TEST(suite, test_work_queue_idle);
+	SUITE_ADD_TEST(suite, test_work_queue_mpmc);
+
+	return suite;
+}
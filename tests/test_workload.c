@@ -0,0 +1,157 @@
+#include <unistd.h>
+
+#include "CuTest.h"
+#include <workload.c>
+
+/* Numbers drawn below a bound stay below it, and the same seed draws the same
+ * numbers */
+void test_workload_rng(CuTest *tc)
+{
+	struct wl_rng a, b;
+	wl_rng_seed(&a, 42);
+	wl_rng_seed(&b, 42);
+	for (int i = 0; i < 1000; ++i)
+		CuAssertTrue(tc, wl_rng_next(&a) == wl_rng_next(&b));
+	int seen[7] = { 0 };
+	for (int i = 0; i < 7000; ++i) {
+		uint32_t x = wl_rng_below(&a, 7);
+		CuAssertTrue(tc, x < 7);
+		++seen[x];
+		double d = wl_rng_double(&a);
+		CuAssertTrue(tc, d >= 0 && d < 1);
+	}
+	for (int i = 0; i < 7; ++i)
+		CuAssertTrue(tc, seen[i] > 800 && seen[i] < 1200);
+}
+
+/* A Zipfian workload sends most requests to a few sectors, more so the higher
+ * its skew, and keeps a request's sectors on the volume */
+void test_workload_zipf(CuTest *tc)
+{
+	enum { SPAN = 10000, DRAWS = 100000 };
+	static int hits[SPAN];
+	const char *specs[] = { "zipf:0.5", "zipf" };
+	int top[2];
+	struct wl_rng rng;
+	wl_rng_seed(&rng, 1);
+	for (int s = 0; s < 2; ++s) {
+		struct workload *w = workload_create(specs[s], SPAN);
+		struct wl_cursor c;
+		CuAssertPtrNotNull(tc, w);
+		workload_cursor_init(w, &c, 0, 1);
+		memset(hits, 0, sizeof(hits));
+		for (int i = 0; i < DRAWS; ++i) {
+			int sector = workload_next(w, &c, &rng, 4);
+			CuAssertTrue(tc, sector >= 0 && sector <= SPAN - 4);
+			++hits[sector];
+		}
+		/* requests to the 100 hottest sectors */
+		top[s] = 0;
+		for (int k = 0; k < 100; ++k) {
+			int hottest = 0;
+			for (int i = 1; i < SPAN; ++i)
+				if (hits[i] > hits[hottest])
+					hottest = i;
+			top[s] += hits[hottest];
+			hits[hottest] = 0;
+		}
+		workload_destroy(w);
+	}
+	CuAssertTrue(tc, top[0] > DRAWS / 20);
+	CuAssertTrue(tc, top[1] > DRAWS / 3);
+	CuAssertTrue(tc, top[1] > 2 * top[0]);
+}
+
+/* Sequential scans start at each thread's own point and wrap at the end */
+void test_workload_seq(CuTest *tc)
+{
+	struct workload *w = workload_create("seq", 100);
+	struct wl_cursor c[4];
+	struct wl_rng rng;
+	wl_rng_seed(&rng, 1);
+	for (int t = 0; t < 4; ++t)
+		workload_cursor_init(w, &c[t], t, 4);
+	CuAssertIntEquals(tc, 0, workload_next(w, &c[0], &rng, 10));
+	CuAssertIntEquals(tc, 10, workload_next(w, &c[0], &rng, 10));
+	CuAssertIntEquals(tc, 75, workload_next(w, &c[3], &rng, 10));
+	CuAssertIntEquals(tc, 85, workload_next(w, &c[3], &rng, 10));
+	CuAssertIntEquals(tc, 0, workload_next(w, &c[3], &rng, 10));
+	workload_destroy(w);
+}
+
+/* A hot set gets its share of the requests, and a mix its parts' */
+void test_workload_hotspot_mix(CuTest *tc)
+{
+	struct workload *w = workload_create("hotspot:0.1:0.9", 1000);
+	struct wl_cursor c;
+	struct wl_rng rng;
+	int hot = 0;
+	wl_rng_seed(&rng, 1);
+	workload_cursor_init(w, &c, 0, 1);
+	for (int i = 0; i < 10000; ++i)
+		hot += workload_next(w, &c, &rng, 1) < 100;
+	CuAssertTrue(tc, hot > 8800 && hot < 9200);
+	workload_destroy(w);
+
+	/* seq@3 makes 0, 1, 2, ...; uniform@1 mostly makes the others */
+	w = workload_create("seq@3+uniform", 1000000);
+	workload_cursor_init(w, &c, 0, 1);
+	int seq = 0;
+	for (int i = 0; i < 10000; ++i)
+		seq += workload_next(w, &c, &rng, 1) == seq;
+	CuAssertTrue(tc, seq > 7200 && seq < 7800);
+	workload_destroy(w);
+
+	CuAssertPtrEquals(tc, NULL, workload_create("zipf:1.5", 100));
+	CuAssertPtrEquals(tc, NULL, workload_create("seq:2", 100));
+	CuAssertPtrEquals(tc, NULL, workload_create("uniform@0", 100));
+	CuAssertPtrEquals(tc, NULL, workload_create("gauss", 100));
+	CuAssertPtrEquals(tc, NULL, workload_create("seq+seq+seq+seq+seq",
+						    100));
+	CuAssertPtrEquals(tc, NULL, workload_create("", 100));
+}
+
+/* A trace is replayed in order, each thread from its own point, skipping
+ * comments, and keeping requests on the volume */
+void test_workload_trace(CuTest *tc)
+{
+	char name[] = "/tmp/test_workload.XXXXXX";
+	int fd = mkstemp(name);
+	const char *trace = "# a trace\n5\n\n  17\n120\n3\n";
+	CuAssertTrue(tc, write(fd, trace, strlen(trace)) ==
+		     (ssize_t)strlen(trace));
+	close(fd);
+	char spec[64];
+	snprintf(spec, sizeof(spec), "trace:%s", name);
+	struct workload *w = workload_create(spec, 100);
+	unlink(name);
+	CuAssertPtrNotNull(tc, w);
+
+	struct wl_cursor c[2];
+	struct wl_rng rng;
+	wl_rng_seed(&rng, 1);
+	workload_cursor_init(w, &c[0], 0, 2);
+	workload_cursor_init(w, &c[1], 1, 2);
+	int expect[] = { 5, 17, 20, 3, 5 };
+	for (int i = 0; i < 5; ++i)
+		CuAssertIntEquals(tc, expect[i], workload_next(w, &c[0], &rng,
+							       1));
+	CuAssertIntEquals(tc, 10, workload_next(w, &c[1], &rng, 90));
+	CuAssertIntEquals(tc, 3, workload_next(w, &c[1], &rng, 1));
+	workload_destroy(w);
+
+	CuAssertPtrEquals(tc, NULL, workload_create(spec, 100));
+}
+
+CuSuite* test_workload_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_workload_rng);
+	SUITE_ADD_TEST(suite, test_workload_zipf);
+	SUITE_ADD_TEST(suite, test_workload_seq);
+	SUITE_ADD_TEST(suite, test_workload_hotspot_mix);
+	SUITE_ADD_TEST(suite, test_workload_trace);
+
+	return suite;
+}
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <fcntl.h>
+
+#include "CuTest.h"
+#include <write_cache.c>
+
+/* sectors in the file the tests write to */
+#define FILE_SECTORS 256
+
+static void fill(char *buf, int sector, int version)
+{
+	memset(buf, 0, SECTOR_SIZE);
+	sprintf(buf, "sector %d, version %d", sector, version);
+}
+
+/* A file of FILE_SECTORS zeroed sectors, already unlinked */
+static int temp_file(void)
+{
+	char name[] = "/tmp/test_write_cache.XXXXXX";
+	int fd = mkstemp(name);
+	unlink(name);
+	if (ftruncate(fd, FILE_SECTORS * SECTOR_SIZE))
+		return -1;
+	return fd;
+}
+
+static bool on_file(int fd, int sector, int version)
+{
+	char buf[SECTOR_SIZE], expect[SECTOR_SIZE];
+	fill(expect, sector, version);
+	return pread(fd, buf, SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) ==
+	       SECTOR_SIZE && !memcmp(buf, expect, SECTOR_SIZE);
+}
+
+struct barrier_done {
+	int calls;
+	int error;
+};
+
+static void barrier_done(void *arg, int error)
+{
+	struct barrier_done *d = arg;
+	d->error = error;
+	__atomic_add_fetch(&d->calls, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Written sectors are read back from the cache before they are written back,
+ * and only the cached ones are reported */
+void test_write_cache_snapshot(CuTest *tc)
+{
+	int fd = temp_file();
+	struct write_cache *wc = write_cache_create(fd, FILE_SECTORS *
+						    SECTOR_SIZE, 64 *
+						    SECTOR_SIZE, 90, 100, NULL);
+	char buf[SECTOR_SIZE], got[4 * SECTOR_SIZE], expect[SECTOR_SIZE];
+	CuAssertTrue(tc, write_cache_seq(wc) == 0);
+	CuAssertTrue(tc, write_cache_snapshot(wc, 10, 4, got) == 0);
+	fill(buf, 11, 1);
+	write_cache_write(wc, 11, buf);
+	fill(buf, 13, 1);
+	write_cache_write(wc, 13, buf);
+	CuAssertTrue(tc, write_cache_seq(wc) == 2);
+
+	CuAssertTrue(tc, write_cache_snapshot(wc, 10, 4, got) == 0xa);
+	fill(expect, 13, 1);
+	CuAssertIntEquals(tc, 0, memcmp(got + 3 * SECTOR_SIZE, expect,
+				       SECTOR_SIZE));
+
+	write_cache_destroy(wc);
+	CuAssertTrue(tc, on_file(fd, 11, 1));
+	CuAssertTrue(tc, on_file(fd, 13, 1));
+	close(fd);
+}
+
+/* A barrier is answered once what was written before it is on the file */
+void test_write_cache_barrier(CuTest *tc)
+{
+	int fd = temp_file();
+	struct write_cache *wc = write_cache_create(fd, FILE_SECTORS *
+						    SECTOR_SIZE, 64 *
+						    SECTOR_SIZE, 90, 100, NULL);
+	char buf[SECTOR_SIZE];
+	for (int i = 0; i < 8; ++i) {
+		fill(buf, 100 + i, 1);
+		write_cache_write(wc, 100 + i, buf);
+	}
+	struct barrier_done d = { 0, -1 };
+	write_cache_barrier(wc, &barrier_done, &d);
+	while (!__atomic_load_n(&d.calls, __ATOMIC_SEQ_CST))
+		usleep(1000);
+	CuAssertIntEquals(tc, 0, d.error);
+	for (int i = 0; i < 8; ++i)
+		CuAssertTrue(tc, on_file(fd, 100 + i, 1));
+
+	struct write_cache_stats st;
+	write_cache_stats(wc, &st);
+	CuAssertIntEquals(tc, 8, (int)st.writes);
+	CuAssertIntEquals(tc, 8, (int)st.writebacks);
+	CuAssertIntEquals(tc, 1, (int)st.write_calls);
+	CuAssertIntEquals(tc, 0, (int)st.dirty);
+	write_cache_destroy(wc);
+	CuAssertIntEquals(tc, 1, d.calls);
+	close(fd);
+}
+
+/* Rewriting a sector keeps one entry with the newest data, and writers wait
+ * for the flusher rather than overrun a full cache */
+void test_write_cache_overwrite(CuTest *tc)
+{
+	int fd = temp_file();
+	struct write_cache *wc = write_cache_create(fd, FILE_SECTORS *
+						    SECTOR_SIZE, 4 *
+						    SECTOR_SIZE, 50, 100, NULL);
+	char buf[SECTOR_SIZE], got[SECTOR_SIZE];
+	for (int v = 1; v <= 3; ++v) {
+		fill(buf, 5, v);
+		write_cache_write(wc, 5, buf);
+	}
+	if (write_cache_snapshot(wc, 5, 1, got)) {
+		CuAssertIntEquals(tc, 0, memcmp(got, buf, SECTOR_SIZE));
+	}
+	for (int i = 0; i < FILE_SECTORS; ++i) {
+		fill(buf, i, 4);
+		write_cache_write(wc, i, buf);
+	}
+	struct write_cache_stats st;
+	write_cache_stats(wc, &st);
+	CuAssertTrue(tc, st.dirty <= 4);
+	write_cache_destroy(wc);
+	for (int i = 0; i < FILE_SECTORS; ++i)
+		CuAssertTrue(tc, on_file(fd, i, 4));
+	close(fd);
+}
+
+static void wait_barrier(struct write_cache *wc, struct barrier_done *d)
+{
+	d->calls = 0;
+	d->error = -1;
+	write_cache_barrier(wc, &barrier_done, d);
+	while (!__atomic_load_n(&d->calls, __ATOMIC_SEQ_CST))
+		usleep(1000);
+}
+
+/* A sector that cannot be written back stays dirty and readable, is dropped
+ * from the sector cache, has its error go to the barrier, and is written once
+ * the file takes it */
+void test_write_cache_error(CuTest *tc)
+{
+	int fd = temp_file();
+	char path[64];
+	sprintf(path, "/proc/self/fd/%d", fd);
+	int ro = open(path, O_RDONLY);
+	struct sector_cache *cache = sector_cache_create(16 * SECTOR_SIZE,
+							 CACHE_LRU);
+	struct write_cache *wc = write_cache_create(ro, FILE_SECTORS *
+						    SECTOR_SIZE, 64 *
+						    SECTOR_SIZE, 90, 100,
+						    cache);
+	char buf[SECTOR_SIZE], got[SECTOR_SIZE];
+	fill(buf, 20, 0);
+	sector_cache_insert(cache, 20, buf);
+	fill(buf, 20, 1);
+	write_cache_write(wc, 20, buf);
+	struct barrier_done d;
+	wait_barrier(wc, &d);
+	CuAssertTrue(tc, d.error != 0);
+	CuAssertTrue(tc, write_cache_snapshot(wc, 20, 1, got) == 1);
+	CuAssertIntEquals(tc, 0, memcmp(got, buf, SECTOR_SIZE));
+	CuAssertIntEquals(tc, False, sector_cache_lookup(cache, 20, got));
+	struct write_cache_stats st;
+	write_cache_stats(wc, &st);
+	CuAssertIntEquals(tc, 1, (int)st.dirty);
+	CuAssertIntEquals(tc, 0, (int)st.writebacks);
+
+	__atomic_store_n(&wc->fd, fd, __ATOMIC_SEQ_CST);
+	wait_barrier(wc, &d);
+	CuAssertIntEquals(tc, 0, d.error);
+	CuAssertTrue(tc, on_file(fd, 20, 1));
+	write_cache_stats(wc, &st);
+	CuAssertIntEquals(tc, 0, (int)st.dirty);
+	write_cache_destroy(wc);
+	sector_cache_destroy(cache);
+	close(ro);
+	close(fd);
+}
+
+CuSuite* test_write_cache_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_write_cache_snapshot);
+	SUITE_ADD_TEST(suite, test_write_cache_barrier);
+	SUITE_ADD_TEST(suite, test_write_cache_overwrite);
+	SUITE_ADD_TEST(suite, test_write_cache_error);
+
+	return suite;
+}
@@ -3,6 +3,19 @@
 #include "CuTest.h"
 
 CuSuite* test_linked_list_get_suite();
+CuSuite* test_ring_get_suite();
+CuSuite* test_sector_cache_get_suite();
+CuSuite* test_data_pool_get_suite();
+CuSuite* test_work_queue_get_suite();
+CuSuite* test_io_sched_get_suite();
+CuSuite* test_coalesce_get_suite();
+CuSuite* test_readahead_get_suite();
+CuSuite* test_write_cache_get_suite();
+CuSuite* test_request_get_suite();
+CuSuite* test_workload_get_suite();
+CuSuite* test_histogram_get_suite();
+CuSuite* test_result_stream_get_suite();
+CuSuite* test_verify_get_suite();
 
 void RunAllTests(void)
 {
@@ -10,6 +23,19 @@ void RunAllTests(void)
 	CuSuite* suite = CuSuiteNew();
 
 	CuSuiteAddSuite(suite, test_linked_list_get_suite());
+	CuSuiteAddSuite(suite, test_ring_get_suite());
+	CuSuiteAddSuite(suite, test_sector_cache_get_suite());
+	CuSuiteAddSuite(suite, test_data_pool_get_suite());
+	CuSuiteAddSuite(suite, test_work_queue_get_suite());
+	CuSuiteAddSuite(suite, test_io_sched_get_suite());
+	CuSuiteAddSuite(suite, test_coalesce_get_suite());
+	CuSuiteAddSuite(suite, test_readahead_get_suite());
+	CuSuiteAddSuite(suite, test_write_cache_get_suite());
+	CuSuiteAddSuite(suite, test_request_get_suite());
+	CuSuiteAddSuite(suite, test_workload_get_suite());
+	CuSuiteAddSuite(suite, test_histogram_get_suite());
+	CuSuiteAddSuite(suite, test_result_stream_get_suite());
+	CuSuiteAddSuite(suite, test_verify_get_suite());
 
 	CuSuiteRun(suite);
 	CuSuiteSummary(suite, output);
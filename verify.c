@@ -0,0 +1,222 @@
+/*
+ * Inline data verification. The make_test_file.py pattern of a sector is
+ * "Sector <number>: ...end.", with the number zero-padded to as many digits
+ * as the sector count has; only the digits differ from sector to sector, so
+ * a sector is compared with one template and its own digits. Sectors checked
+ * against a manifest are checksummed with CRC32C, which SSE4.2 does at about
+ * 8 bytes a cycle.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "verify.h"
+#include "file_service.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+/* sectors of the image read at a time while making a manifest */
+#define MANIFEST_CHUNK 256
+
+static const char pattern_header[] = "Sector ";
+static const char pattern_content[] =
+	": The quick brown fox jumped over the lazy dog.";
+static const char pattern_end[] = "end.";
+
+struct verifier {
+	int nsectors;
+	/* pattern */
+	int digits;
+	char template[SECTOR_SIZE];
+	/* manifest */
+	uint32_t *crcs;
+};
+
+static uint32_t crc_table[8][256];
+static uint32_t (*crc_update)(uint32_t crc, const unsigned char *p,
+			      size_t len);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* Slicing-by-8: eight table lookups per 8 bytes */
+static uint32_t crc_update_table(uint32_t crc, const unsigned char *p,
+				 size_t len)
+{
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = crc_table[7][w & 0xff] ^
+		      crc_table[6][(w >> 8) & 0xff] ^
+		      crc_table[5][(w >> 16) & 0xff] ^
+		      crc_table[4][(w >> 24) & 0xff] ^
+		      crc_table[3][(w >> 32) & 0xff] ^
+		      crc_table[2][(w >> 40) & 0xff] ^
+		      crc_table[1][(w >> 48) & 0xff] ^
+		      crc_table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc_update_sse42(uint32_t crc, const unsigned char *p,
+				 size_t len)
+{
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		crc64 = _mm_crc32_u64(crc64, w);
+		p += 8;
+		len -= 8;
+	}
+	crc = crc64;
+#endif
+	while (len >= 4) {
+		uint32_t w;
+		memcpy(&w, p, 4);
+		crc = _mm_crc32_u32(crc, w);
+		p += 4;
+		len -= 4;
+	}
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+static void crc_init(void)
+{
+	for (int i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; ++j)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc_table[0][i] = crc;
+	}
+	for (int i = 0; i < 256; ++i) {
+		for (int t = 1; t < 8; ++t) {
+			uint32_t prev = crc_table[t - 1][i];
+			crc_table[t][i] = crc_table[0][prev & 0xff] ^ (prev >> 8);
+		}
+	}
+	crc_update = &crc_update_table;
+#ifdef HAVE_SSE42_CRC
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc_update = &crc_update_sse42;
+#endif
+}
+
+uint32_t crc32c(const void *buf, size_t len)
+{
+	pthread_once(&crc_once, &crc_init);
+	return ~crc_update(~0U, buf, len);
+}
+
+void verify_fill(char *buf, int sector)
+{
+	for (int i = 0; i < SECTOR_SIZE; ++i)
+		buf[i] = (sector * 31 + i) & 0xff;
+}
+
+/* Whether `data` is what clients write to `sector` */
+static bool is_fill(int sector, const char *data)
+{
+	char fill[SECTOR_SIZE];
+	verify_fill(fill, sector);
+	return !memcmp(data, fill, SECTOR_SIZE);
+}
+
+struct verifier *verifier_pattern(int nsectors)
+{
+	struct verifier *v = ecalloc(sizeof(*v));
+	v->nsectors = nsectors;
+	for (int n = nsectors; n; n /= 10)
+		++v->digits;
+	if (!v->digits)
+		v->digits = 1;
+
+	/* the sector's digits are left as zeros; they are checked apart */
+	int head = strlen(pattern_header), content = strlen(pattern_content);
+	int end = strlen(pattern_end);
+	memset(v->template, '.', SECTOR_SIZE);
+	memcpy(v->template, pattern_header, head);
+	memset(v->template + head, '0', v->digits);
+	memcpy(v->template + head + v->digits, pattern_content, content);
+	memcpy(v->template + SECTOR_SIZE - end, pattern_end, end);
+	return v;
+}
+
+struct verifier *verifier_image(const char *path, int nsectors)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct verifier *v = ecalloc(sizeof(*v));
+	v->nsectors = nsectors;
+	v->crcs = emalloc(nsectors * sizeof(*v->crcs));
+	char *buf = emalloc(MANIFEST_CHUNK * SECTOR_SIZE);
+	for (int s = 0; s < nsectors; s += MANIFEST_CHUNK) {
+		size_t len = (size_t)(nsectors - s < MANIFEST_CHUNK ?
+				      nsectors - s : MANIFEST_CHUNK) *
+			     SECTOR_SIZE;
+		/* past the end of the file (a partial last sector) reads as
+		 * zeros, as the server returns it */
+		memset(buf, 0, len);
+		ssize_t n = pread(fd, buf, len, (off_t)s * SECTOR_SIZE);
+		if (n < 0) {
+			int error = errno;
+			free(buf);
+			close(fd);
+			verifier_destroy(v);
+			errno = error;
+			return NULL;
+		}
+		for (size_t i = 0; i * SECTOR_SIZE < len; ++i)
+			v->crcs[s + i] = crc32c(buf + i * SECTOR_SIZE,
+						SECTOR_SIZE);
+	}
+	free(buf);
+	close(fd);
+	return v;
+}
+
+void verifier_destroy(struct verifier *v)
+{
+	free(v->crcs);
+	free(v);
+}
+
+/* Whether `data` holds the pattern of `sector` */
+static bool is_pattern(const struct verifier *v, int sector, const char *data)
+{
+	int head = sizeof(pattern_header) - 1, tail = head + v->digits;
+	if (memcmp(data, v->template, head) ||
+	    memcmp(data + tail, v->template + tail, SECTOR_SIZE - tail))
+		return False;
+	for (int i = tail - 1; i >= head; --i, sector /= 10)
+		if (data[i] != '0' + sector % 10)
+			return False;
+	return !sector;
+}
+
+bool verifier_check(const struct verifier *v, int sector, const char *data)
+{
+	if (sector < 0 || sector >= v->nsectors)
+		return False;
+	bool ok = v->crcs ? crc32c(data, SECTOR_SIZE) == v->crcs[sector] :
+			    is_pattern(v, sector, data);
+	return ok || is_fill(sector, data);
+}
@@ -0,0 +1,41 @@
+/*
+ * Checking the data the server returns, as it comes in. A verifier knows what
+ * each sector of a volume should hold, either because the image was made by
+ * make_test_file.py, whose pattern it rebuilds, or from a manifest of the
+ * CRC32C of each sector, which it makes by reading the image once. A sector
+ * that holds what clients write to it (see verify_fill()) is always right.
+ *
+ * A verifier is read-only once made, so threads check with it without locks
+ * and keep their own counts.
+ */
+
+#ifndef VERIFY_H_
+#define VERIFY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* The CRC32C (Castagnoli) of `len` bytes, with the SSE4.2 instruction where
+ * the CPU has it */
+uint32_t crc32c(const void *buf, size_t len);
+
+/* The data every client writes to a sector (SECTOR_SIZE bytes) */
+void verify_fill(char *buf, int sector);
+
+struct verifier;
+
+/* A verifier for a volume of `nsectors` sectors made by make_test_file.py */
+struct verifier *verifier_pattern(int nsectors);
+
+/* A verifier for the `nsectors` sectors of the image at `path`, checked by
+ * their CRC32Cs. Returns NULL, with errno set, if it cannot be read. */
+struct verifier *verifier_image(const char *path, int nsectors);
+
+void verifier_destroy(struct verifier *v);
+
+/* Whether `data` is right for `sector` */
+bool verifier_check(const struct verifier *v, int sector, const char *data);
+
+#endif /* end of include guard: VERIFY_H_ */
@@ -0,0 +1,357 @@
+/*
+ * Functions supporting the MPMC work queues, and the fair sharing of the I/O
+ * threads between the clients' queues.
+ */
+
+#include <errno.h>
+#include <sched.h>
+
+#include "work_queue.h"
+#include "ring.h"
+
+void work_queue_init(struct work_queue *q, unsigned int size)
+{
+	if (!size || (size & (size - 1)))
+		fail("work queue size is not a power of two");
+	q->cells = emalloc(size * sizeof(*q->cells));
+	for (unsigned int i = 0; i < size; ++i)
+		q->cells[i].seq = i;
+	q->mask = size - 1;
+	q->head = 0;
+	q->tail = 0;
+}
+
+void work_queue_destroy(struct work_queue *q)
+{
+	free(q->cells);
+}
+
+/* The cell at `pos` is free for the producer of `pos` when its seq is `pos`,
+ * and holds that producer's item once its seq is `pos + 1`. The consumer frees
+ * it for the next lap by setting seq to `pos + size`. */
+
+void work_queue_push(struct work_queue *q, struct work_item item)
+{
+	uint32_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	struct work_cell *c;
+	for (;;) {
+		c = &q->cells[pos & q->mask];
+		uint32_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		int32_t diff = (int32_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* full: wait for the I/O threads to catch up. They
+			 * may have been cancelled, so we can be too. */
+			pthread_testcancel();
+			sched_yield();
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+	c->item = item;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+int work_queue_take(struct work_queue *q, struct work_item *item)
+{
+	uint32_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	struct work_cell *c;
+	for (;;) {
+		c = &q->cells[pos & q->mask];
+		uint32_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		int32_t diff = (int32_t)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* empty, or its producer has not finished the cell */
+			errno = EAGAIN;
+			return -1;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+	*item = c->item;
+	__atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Whether a request has been pushed that has not been taken yet */
+static bool work_queue_ready(struct work_queue *q)
+{
+	uint32_t pos = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+	struct work_cell *c = &q->cells[pos & q->mask];
+	return __atomic_load_n(&c->seq, __ATOMIC_SEQ_CST) == pos + 1;
+}
+
+void work_queue_set_init(struct work_queue_set *s, int count)
+{
+	if (posix_memalign((void **)&s->homes, 64, count * sizeof(*s->homes)))
+		fail("posix_memalign");
+	for (int i = 0; i < count; ++i) {
+		pthread_mutex_init(&s->homes[i].mtx, NULL);
+		s->homes[i].first = NULL;
+		s->homes[i].count = 0;
+		s->homes[i].cursor = NULL;
+		s->homes[i].nactive = 0;
+	}
+	s->count = count;
+	s->wakeups = 0;
+	s->sleepers = 0;
+}
+
+void work_queue_set_destroy(struct work_queue_set *s)
+{
+	for (int i = 0; i < s->count; ++i) {
+		struct work_source *src = s->homes[i].first;
+		while (src) {
+			struct work_source *next = src->next;
+			work_queue_destroy(&src->q);
+			free(src);
+			src = next;
+		}
+		pthread_mutex_destroy(&s->homes[i].mtx);
+	}
+	free(s->homes);
+}
+
+static void bucket_init(struct work_bucket *b, uint64_t rate)
+{
+	b->rate = rate;
+	b->tokens = 0;
+	b->last = rb_now_ns();
+}
+
+struct work_source *work_source_create(const struct work_qos *qos,
+				       unsigned int size)
+{
+	struct work_source *src;
+	if (posix_memalign((void **)&src, 64, sizeof(*src)))
+		fail("posix_memalign");
+	memset(src, 0, sizeof(*src));
+	work_queue_init(&src->q, size);
+	src->qos = *qos;
+	if (src->qos.weight < 1)
+		src->qos.weight = 1;
+	bucket_init(&src->ops, qos->ops_per_sec);
+	bucket_init(&src->cost, qos->cost_per_sec);
+	return src;
+}
+
+/* Puts a source on its home's ring of sources with work, just before the
+ * cursor, so it has its turn after those already there; on an empty ring, its
+ * turn starts now. Call with the home locked. */
+static void link_active(struct work_home *h, struct work_source *src)
+{
+	src->deficit = 0; // an idle source saves nothing
+	if (!h->cursor) {
+		src->active_next = src;
+		src->active_prev = src;
+		src->deficit = (int64_t)src->qos.weight * WORK_QUANTUM;
+		h->cursor = src;
+	} else {
+		src->active_next = h->cursor;
+		src->active_prev = h->cursor->active_prev;
+		src->active_prev->active_next = src;
+		h->cursor->active_prev = src;
+	}
+	++h->nactive;
+}
+
+/* Takes a source off its home's ring. Call with the home locked. */
+static void unlink_active(struct work_home *h, struct work_source *src)
+{
+	if (src->active_next == src) {
+		h->cursor = NULL;
+	} else {
+		src->active_prev->active_next = src->active_next;
+		src->active_next->active_prev = src->active_prev;
+		if (h->cursor == src)
+			h->cursor = src->active_next;
+	}
+	--h->nactive;
+}
+
+void work_queue_set_add(struct work_queue_set *s, int home,
+			struct work_source *src)
+{
+	struct work_home *h = &s->homes[home];
+	pthread_mutex_lock(&h->mtx);
+	src->home = home;
+	src->deficit = 0;
+	src->active = 0;
+	src->next = h->first;
+	h->first = src;
+	++h->count;
+	pthread_mutex_unlock(&h->mtx);
+}
+
+void work_queue_set_remove(struct work_queue_set *s, struct work_source *src)
+{
+	struct work_home *h = &s->homes[src->home];
+	pthread_mutex_lock(&h->mtx);
+	if (src->active)
+		unlink_active(h, src);
+	struct work_source **p = &h->first;
+	while (*p != src)
+		p = &(*p)->next;
+	*p = src->next;
+	--h->count;
+	pthread_mutex_unlock(&h->mtx);
+	work_queue_destroy(&src->q);
+	free(src);
+}
+
+void work_queue_set_push(struct work_queue_set *s, struct work_source *src,
+			 struct work_item item)
+{
+	work_queue_push(&src->q, item);
+	/* pairs with a taker marking the source idle before it looks at the
+	 * queue again: either it sees the item or we see the source idle */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_exchange_n(&src->active, 1, __ATOMIC_SEQ_CST)) {
+		struct work_home *h = &s->homes[src->home];
+		pthread_mutex_lock(&h->mtx);
+		link_active(h, src);
+		pthread_mutex_unlock(&h->mtx);
+	}
+	/* pairs with the sleeper registering itself before it looks at the
+	 * queues one last time: either it sees the item or we see it */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->sleepers, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(&s->wakeups, 1, __ATOMIC_SEQ_CST);
+		rb_futex_wake_one(&s->wakeups);
+	}
+}
+
+/* Tops a bucket up for the time since it last was, to at most a tenth of a
+ * second's worth, and returns whether it has any tokens. The bucket may go
+ * into debt by a request, which is paid back before the next one goes. */
+static bool bucket_ready(struct work_bucket *b, uint64_t now)
+{
+	if (!b->rate)
+		return True;
+	double burst = b->rate / 10.0;
+	if (burst < 1)
+		burst = 1;
+	b->tokens += (double)b->rate * (now - b->last) / 1e9;
+	if (b->tokens > burst)
+		b->tokens = burst;
+	b->last = now;
+	return b->tokens > 0;
+}
+
+static void bucket_charge(struct work_bucket *b, unsigned int cost)
+{
+	if (b->rate)
+		b->tokens -= cost;
+}
+
+/* Takes a source whose queue ran dry off its home's ring. A request pushed
+ * just before it was marked idle would not have put it back, so it goes back
+ * itself if it has one. Call with the home locked. */
+static void deactivate(struct work_home *h, struct work_source *src)
+{
+	unlink_active(h, src);
+	__atomic_store_n(&src->active, 0, __ATOMIC_SEQ_CST);
+	if (work_queue_ready(&src->q) &&
+	    !__atomic_exchange_n(&src->active, 1, __ATOMIC_SEQ_CST))
+		link_active(h, src);
+}
+
+/* Takes the next request of a home's round robin, among the sources with
+ * work. The source whose turn it is keeps it until its queue runs dry or it
+ * has spent its deficit; the next one then gets another quantum for each unit
+ * of its weight. A source whose queue runs dry leaves the round robin until a
+ * request is pushed to it again. A source held back by its caps is passed over
+ * without losing what it has left. Sets `*throttled` if any source was passed
+ * over for its caps. Call with the home locked. */
+static int take_home(struct work_home *h, struct work_item *item,
+		     bool *throttled)
+{
+	struct work_source *src = h->cursor;
+	if (!src)
+		return -1;
+	uint64_t now = rb_now_ns();
+	/* a quantum always covers a request, so a source with work gets to go
+	 * by its second turn */
+	for (int i = 0; i <= 2 * h->nactive; ++i) {
+		struct work_source *next = src->active_next;
+		if (src->deficit > 0) {
+			if (!bucket_ready(&src->ops, now) ||
+			    !bucket_ready(&src->cost, now)) {
+				++src->throttled;
+				*throttled = True;
+			} else if (!work_queue_take(&src->q, item)) {
+				unsigned int cost = item->cost ? item->cost : 1;
+				src->deficit -= cost;
+				bucket_charge(&src->ops, 1);
+				bucket_charge(&src->cost, cost);
+				++src->taken;
+				h->cursor = src;
+				return 0;
+			} else {
+				deactivate(h, src);
+				if (!h->cursor)
+					return -1;
+			}
+		}
+		src = next;
+		src->deficit += (int64_t)src->qos.weight * WORK_QUANTUM;
+		if (src->deficit > (int64_t)src->qos.weight * WORK_QUANTUM)
+			src->deficit = (int64_t)src->qos.weight * WORK_QUANTUM;
+		h->cursor = src;
+	}
+	return -1;
+}
+
+/* Takes from `self`'s home, then tries each of the others in turn, skipping
+ * any whose lock is held */
+static int take_any(struct work_queue_set *s, int self, struct work_item *item,
+		    bool *throttled)
+{
+	for (int i = 0; i < s->count; ++i) {
+		struct work_home *h = &s->homes[(self + i) % s->count];
+		if (i == 0)
+			pthread_mutex_lock(&h->mtx);
+		else if (pthread_mutex_trylock(&h->mtx))
+			continue;
+		int r = take_home(h, item, throttled);
+		pthread_mutex_unlock(&h->mtx);
+		if (!r)
+			return 0;
+	}
+	return -1;
+}
+
+int work_queue_set_take(struct work_queue_set *s, int self,
+			struct work_item *item, bool wait)
+{
+	for (;;) {
+		bool throttled = False;
+		if (!take_any(s, self, item, &throttled))
+			return 0;
+		if (!wait) {
+			errno = EAGAIN;
+			return -1;
+		}
+		/* sources held back by their caps do not ring, so look again
+		 * soon if there are any */
+		struct timespec poll = { 0, throttled ? WORK_THROTTLE_POLL_NS :
+					 RB_CANCEL_POLL_NS };
+		__atomic_fetch_add(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+		uint32_t seen = __atomic_load_n(&s->wakeups, __ATOMIC_SEQ_CST);
+		int r = take_any(s, self, item, &throttled);
+		if (r)
+			rb_futex_wait(&s->wakeups, seen, &poll);
+		__atomic_fetch_sub(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+		if (!r)
+			return 0;
+		pthread_testcancel();
+	}
+}
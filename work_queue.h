@@ -0,0 +1,158 @@
+/*
+ * Queues of requests waiting for the I/O threads, and the fair-share
+ * scheduling of clients onto them.
+ *
+ * Each client has a queue of its own, its work source, and is given a home I/O
+ * thread when it registers. An I/O thread takes work from the sources homed on
+ * it by deficit round robin: each turn a source may take requests costing up
+ * to its weight times WORK_QUANTUM, so busy clients share the thread in
+ * proportion to their weights however many requests each has queued. A source
+ * may also be capped to a rate of requests and of cost per second, enforced
+ * with token buckets. An I/O thread that runs out of work steals from the
+ * other threads' sources, so a few hot clients cannot leave the other threads
+ * idle.
+ *
+ * Each queue is D. Vyukov's bounded MPMC queue: every cell carries a sequence
+ * number that tells producers when it is free and consumers when it is full,
+ * so the only contended words are the two positions, each claimed with a
+ * compare-and-swap. The round-robin state of each home is guarded by a mutex
+ * that the I/O threads take, and thieves only try. The round robin only goes
+ * through the sources that have work queued, so a dispatch costs the same
+ * however many clients are idle; a producer takes the mutex only to put a
+ * source whose queue was empty back among them. Producers only touch the
+ * shared wakeup word when an I/O thread is actually asleep.
+ */
+
+#ifndef WORK_QUEUE_H_
+#define WORK_QUEUE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "readahead.h"
+
+union fs_process_sring_entry;
+struct stlist_node;
+
+/* A request taken off a client's ring, waiting for the file server */
+struct work_item {
+	struct stlist_node *node;	// the client it came from
+	union fs_process_sring_entry *entry;
+	unsigned int pos;		// ring position, to complete the request
+	unsigned int cost;		// for its client's share
+	struct ra_plan ra;		// sectors to prefetch along with it
+};
+
+struct work_cell {
+	uint32_t seq;
+	struct work_item item;
+};
+
+struct work_queue {
+	struct work_cell *cells;
+	uint32_t mask;			// cell count - 1
+	uint32_t head __attribute__((aligned(64)));	// next to fill
+	uint32_t tail __attribute__((aligned(64)));	// next to take
+} __attribute__((aligned(64)));
+
+/* Cost a source may spend per turn for each unit of its weight. A request
+ * costs at least 1 and must not cost more than this. */
+#define WORK_QUANTUM 64
+
+/* How often an I/O thread checks on sources held back by their caps, when it
+ * has nothing else to do */
+#define WORK_THROTTLE_POLL_NS 1000000
+
+/* A client's share of the I/O threads. A rate of 0 is no cap. */
+struct work_qos {
+	int weight;
+	uint64_t ops_per_sec;
+	uint64_t cost_per_sec;
+};
+
+struct work_bucket {
+	uint64_t rate;			// per second, or 0 for no cap
+	double tokens;			// may go negative: a debt
+	uint64_t last;			// ns, when last topped up
+};
+
+/* A client's queue, and its place in the round robin of its home */
+struct work_source {
+	struct work_queue q;
+	struct work_qos qos;
+	int home;
+	int64_t deficit;		// cost it may still take this turn
+	struct work_bucket ops;
+	struct work_bucket cost;
+	uint64_t taken;			// requests taken
+	uint64_t throttled;		// turns passed over for its caps
+	struct work_source *next;	// on its home's list
+	int active;			// on its home's ring of sources with
+					// work, or being put there
+	struct work_source *active_next;
+	struct work_source *active_prev;
+};
+
+/* The sources homed on one I/O thread */
+struct work_home {
+	pthread_mutex_t mtx;		// guards all but the sources' queues
+	struct work_source *first;
+	int count;
+	struct work_source *cursor;	// on the ring of sources with work,
+					// whose turn it is, or NULL
+	int nactive;			// sources on that ring
+} __attribute__((aligned(64)));
+
+/* The homes of all the I/O threads */
+struct work_queue_set {
+	struct work_home *homes;
+	int count;
+	uint32_t wakeups __attribute__((aligned(64)));	// bumped to wake a
+							// sleeping taker
+	uint32_t sleepers;		// takers asleep, or about to be
+};
+
+/* Sets up a queue of `size` cells, which must be a power of two */
+void work_queue_init(struct work_queue *q, unsigned int size);
+
+void work_queue_destroy(struct work_queue *q);
+
+/* Adds a request, waiting for room if the queue is full */
+void work_queue_push(struct work_queue *q, struct work_item item);
+
+/* Takes the oldest request. Returns -1, with errno EAGAIN, if there is none. */
+int work_queue_take(struct work_queue *q, struct work_item *item);
+
+/* Sets up `count` homes, with no sources */
+void work_queue_set_init(struct work_queue_set *s, int count);
+
+/* Destroys the homes, and every source added to them */
+void work_queue_set_destroy(struct work_queue_set *s);
+
+/* Creates a source of `size` cells with the given share. A weight below 1 is
+ * taken as 1. */
+struct work_source *work_source_create(const struct work_qos *qos,
+				       unsigned int size);
+
+/* Adds a source to home `home`; the set owns it from then on */
+void work_queue_set_add(struct work_queue_set *s, int home,
+			struct work_source *src);
+
+/* Takes a source out of the set and frees it, with any requests still in its
+ * queue, once its client's ring is gone. Nothing may push to it since. */
+void work_queue_set_remove(struct work_queue_set *s, struct work_source *src);
+
+/* Adds a request costing `item.cost` to a source, waking a sleeping taker if
+ * there is one */
+void work_queue_set_push(struct work_queue_set *s, struct work_source *src,
+			 struct work_item item);
+
+/* Takes a request for the I/O thread of home `self`: from its own sources if
+ * any may go, or else one stolen from another home. If `wait`, sleeps until
+ * there is one, and is a cancellation point; otherwise returns -1, with errno
+ * EAGAIN, if there is none. */
+int work_queue_set_take(struct work_queue_set *s, int self,
+			struct work_item *item, bool wait);
+
+#endif /* end of include guard: WORK_QUEUE_H_ */
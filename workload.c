@@ -0,0 +1,332 @@
+/*
+ * Workload profiles. Zipfian ranks are drawn with the method of Gray et al.,
+ * "Quickly generating billion-record synthetic databases", which needs the
+ * zeta constant of the volume worked out once, when the workload is created.
+ */
+
+#include <errno.h>
+#include <math.h>
+
+#include "workload.h"
+
+#define DEFAULT_ZIPF_THETA 0.99
+#define DEFAULT_HOT_FRACTION 0.2
+#define DEFAULT_HOT_PROBABILITY 0.8
+
+enum wl_kind {
+	WL_UNIFORM,
+	WL_ZIPF,
+	WL_SEQ,
+	WL_HOTSPOT,
+	WL_TRACE
+};
+
+struct wl_part {
+	enum wl_kind kind;
+	int weight;		// up to and including this part's
+	/* zipf */
+	double theta, alpha, zetan, eta;
+	uint64_t mult, add;	// scatter rank r to (r * mult + add) % span
+	/* hotspot */
+	int hot;		// sectors in the hot set
+	double hot_probability;
+	/* trace */
+	int *trace;
+	int trace_len;
+};
+
+struct workload {
+	int span;
+	int nparts;
+	int total_weight;
+	struct wl_part parts[WL_MAX_PARTS];
+};
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+void wl_rng_seed(struct wl_rng *rng, uint64_t seed)
+{
+	/* splitmix64, so that nearby seeds give unrelated states */
+	for (int i = 0; i < 4; ++i) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		rng->s[i] = z ^ (z >> 31);
+	}
+}
+
+uint64_t wl_rng_next(struct wl_rng *rng)
+{
+	uint64_t *s = rng->s;
+	uint64_t result = rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+uint32_t wl_rng_below(struct wl_rng *rng, uint32_t n)
+{
+	/* Lemire's multiply-and-shift, retrying the few values that would make
+	 * the low numbers likelier */
+	uint64_t m = (wl_rng_next(rng) >> 32) * n;
+	if ((uint32_t)m < n) {
+		uint32_t threshold = -n % n;
+		while ((uint32_t)m < threshold)
+			m = (wl_rng_next(rng) >> 32) * n;
+	}
+	return m >> 32;
+}
+
+double wl_rng_double(struct wl_rng *rng)
+{
+	return (wl_rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+	while (b) {
+		uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static void zipf_init(struct wl_part *p, int span)
+{
+	double zeta2 = 1 + pow(0.5, p->theta);
+	p->zetan = 0;
+	for (int i = 1; i <= span; ++i)
+		p->zetan += pow(i, -p->theta);
+	p->alpha = 1 / (1 - p->theta);
+	p->eta = span > 2 ? (1 - pow(2.0 / span, 1 - p->theta)) /
+			    (1 - zeta2 / p->zetan) : 1;
+
+	/* a multiplier near span / phi, coprime with span, spreads consecutive
+	 * ranks far apart */
+	p->mult = (uint64_t)(span * 0.6180339887) | 1;
+	while (gcd(p->mult, span) != 1)
+		++p->mult;
+	p->add = span / 2;
+}
+
+static int zipf_next(const struct wl_part *p, struct wl_rng *rng, int span)
+{
+	double u = wl_rng_double(rng), uz = u * p->zetan;
+	uint64_t rank;
+	if (uz < 1)
+		rank = 0;
+	else if (uz < 1 + pow(0.5, p->theta))
+		rank = 1;
+	else
+		rank = span * pow(p->eta * u - p->eta + 1, p->alpha);
+	if (rank >= (uint64_t)span)
+		rank = span - 1;
+	return (rank * p->mult + p->add) % span;
+}
+
+/* Reads a trace, keeping its sectors modulo `span`. Returns False, having
+ * said why, if it cannot be read or lists nothing. */
+static bool load_trace(struct wl_part *p, const char *path, int span)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Error: trace %s: %s\n", path, strerror(errno));
+		return False;
+	}
+	int cap = 1024;
+	char line[256];
+	p->trace = emalloc(cap * sizeof(*p->trace));
+	p->trace_len = 0;
+	while (fgets(line, sizeof(line), f)) {
+		char *s = line + strspn(line, " \t"), *end;
+		if (*s == '#' || *s == '\n' || !*s)
+			continue;
+		long long sector = strtoll(s, &end, 0);
+		if (end == s || sector < 0) {
+			fprintf(stderr, "Error: trace %s: bad line: %s", path,
+				line);
+			fclose(f);
+			return False;
+		}
+		if (p->trace_len == cap) {
+			cap *= 2;
+			p->trace = realloc(p->trace, cap * sizeof(*p->trace));
+			if (!p->trace)
+				fail("realloc");
+		}
+		p->trace[p->trace_len++] = sector % span;
+	}
+	fclose(f);
+	if (!p->trace_len) {
+		fprintf(stderr, "Error: trace %s lists no sectors\n", path);
+		return False;
+	}
+	return True;
+}
+
+/* Reads `n` fractions from `args` (which may run out early, leaving the rest
+ * as they are) into `out`. Returns False if one is not in (0, 1). */
+static bool parse_fractions(const char *args, double *out[], int n)
+{
+	for (int i = 0; i < n && args && *args; ++i) {
+		char *end;
+		double v = strtod(args, &end);
+		if (end == args || (*end && *end != ':') || v <= 0 || v >= 1)
+			return False;
+		*out[i] = v;
+		args = *end ? end + 1 : NULL;
+	}
+	return !args || !*args;
+}
+
+static bool parse_part(struct wl_part *p, char *s, int span)
+{
+	/* a weight is whatever follows the last '@', if it is a number, so a
+	 * trace's path may have '@'s of its own */
+	int weight = 1;
+	char *at = strrchr(s, '@');
+	if (at && at[1] && strspn(at + 1, "0123456789") == strlen(at + 1)) {
+		weight = atoi(at + 1);
+		*at = '\0';
+		if (weight <= 0)
+			return False;
+	}
+	p->weight = weight;
+
+	char *args = strchr(s, ':');
+	if (args)
+		*args++ = '\0';
+	if (!strcmp(s, "uniform") && !args) {
+		p->kind = WL_UNIFORM;
+	} else if (!strcmp(s, "zipf")) {
+		p->kind = WL_ZIPF;
+		p->theta = DEFAULT_ZIPF_THETA;
+		if (!parse_fractions(args, (double *[]){ &p->theta }, 1))
+			return False;
+		zipf_init(p, span);
+	} else if (!strcmp(s, "seq") && !args) {
+		p->kind = WL_SEQ;
+	} else if (!strcmp(s, "hotspot")) {
+		double frac = DEFAULT_HOT_FRACTION;
+		p->kind = WL_HOTSPOT;
+		p->hot_probability = DEFAULT_HOT_PROBABILITY;
+		if (!parse_fractions(args, (double *[]){ &frac,
+						&p->hot_probability }, 2))
+			return False;
+		p->hot = frac * span;
+		if (p->hot < 1)
+			p->hot = 1;
+	} else if (!strcmp(s, "trace") && args && *args) {
+		p->kind = WL_TRACE;
+		if (!load_trace(p, args, span))
+			return False;
+	} else {
+		return False;
+	}
+	return True;
+}
+
+struct workload *workload_create(const char *spec, int span)
+{
+	if (span < 1)
+		return NULL;
+	struct workload *w = ecalloc(sizeof(*w));
+	char *copy = strdup(spec), *save = NULL, *s;
+	if (!copy)
+		fail("strdup");
+	w->span = span;
+	for (s = strtok_r(copy, "+", &save); s;
+	     s = strtok_r(NULL, "+", &save)) {
+		if (w->nparts == WL_MAX_PARTS) {
+			fprintf(stderr, "Error: profile %s mixes more than %d "
+				"patterns\n", spec, WL_MAX_PARTS);
+			goto bad;
+		}
+		struct wl_part *p = &w->parts[w->nparts++];
+		if (!parse_part(p, s, span)) {
+			if (p->kind != WL_TRACE)
+				fprintf(stderr, "Error: bad profile: %s\n", spec);
+			goto bad;
+		}
+		w->total_weight += p->weight;
+		p->weight = w->total_weight;
+	}
+	free(copy);
+	if (!w->nparts) {
+		fprintf(stderr, "Error: bad profile: %s\n", spec);
+		workload_destroy(w);
+		return NULL;
+	}
+	checkpoint("profile %s: %d patterns over %d sectors", spec, w->nparts,
+		   span);
+	return w;
+bad:
+	free(copy);
+	workload_destroy(w);
+	return NULL;
+}
+
+void workload_destroy(struct workload *w)
+{
+	for (int i = 0; i < w->nparts; ++i)
+		free(w->parts[i].trace);
+	free(w);
+}
+
+void workload_cursor_init(const struct workload *w, struct wl_cursor *c,
+			  int thread, int nthreads)
+{
+	for (int i = 0; i < w->nparts; ++i) {
+		const struct wl_part *p = &w->parts[i];
+		int len = p->kind == WL_TRACE ? p->trace_len : w->span;
+		c->pos[i] = (int64_t)len * thread / nthreads;
+	}
+}
+
+int workload_next(const struct workload *w, struct wl_cursor *c,
+		  struct wl_rng *rng, int count)
+{
+	int span = w->span, i = 0, sector;
+	if (count > span)
+		count = span;
+	if (w->nparts > 1) {
+		int pick = wl_rng_below(rng, w->total_weight);
+		while (pick >= w->parts[i].weight)
+			++i;
+	}
+	const struct wl_part *p = &w->parts[i];
+	switch (p->kind) {
+	case WL_ZIPF:
+		sector = zipf_next(p, rng, span);
+		break;
+	case WL_SEQ:
+		if (c->pos[i] > span - count)
+			c->pos[i] = 0;
+		sector = c->pos[i];
+		c->pos[i] += count;
+		return sector;
+	case WL_HOTSPOT:
+		if (p->hot >= span || wl_rng_double(rng) < p->hot_probability)
+			sector = wl_rng_below(rng, p->hot);
+		else
+			sector = p->hot + wl_rng_below(rng, span - p->hot);
+		break;
+	case WL_TRACE:
+		sector = p->trace[c->pos[i]];
+		if (++c->pos[i] == p->trace_len)
+			c->pos[i] = 0;
+		break;
+	default:
+		return wl_rng_below(rng, span - count + 1);
+	}
+	return sector > span - count ? span - count : sector;
+}
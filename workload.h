@@ -0,0 +1,74 @@
+/*
+ * Workload profiles for the benchmark client: which sectors its requests go
+ * to. A profile is one access pattern, or a mix of several, each picked for a
+ * request in proportion to its weight:
+ *
+ * 	uniform			every sector equally likely
+ * 	zipf[:theta]		Zipfian, with skew 0 < theta < 1 (default
+ * 				0.99); the hottest sectors are scattered over
+ * 				the volume rather than bunched at its start
+ * 	seq			sequential scans, each thread starting at its
+ * 				own point and wrapping around at the end
+ * 	hotspot[:frac[:prob]]	a hot set of the first `frac` of the volume
+ * 				(default 0.2) gets `prob` of the requests
+ * 				(default 0.8); the rest go to the cold set
+ * 	trace:path		the sectors listed in a file, one per line
+ * 				(blank lines and lines starting with '#' are
+ * 				skipped), each thread starting at its own point
+ * 				and wrapping around at the end
+ *
+ * written `name[:args][@weight]`, with several joined by '+', e.g.
+ * "zipf:0.9@70+seq@30".
+ *
+ * A workload is read-only once created, and shared by the client's threads;
+ * each thread has its own cursor and random number generator, so drawing a
+ * sector takes no lock.
+ */
+
+#ifndef WORKLOAD_H_
+#define WORKLOAD_H_
+
+#include <stdint.h>
+
+#include "common.h"
+
+/* most patterns mixed in one profile */
+#define WL_MAX_PARTS 4
+
+/* xoshiro256**: small, fast, and good enough for picking sectors */
+struct wl_rng {
+	uint64_t s[4];
+};
+
+void wl_rng_seed(struct wl_rng *rng, uint64_t seed);
+uint64_t wl_rng_next(struct wl_rng *rng);
+
+/* A number in [0, n), n > 0 */
+uint32_t wl_rng_below(struct wl_rng *rng, uint32_t n);
+
+/* A number in [0, 1) */
+double wl_rng_double(struct wl_rng *rng);
+
+/* Where a thread is in each of a workload's sequential patterns */
+struct wl_cursor {
+	int pos[WL_MAX_PARTS];
+};
+
+struct workload;
+
+/* Creates the workload `spec` describes over a volume of `span` sectors.
+ * Returns NULL, having said why on stderr, if `spec` is not a profile. */
+struct workload *workload_create(const char *spec, int span);
+
+void workload_destroy(struct workload *w);
+
+/* Sets up the cursor of thread `thread` of `nthreads` */
+void workload_cursor_init(const struct workload *w, struct wl_cursor *c,
+			  int thread, int nthreads);
+
+/* The first of `count` consecutive sectors for the next request, from 0 to
+ * span - count */
+int workload_next(const struct workload *w, struct wl_cursor *c,
+		  struct wl_rng *rng, int count);
+
+#endif /* end of include guard: WORKLOAD_H_ */
@@ -0,0 +1,539 @@
+/*
+ * Sharded write-back cache.
+ *
+ * Each shard is a fixed array of entries, on a free list or hashed by sector,
+ * with a sector of data each. Every entry in use is dirty: once the flusher
+ * has written one back it is freed, unless it was written again meanwhile,
+ * which the entry's generation tells.
+ *
+ * The flusher copies dirty sectors out in batches, so writers only wait for
+ * a shard lock while it copies, and writes each batch back sorted by sector,
+ * with one pwritev() per run of consecutive sectors. The entries of a run that
+ * fails stay in use, and after a round with a failure the flusher waits out
+ * the interval before trying again unless a barrier or shutdown asks for it.
+ */
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "write_cache.h"
+#include "sector_cache.h"
+#include "file_service.h"
+
+/* Most shards to split a cache into, and the fewest sectors worth a shard */
+#define WC_MAX_SHARDS 64
+#define WC_MIN_SHARD_SECTORS 64
+
+/* Sectors the flusher copies out and writes back at a time. A batch is
+ * written with at most this many iovecs, so it must not exceed IOV_MAX. */
+#define WC_BATCH 1024
+
+struct wc_entry {
+	int sector;
+	int hnext;			// next in the hash chain or free list
+	uint32_t gen;			// bumped by each write
+	bool used;
+};
+
+struct wc_shard {
+	pthread_mutex_t mtx;		// protects the whole shard
+	int cap;
+	int free;			// first free entry, or -1
+	int nfree;
+	struct wc_entry *e;
+	char *data;			// a sector for each entry
+	int *buckets;
+	unsigned int bucket_mask;
+	uint64_t writes;
+} __attribute__((aligned(64)));
+
+/* A sector the flusher has copied out, and where it came from */
+struct wc_ref {
+	int sector;
+	int shard;
+	int index;
+	uint32_t gen;
+	int slot;			// in the flusher's buffer
+	bool failed;			// its run could not be written
+};
+
+struct wc_waiter {
+	void (*done)(void *arg, int error);
+	void *arg;
+	struct wc_waiter *next;
+};
+
+struct write_cache {
+	int fd;
+	size_t size;			// of the file, in bytes
+	struct sector_cache *cache;
+	int shard_mask;
+	struct wc_shard *shards;
+	size_t capacity;		// in sectors
+	size_t background;		// dirty sectors that start the flusher
+	size_t limit;			// and that make writers wait
+	size_t dirty;			// sectors in use, in every shard
+	uint64_t seq;			// sectors written
+
+	pthread_mutex_t mtx;		// protects the rest
+	pthread_cond_t kick;		// wakes the flusher
+	pthread_cond_t room;		// wakes writers waiting for it
+	bool kicked;			// flusher asked for since it last began
+	bool stop;
+	struct wc_waiter *waiters;	// barriers not yet begun
+	int error;			// first since the last barrier
+	uint64_t writebacks;
+	uint64_t write_calls;
+	uint64_t barriers;
+	uint64_t throttled;
+
+	struct wc_ref *refs;		// the flusher's batch
+	char *buf;
+	pthread_t flusher;
+};
+
+static uint32_t hash_sector(int sector)
+{
+	uint32_t h = (uint32_t)sector * 2654435761u;
+	return h ^ (h >> 16);
+}
+
+static struct wc_shard *shard_of(struct write_cache *wc, int sector)
+{
+	return &wc->shards[(hash_sector(sector) >> 24) & wc->shard_mask];
+}
+
+static int hash_find(struct wc_shard *s, int sector)
+{
+	int i = s->buckets[hash_sector(sector) & s->bucket_mask];
+	while (i != -1 && s->e[i].sector != sector)
+		i = s->e[i].hnext;
+	return i;
+}
+
+static void hash_insert(struct wc_shard *s, int i)
+{
+	int *b = &s->buckets[hash_sector(s->e[i].sector) & s->bucket_mask];
+	s->e[i].hnext = *b;
+	*b = i;
+}
+
+static void hash_remove(struct wc_shard *s, int i)
+{
+	int *p = &s->buckets[hash_sector(s->e[i].sector) & s->bucket_mask];
+	while (*p != i)
+		p = &s->e[*p].hnext;
+	*p = s->e[i].hnext;
+}
+
+/* Wakes the flusher, or has it go round again if it is already running.
+ * Called with wc->mtx held. */
+static void kick_locked(struct write_cache *wc)
+{
+	wc->kicked = True;
+	pthread_cond_signal(&wc->kick);
+}
+
+static void kick(struct write_cache *wc)
+{
+	pthread_mutex_lock(&wc->mtx);
+	kick_locked(wc);
+	pthread_mutex_unlock(&wc->mtx);
+}
+
+static int ref_cmp(const void *a_, const void *b_)
+{
+	const struct wc_ref *a = a_, *b = b_;
+	return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Writes `n` copied-out sectors back to the file, then frees the entries that
+ * were not written again meanwhile, putting their data in the sector cache.
+ * The entries of a run that could not be written stay dirty, and what the file
+ * holds for them is unknown, so they are dropped from the sector cache.
+ * Returns the first error, or 0. */
+static int write_batch(struct write_cache *wc, int n)
+{
+	struct iovec iov[WC_BATCH];
+	int calls = 0, error = 0, failed = 0;
+	qsort(wc->refs, n, sizeof(*wc->refs), &ref_cmp);
+	for (int i = 0, j; i < n; i = j) {
+		off_t off = (off_t)wc->refs[i].sector * SECTOR_SIZE;
+		size_t len = 0;
+		for (j = i; j < n; ++j) {
+			if (j > i &&
+			    wc->refs[j].sector != wc->refs[j - 1].sector + 1)
+				break;
+			iov[j - i].iov_base = wc->buf +
+					      (size_t)wc->refs[j].slot * SECTOR_SIZE;
+			iov[j - i].iov_len = SECTOR_SIZE;
+			len += SECTOR_SIZE;
+		}
+		/* the last sector of the file may be short; do not grow it */
+		if (off + len > wc->size) {
+			size_t over = off + len - wc->size;
+			iov[j - i - 1].iov_len -= over;
+			len -= over;
+		}
+		ssize_t done = pwritev(wc->fd, iov, j - i, off);
+		++calls;
+		bool ok = done == len;
+		if (!ok && !error) {
+			error = done == -1 ? errno : EIO;
+			fprintf(stderr, "Error writing back sector %d: %s\n",
+				wc->refs[i].sector, strerror(error));
+		}
+		for (int k = i; k < j; ++k)
+			wc->refs[k].failed = !ok;
+		if (!ok)
+			failed += j - i;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		struct wc_ref *r = &wc->refs[i];
+		struct wc_shard *s = &wc->shards[r->shard];
+		pthread_mutex_lock(&s->mtx);
+		struct wc_entry *e = &s->e[r->index];
+		if (r->failed) {
+			if (wc->cache)
+				sector_cache_invalidate(wc->cache, r->sector);
+		} else if (e->used && e->sector == r->sector &&
+			   e->gen == r->gen) {
+			if (wc->cache)
+				sector_cache_insert(wc->cache, r->sector,
+						    wc->buf + (size_t)r->slot *
+						    SECTOR_SIZE);
+			hash_remove(s, r->index);
+			e->used = False;
+			e->hnext = s->free;
+			s->free = r->index;
+			++s->nfree;
+			__atomic_sub_fetch(&wc->dirty, 1, __ATOMIC_SEQ_CST);
+		}
+		pthread_mutex_unlock(&s->mtx);
+	}
+
+	pthread_mutex_lock(&wc->mtx);
+	wc->writebacks += n - failed;
+	wc->write_calls += calls;
+	if (error && !wc->error)
+		wc->error = error;
+	pthread_cond_broadcast(&wc->room);
+	pthread_mutex_unlock(&wc->mtx);
+	return error;
+}
+
+/* Writes back every sector that is dirty when its shard is reached. Returns
+ * the first error, or 0. */
+static int write_back(struct write_cache *wc)
+{
+	int n = 0, error = 0, e;
+	for (int k = 0; k <= wc->shard_mask; ++k) {
+		struct wc_shard *s = &wc->shards[k];
+		pthread_mutex_lock(&s->mtx);
+		for (int i = 0; i < s->cap; ++i) {
+			if (!s->e[i].used)
+				continue;
+			if (n == WC_BATCH) {
+				pthread_mutex_unlock(&s->mtx);
+				if ((e = write_batch(wc, n)) && !error)
+					error = e;
+				n = 0;
+				pthread_mutex_lock(&s->mtx);
+				if (!s->e[i].used)
+					continue;
+			}
+			struct wc_ref *r = &wc->refs[n];
+			r->sector = s->e[i].sector;
+			r->shard = k;
+			r->index = i;
+			r->gen = s->e[i].gen;
+			r->slot = n;
+			memcpy(wc->buf + (size_t)n * SECTOR_SIZE,
+			       s->data + (size_t)i * SECTOR_SIZE, SECTOR_SIZE);
+			++n;
+		}
+		pthread_mutex_unlock(&s->mtx);
+	}
+	if (n && (e = write_batch(wc, n)) && !error)
+		error = e;
+	return error;
+}
+
+/* Whether the flusher should start a round now. After a round that failed,
+ * only barriers and shutdown count, so a failing file is not retried in a
+ * tight loop. Called with wc->mtx held. */
+static bool flush_due(struct write_cache *wc, bool failing)
+{
+	if (wc->stop || wc->waiters)
+		return True;
+	return !failing && (wc->kicked ||
+			    __atomic_load_n(&wc->dirty, __ATOMIC_SEQ_CST) >=
+			    wc->background);
+}
+
+/* Flusher thread. Sleeps until it is kicked, the cache is dirty enough or
+ * WC_FLUSH_INTERVAL_MS have passed, then writes back everything dirty. Each
+ * round answers the barriers asked for before it began, once it has synced
+ * the file. */
+static void *flusher(void *arg)
+{
+	struct write_cache *wc = arg;
+	bool failing = False;
+	pthread_mutex_lock(&wc->mtx);
+	for (;;) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += WC_FLUSH_INTERVAL_MS / 1000;
+		until.tv_nsec += WC_FLUSH_INTERVAL_MS % 1000 * 1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_nsec -= 1000000000;
+			++until.tv_sec;
+		}
+		while (!flush_due(wc, failing) &&
+		       pthread_cond_timedwait(&wc->kick, &wc->mtx, &until) !=
+		       ETIMEDOUT)
+			;
+		bool stop = wc->stop;
+		struct wc_waiter *waiters = wc->waiters;
+		wc->waiters = NULL;
+		wc->kicked = False;
+		pthread_mutex_unlock(&wc->mtx);
+
+		failing = __atomic_load_n(&wc->dirty, __ATOMIC_SEQ_CST) &&
+			  write_back(wc);
+		int error = 0;
+		if ((waiters || stop) && fdatasync(wc->fd))
+			error = errno;
+
+		pthread_mutex_lock(&wc->mtx);
+		if (waiters) {
+			if (!error)
+				error = wc->error;
+			wc->error = 0;
+		}
+		pthread_mutex_unlock(&wc->mtx);
+		while (waiters) {
+			struct wc_waiter *w = waiters;
+			waiters = w->next;
+			w->done(w->arg, error);
+			free(w);
+		}
+		pthread_mutex_lock(&wc->mtx);
+		/* a writer that found no room just before this round freed
+		 * some is waiting for the kick it gave */
+		pthread_cond_broadcast(&wc->room);
+		if (stop && !wc->waiters)
+			break;
+	}
+	pthread_mutex_unlock(&wc->mtx);
+	return NULL;
+}
+
+static void shard_init(struct wc_shard *s, int cap)
+{
+	pthread_mutex_init(&s->mtx, NULL);
+	s->cap = cap;
+	s->e = emalloc(cap * sizeof(*s->e));
+	s->data = emalloc((size_t)cap * SECTOR_SIZE);
+	s->free = -1;
+	for (int i = cap - 1; i >= 0; --i) {
+		s->e[i].used = False;
+		s->e[i].hnext = s->free;
+		s->free = i;
+	}
+	s->nfree = cap;
+	s->writes = 0;
+
+	unsigned int nbuckets = 1;
+	while (nbuckets < cap)
+		nbuckets <<= 1;
+	s->bucket_mask = nbuckets - 1;
+	s->buckets = emalloc(nbuckets * sizeof(*s->buckets));
+	for (int i = 0; i < nbuckets; ++i)
+		s->buckets[i] = -1;
+}
+
+struct write_cache *write_cache_create(int fd, size_t size, size_t bytes,
+				       int background_ratio, int dirty_ratio,
+				       struct sector_cache *cache)
+{
+	size_t total = bytes / SECTOR_SIZE;
+	if (!total)
+		return NULL;
+
+	int nshards = 1;
+	while (nshards * 2 <= WC_MAX_SHARDS &&
+	       total / (nshards * 2) >= WC_MIN_SHARD_SECTORS)
+		nshards *= 2;
+
+	struct write_cache *wc = ecalloc(sizeof(*wc));
+	wc->fd = fd;
+	wc->size = size;
+	wc->cache = cache;
+	wc->shard_mask = nshards - 1;
+	if (posix_memalign((void **)&wc->shards, 64,
+			   nshards * sizeof(*wc->shards)))
+		fail("posix_memalign");
+	for (int i = 0; i < nshards; ++i)
+		shard_init(&wc->shards[i], total / nshards +
+			   (i < total % nshards));
+	wc->capacity = total;
+	wc->background = total * background_ratio / 100;
+	if (wc->background < 1)
+		wc->background = 1;
+	wc->limit = total * dirty_ratio / 100;
+	if (wc->limit < 1)
+		wc->limit = 1;
+
+	pthread_mutex_init(&wc->mtx, NULL);
+	pthread_cond_init(&wc->kick, NULL);
+	pthread_cond_init(&wc->room, NULL);
+	wc->refs = emalloc(WC_BATCH * sizeof(*wc->refs));
+	wc->buf = emalloc(WC_BATCH * SECTOR_SIZE);
+	if ((errno = pthread_create(&wc->flusher, NULL, &flusher, wc)))
+		fail_en("pthread_create");
+	return wc;
+}
+
+void write_cache_destroy(struct write_cache *wc)
+{
+	pthread_mutex_lock(&wc->mtx);
+	wc->stop = True;
+	kick_locked(wc);
+	pthread_mutex_unlock(&wc->mtx);
+	pthread_join(wc->flusher, NULL);
+	if (wc->dirty)
+		fprintf(stderr, "%zu written sectors could not be written back\n",
+			wc->dirty);
+
+	for (int i = 0; i <= wc->shard_mask; ++i) {
+		struct wc_shard *s = &wc->shards[i];
+		pthread_mutex_destroy(&s->mtx);
+		free(s->e);
+		free(s->data);
+		free(s->buckets);
+	}
+	pthread_mutex_destroy(&wc->mtx);
+	pthread_cond_destroy(&wc->kick);
+	pthread_cond_destroy(&wc->room);
+	free(wc->shards);
+	free(wc->refs);
+	free(wc->buf);
+	free(wc);
+}
+
+static void unlock_mutex(void *mtx)
+{
+	pthread_mutex_unlock(mtx);
+}
+
+void write_cache_wait(struct write_cache *wc)
+{
+	pthread_mutex_lock(&wc->mtx);
+	pthread_cleanup_push(&unlock_mutex, &wc->mtx);
+	++wc->throttled;
+	kick_locked(wc);
+	pthread_cond_wait(&wc->room, &wc->mtx);
+	pthread_cleanup_pop(1);
+}
+
+bool write_cache_try_write(struct write_cache *wc, int sector, const char *buf)
+{
+	struct wc_shard *s = shard_of(wc, sector);
+	pthread_mutex_lock(&s->mtx);
+	int i = hash_find(s, sector);
+	if (i == -1 &&
+	    (!s->nfree ||
+	     __atomic_load_n(&wc->dirty, __ATOMIC_SEQ_CST) >= wc->limit)) {
+		pthread_mutex_unlock(&s->mtx);
+		return False;
+	}
+	bool crossed = False;
+	if (i == -1) {
+		i = s->free;
+		s->free = s->e[i].hnext;
+		--s->nfree;
+		s->e[i].sector = sector;
+		s->e[i].gen = 0;
+		s->e[i].used = True;
+		hash_insert(s, i);
+		crossed = __atomic_add_fetch(&wc->dirty, 1, __ATOMIC_SEQ_CST) ==
+			  wc->background;
+	} else {
+		++s->e[i].gen;
+	}
+	memcpy(s->data + (size_t)i * SECTOR_SIZE, buf, SECTOR_SIZE);
+	++s->writes;
+	pthread_mutex_unlock(&s->mtx);
+	__atomic_add_fetch(&wc->seq, 1, __ATOMIC_SEQ_CST);
+	if (crossed)
+		kick(wc);
+	return True;
+}
+
+void write_cache_write(struct write_cache *wc, int sector, const char *buf)
+{
+	while (!write_cache_try_write(wc, sector, buf))
+		write_cache_wait(wc);
+}
+
+uint64_t write_cache_snapshot(struct write_cache *wc, int sector, int count,
+			      char *buf)
+{
+	if (!__atomic_load_n(&wc->dirty, __ATOMIC_SEQ_CST))
+		return 0;
+	uint64_t mask = 0;
+	for (int k = 0; k < count; ++k) {
+		struct wc_shard *s = shard_of(wc, sector + k);
+		pthread_mutex_lock(&s->mtx);
+		int i = hash_find(s, sector + k);
+		if (i != -1) {
+			memcpy(buf + (size_t)k * SECTOR_SIZE,
+			       s->data + (size_t)i * SECTOR_SIZE, SECTOR_SIZE);
+			mask |= 1ull << k;
+		}
+		pthread_mutex_unlock(&s->mtx);
+	}
+	return mask;
+}
+
+uint64_t write_cache_seq(struct write_cache *wc)
+{
+	return __atomic_load_n(&wc->seq, __ATOMIC_SEQ_CST);
+}
+
+void write_cache_barrier(struct write_cache *wc,
+			 void (*done)(void *arg, int error), void *arg)
+{
+	struct wc_waiter *w = emalloc(sizeof(*w));
+	w->done = done;
+	w->arg = arg;
+	pthread_mutex_lock(&wc->mtx);
+	w->next = wc->waiters;
+	wc->waiters = w;
+	++wc->barriers;
+	kick_locked(wc);
+	pthread_mutex_unlock(&wc->mtx);
+}
+
+void write_cache_stats(struct write_cache *wc, struct write_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i <= wc->shard_mask; ++i) {
+		struct wc_shard *s = &wc->shards[i];
+		pthread_mutex_lock(&s->mtx);
+		stats->writes += s->writes;
+		pthread_mutex_unlock(&s->mtx);
+	}
+	pthread_mutex_lock(&wc->mtx);
+	stats->writebacks = wc->writebacks;
+	stats->write_calls = wc->write_calls;
+	stats->barriers = wc->barriers;
+	stats->throttled = wc->throttled;
+	pthread_mutex_unlock(&wc->mtx);
+	stats->dirty = __atomic_load_n(&wc->dirty, __ATOMIC_SEQ_CST);
+	stats->capacity = wc->capacity;
+}
@@ -0,0 +1,90 @@
+/*
+ * Write-back cache of the sectors clients have written. A write is answered
+ * as soon as its sectors are in the cache; a flusher thread writes dirty
+ * sectors back to the file in sector order, in the background once the cache
+ * is `background_ratio` percent dirty or has held dirty sectors for a while,
+ * and writers wait for it once it is `dirty_ratio` percent dirty.
+ *
+ * Like the sector cache, it is split into shards by a hash of the sector
+ * number, each with its own lock. A sector leaves it only once it is on the
+ * file, so readers look here first: a sector that is not here is as new on
+ * the file as anywhere.
+ *
+ * A barrier is answered once every sector written before it was asked for is
+ * on the file and has been synced. A sector that cannot be written back stays
+ * dirty, and is tried again every WC_FLUSH_INTERVAL_MS; the error goes to the
+ * barriers answered meanwhile.
+ */
+
+#ifndef WRITE_CACHE_H_
+#define WRITE_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+
+struct sector_cache;
+
+/* Defaults for the dirty ratios, in percent of the cache's capacity */
+#define WC_DEFAULT_BACKGROUND_RATIO 10
+#define WC_DEFAULT_DIRTY_RATIO 50
+
+/* Longest a dirty sector waits before the flusher writes it back, in ms */
+#define WC_FLUSH_INTERVAL_MS 1000
+
+struct write_cache_stats {
+	uint64_t writes;		// sectors written by clients
+	uint64_t writebacks;		// sectors written to the file
+	uint64_t write_calls;		// and the pwritev()s that took
+	uint64_t barriers;
+	uint64_t throttled;		// times a writer waited for room
+	size_t dirty;			// sectors in the cache now
+	size_t capacity;
+};
+
+struct write_cache;
+
+/* Creates a cache for `fd`, a file of `size` bytes, holding as many sectors as
+ * fit in `bytes`, and starts its flusher. Sectors written back are put in
+ * `cache`, if it is not NULL, so they can still be read from memory. Returns
+ * NULL if that is not even one sector. */
+struct write_cache *write_cache_create(int fd, size_t size, size_t bytes,
+				       int background_ratio, int dirty_ratio,
+				       struct sector_cache *cache);
+
+/* Writes back everything, syncs the file and answers any barriers still
+ * waiting, then stops the flusher and frees the cache */
+void write_cache_destroy(struct write_cache *wc);
+
+/* Puts a sector (SECTOR_SIZE bytes) in the cache, waiting first while the
+ * cache is too dirty */
+void write_cache_write(struct write_cache *wc, int sector, const char *buf);
+
+/* Puts a sector in the cache if it has room for it. Returns False, having
+ * done nothing, if the cache is too dirty. */
+bool write_cache_try_write(struct write_cache *wc, int sector, const char *buf);
+
+/* Waits until the flusher has written back some sectors, for a writer whose
+ * write_cache_try_write() found no room. A cancellation point. */
+void write_cache_wait(struct write_cache *wc);
+
+/* Copies the cached ones of the `count` (at most 64) sectors from `sector` on
+ * into their places in `buf`. Returns a mask of the sectors copied, with bit
+ * i for sector + i. */
+uint64_t write_cache_snapshot(struct write_cache *wc, int sector, int count,
+			      char *buf);
+
+/* Counts the sectors written so far. A read that saw the same count when it
+ * started and when it finished raced with no write. */
+uint64_t write_cache_seq(struct write_cache *wc);
+
+/* Has `done(arg, error)` called from the flusher once every sector written
+ * before now is on the file and synced. `error` is 0, or an errno value from
+ * writing back or syncing since the last barrier. */
+void write_cache_barrier(struct write_cache *wc,
+			 void (*done)(void *arg, int error), void *arg);
+
+void write_cache_stats(struct write_cache *wc, struct write_cache_stats *stats);
+
+#endif /* end of include guard: WRITE_CACHE_H_ */